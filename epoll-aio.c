@@ -0,0 +1,209 @@
+/* Kernel Queue The Complete Guide: epoll-aio.c: Streaming a file with Linux AIO
+The whole file is read with up to DEPTH O_DIRECT requests in flight (kq-aio.h).
+With -o the data is also written to the output file: each buffer is written as soon as it's read
+ and then it's reused for the next read.
+If a file system doesn't support O_DIRECT, the operations with this file are performed by worker threads (kq-offload.h):
+ otherwise io_submit() would block the loop until the data is read from disk.
+The output file is fsync()-ed by a worker thread too.
+Usage:
+	$ ./epoll-aio [-d DEPTH] [-s BLOCK_KB] [-t THREADS] [-o OUTPUT] [-b BACKEND] FILE
+Options:
+	-t THREADS  worker threads for the operations which AIO can't perform (default: 4); 0: perform them synchronously
+*/
+#define _GNU_SOURCE
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "kq-aio.h"
+
+struct kq_loop loop;
+struct kq_aio aio;
+struct kq_offload pool;
+int fd, out_fd = -1;
+int buffered, out_buffered; // the file isn't opened with O_DIRECT
+struct kq_fop fsync_op;
+uint64_t size, next_off, total;
+unsigned block, active;
+
+struct stream_req {
+	struct kq_aio_req req;
+	void *buf;
+	uint64_t off;
+	size_t len; // bytes read
+};
+
+void stream_read_done(struct kq_aio_req *r);
+void stream_write_done(struct kq_aio_req *r);
+
+void stream_synced(struct kq_fop *f)
+{
+	if (f->result < 0) {
+		errno = f->error;
+		perror("fsync");
+		exit(1);
+	}
+	kq_stop(&loop);
+}
+
+// read the next block with this request, or finish
+void stream_next(struct stream_req *s)
+{
+	if (next_off >= size) {
+		kq_aio_buf_free(&aio, s->buf);
+		if (--active == 0) {
+			if (out_fd != -1 && aio.pool != NULL) {
+				fsync_op.handler = stream_synced;
+				kq_offload_fsync(&pool, &loop, &fsync_op, out_fd);
+				return;
+			}
+			kq_stop(&loop);
+		}
+		return;
+	}
+	s->off = next_off;
+	next_off += block;
+	s->req.handler = stream_read_done;
+	s->req.offload = buffered;
+	assert(0 == kq_aio_read(&aio, &s->req, fd, s->buf, block, s->off));
+}
+
+void stream_read_done(struct kq_aio_req *r)
+{
+	struct stream_req *s = (void*)r;
+	if (r->result < 0) {
+		errno = r->error;
+		perror("read");
+		exit(1);
+	}
+	s->len = r->result;
+	total += s->len;
+
+	if (out_fd != -1 && s->len != 0) {
+		// O_DIRECT: the size must be aligned; the output file is truncated to the actual size in the end
+		size_t n = (s->len + KQ_AIO_ALIGN-1) & ~(size_t)(KQ_AIO_ALIGN-1);
+		memset((char*)s->buf + s->len, 0, n - s->len);
+		r->handler = stream_write_done;
+		r->offload = out_buffered;
+		assert(0 == kq_aio_write(&aio, r, out_fd, s->buf, n, s->off));
+		return;
+	}
+	stream_next(s);
+}
+
+void stream_write_done(struct kq_aio_req *r)
+{
+	struct stream_req *s = (void*)r;
+	if (r->result < 0) {
+		errno = r->error;
+		perror("write");
+		exit(1);
+	}
+	stream_next(s);
+}
+
+// open with O_DIRECT if the file system supports it
+int file_open(const char *name, int flags, int *no_direct)
+{
+	int f = open(name, flags | O_DIRECT | O_CLOEXEC, 0644);
+	*no_direct = 0;
+	if (f == -1 && errno == EINVAL) {
+		fprintf(stderr, "%s: O_DIRECT isn't supported\n", name);
+		*no_direct = 1;
+		f = open(name, flags | O_CLOEXEC, 0644);
+	}
+	if (f == -1) {
+		perror(name);
+		exit(1);
+	}
+	return f;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned depth = 32, backend = 0, nthreads = 4;
+	const char *out_name = NULL;
+	block = 128*1024;
+	int opt;
+	while (-1 != (opt = getopt(argc, argv, "d:s:t:o:b:"))) {
+		switch (opt) {
+		case 'd':
+			depth = atoi(optarg); break;
+		case 's':
+			block = atoi(optarg) * 1024; break;
+		case 't':
+			nthreads = atoi(optarg); break;
+		case 'o':
+			out_name = optarg; break;
+		case 'b':
+			if (0 == (backend = kq_backend_by_name(optarg))) {
+				fprintf(stderr, "Unsupported backend: %s\n", optarg);
+				return 1;
+			}
+			break;
+		default:
+			optind = argc;
+		}
+	}
+	if (optind != argc - 1 || depth == 0 || block == 0 || block % KQ_AIO_ALIGN) {
+		fprintf(stderr, "Usage: %s [-d DEPTH] [-s BLOCK_KB] [-t THREADS] [-o OUTPUT] [-b BACKEND] FILE\n", argv[0]);
+		return 1;
+	}
+
+	fd = file_open(argv[optind], O_RDONLY, &buffered);
+	struct stat st;
+	assert(0 == fstat(fd, &st));
+	size = st.st_size;
+	if (out_name != NULL)
+		out_fd = file_open(out_name, O_WRONLY | O_CREAT | O_TRUNC, &out_buffered);
+
+	assert(0 == kq_create_backend(&loop, backend, 0));
+	assert(0 == kq_aio_create(&aio, &loop, depth, block));
+	struct kq_post q;
+	if (nthreads != 0) {
+		// the workers post completions to the loop's task queue
+		assert(0 == kq_post_enable(&loop, &q));
+		assert(0 == kq_offload_create(&pool, nthreads));
+		aio.pool = &pool;
+	}
+
+	// fill the queue: all requests are submitted with one io_submit() call
+	unsigned long long start = kq_now_ms();
+	struct stream_req *reqs = calloc(depth, sizeof(struct stream_req));
+	assert(reqs != NULL);
+	for (unsigned i = 0;  i != depth && next_off < size;  i++) {
+		reqs[i].buf = kq_aio_buf(&aio);
+		assert(reqs[i].buf != NULL);
+		active++;
+		stream_next(&reqs[i]);
+	}
+	kq_aio_submit(&aio);
+
+	if (active == 0)
+		kq_stop(&loop); // empty file, or all operations were performed synchronously
+	assert(0 == kq_run(&loop));
+	unsigned long long ms = kq_now_ms() - start;
+
+	if (out_fd != -1)
+		assert(0 == ftruncate(out_fd, size));
+	assert(total == size);
+
+	printf("%s: %llu bytes in %llums: %.1fMB/s\n"
+		, argv[optind], (unsigned long long)total, ms, (double)total / (ms ? ms : 1) / 1000);
+	printf("operations: %llu, io_submit() calls: %llu, eventfd signals: %llu, worker threads: %llu, synchronous: %llu\n"
+		, aio.nops, aio.nsubmits, aio.nwakeups, aio.noffload, aio.nsync);
+
+	if (nthreads != 0) {
+		kq_offload_close(&pool);
+		kq_post_disable(&loop);
+	}
+	kq_aio_close(&aio);
+	kq_close(&loop);
+	free(reqs);
+	close(fd);
+	if (out_fd != -1)
+		close(out_fd);
+	return 0;
+}
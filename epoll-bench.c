@@ -0,0 +1,505 @@
+/* Kernel Queue The Complete Guide: epoll-bench.c: Load generator with latency percentiles
+Each thread runs its own loop with its own client (kq-client.h) and its own connections to the server.
+Closed loop (default): CONCURRENCY requests are in flight, and the next one is sent as soon as a response arrives.
+ It finds the max. throughput, but while the server stalls no new requests are sent,
+ so the stall affects only a few measurements (coordinated omission).
+Open loop (-r RATE): the requests are sent at a fixed rate whether the responses arrive or not:
+ each millisecond every thread sends its share, and the latency is measured from the time
+ the request was scheduled for, so the queueing behind a stall shows in the percentiles.
+Each thread records the latency to its own histogram (kq-hist.h); they are merged for the report.
+Only the responses received during DURATION after WARMUP are counted.
+
+System calls per request are counted by the kernel (the raw_syscalls:sys_enter tracepoint, perf_event_open())
+ for the generator's threads and, with -P, for the server's threads.
+It needs tracefs and the permission to use perf events:
+	# mount -t tracefs nodev /sys/kernel/tracing;  sysctl kernel.perf_event_paranoid=-1
+Usage:
+	$ ./epoll-server -p
+	$ ./epoll-bench [-b BACKEND] [-t THREADS] [-c CONNS] [-k CONCURRENCY | -r RATE] [-p PIPELINE] [-d DURATION] [-w WARMUP] [-e SIZE] [-P PID] [IP:PORT]
+	$ ./epoll-echo -p  &&  ./epoll-bench -e 64
+Options:
+	-b BACKEND      epoll (default), io_uring, poll
+	-t THREADS      number of generator threads (default: 1)
+	-c CONNS        max. connections per thread (default: 16)
+	-k CONCURRENCY  closed loop: requests in flight in total (default: 64)
+	-r RATE         open loop: requests per second in total
+	-p PIPELINE     max. requests in flight per connection (default: 1)
+	-d DURATION     measure for DURATION seconds (default: 10)
+	-w WARMUP       don't measure for the first WARMUP seconds (default: 2)
+	-e SIZE         send SIZE-byte messages to an echo server (epoll-echo) instead of HTTP requests (epoll-server)
+	-P PID          count the system calls of the server process too
+	IP:PORT         destination (default: 127.0.0.1:64000)
+*/
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <assert.h>
+#include <dirent.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include "kq-client.h"
+#include "kq-hist.h"
+
+enum {
+	CALLS_CHUNK = 1024,
+	CALLS_MAX = 64 * CALLS_CHUNK, // open loop: requests in flight per thread
+	GRACE_MS = 1000, // wait for the responses after DURATION
+	PACE_MIN_US = 50, // open loop: send the requests in batches at least this far apart
+};
+
+struct worker;
+
+struct call {
+	struct kq_request req;
+	struct worker *w;
+	unsigned long long start; // usec: when the request was (scheduled to be) sent
+	struct call *next; // in the free list
+};
+
+struct worker {
+	pthread_t thread;
+	int perf_fd; // system call counter
+	struct kq_loop loop;
+	struct kq_client client;
+	struct kq_client_pool *pool;
+	struct kq_timer tick; // closed loop: restarts the failed requests;  the end of the test
+	struct context pace; // open loop: timerfd
+	struct call *chunks[CALLS_MAX / CALLS_CHUNK];
+	unsigned nchunks;
+	struct call *free; // not in flight
+	unsigned inflight;
+	unsigned concurrency; // closed loop
+	unsigned long long rate; // open loop: requests per second
+	unsigned long long scheduled; // open loop: requests scheduled since the start
+	unsigned long long completed, errors, dropped; // during the measurement
+	int error; // the first error
+	struct kq_hist hist;
+};
+
+unsigned backend, nworkers = 1, pipeline = 1, conns = 16, concurrency = 64;
+unsigned long long rate;
+unsigned duration_s = 10, warmup_s = 2;
+size_t echo_size;
+struct sockaddr_in dest;
+char *req_data;
+size_t req_len;
+unsigned long long t_start, t_warm, t_end; // usec
+pthread_barrier_t barrier;
+
+// find the end of an HTTP/1 response with Content-Length
+int http_parse(struct kq_request *r, const char *data, size_t len)
+{
+	const char *end = memmem(data, len, "\r\n\r\n", 4);
+	if (end == NULL)
+		return 0; // wait for the complete header
+	size_t hdr_len = end + 4 - data;
+
+	long long body_len = -1;
+	const char *line = memmem(data, hdr_len, "\r\n", 2) + 2;
+	while (line < end) {
+		const char *eol = memmem(line, end + 2 - line, "\r\n", 2);
+		if (eol - line > 15 && !strncasecmp(line, "Content-Length:", 15))
+			body_len = strtoll(line + 15, NULL, 10);
+		else if (eol - line >= 17 && !strncasecmp(line, "Connection: close", 17))
+			r->close = 1;
+		line = eol + 2;
+	}
+	if (body_len < 0)
+		return -1; // chunked encoding isn't supported
+	if (hdr_len + body_len > len)
+		return 0;
+	return hdr_len + body_len;
+}
+
+// the echo server returns the message as is
+int echo_parse(struct kq_request *r, const char *data, size_t len)
+{
+	return (len >= echo_size) ? (int)echo_size : 0;
+}
+
+// open a counter of the system calls made by the thread (0: the calling thread);  -1: not supported
+int syscall_counter(pid_t tid)
+{
+	static long long id = -1;
+	if (id == -1) {
+		const char *paths[] = { "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id"
+			, "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id" };
+		for (unsigned i = 0;  i != 2 && id == -1;  i++) {
+			FILE *f = fopen(paths[i], "r");
+			if (f == NULL)
+				continue;
+			if (1 != fscanf(f, "%lld", &id))
+				id = -1;
+			fclose(f);
+		}
+		if (id == -1)
+			return -1;
+	}
+	struct perf_event_attr a = {};
+	a.type = PERF_TYPE_TRACEPOINT;
+	a.size = sizeof(a);
+	a.config = id;
+	return syscall(SYS_perf_event_open, &a, tid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+// the total value of the counters;  -1: some of them aren't available
+long long counters_read(const int *fds, unsigned n)
+{
+	long long total = 0;
+	for (unsigned i = 0;  i != n;  i++) {
+		unsigned long long v;
+		if (fds[i] == -1 || sizeof(v) != read(fds[i], &v, sizeof(v)))
+			return -1;
+		total += v;
+	}
+	return (n != 0) ? total : -1;
+}
+
+// open a system call counter for each thread of the process
+unsigned server_counters(pid_t pid, int *fds, unsigned max)
+{
+	char fn[64];
+	snprintf(fn, sizeof(fn), "/proc/%d/task", (int)pid);
+	DIR *d = opendir(fn);
+	if (d == NULL)
+		return 0;
+	unsigned n = 0;
+	struct dirent *de;
+	while (n != max && NULL != (de = readdir(d))) {
+		if (de->d_name[0] != '.')
+			fds[n++] = syscall_counter(atoi(de->d_name));
+	}
+	closedir(d);
+	return n;
+}
+
+void call_complete(struct kq_request *r, const char *resp, size_t len);
+
+void call_send(struct worker *w, struct call *c, unsigned long long start)
+{
+	memset(&c->req, 0, sizeof(c->req));
+	c->req.data = req_data;
+	c->req.len = req_len;
+	c->req.parse = (echo_size != 0) ? echo_parse : http_parse;
+	c->req.on_complete = call_complete;
+	c->req.udata = c;
+	c->req.idempotent = 1;
+	c->w = w;
+	c->start = start;
+	w->inflight++;
+	kq_client_request(w->pool, &c->req);
+}
+
+void call_complete(struct kq_request *r, const char *resp, size_t len)
+{
+	struct call *c = r->udata;
+	struct worker *w = c->w;
+	unsigned long long now = kq_now_us();
+	w->inflight--;
+	if (now >= t_warm && now < t_end) {
+		if (r->error == 0) {
+			w->completed++;
+			kq_hist_add(&w->hist, now - c->start);
+		} else {
+			w->errors++;
+		}
+	}
+	if (r->error != 0 && w->error == 0)
+		w->error = r->error;
+
+	if (rate == 0 && r->error == 0 && now < t_end) {
+		call_send(w, c, now); // closed loop: the next request
+		return;
+	}
+	// a failed request is sent again by the timer: the connection may fail right away
+	c->next = w->free;
+	w->free = c;
+	if (now >= t_end && w->inflight == 0)
+		kq_stop(&w->loop);
+}
+
+struct call* call_alloc(struct worker *w)
+{
+	if (w->free == NULL) {
+		if (w->nchunks == CALLS_MAX / CALLS_CHUNK)
+			return NULL;
+		struct call *chunk = calloc(CALLS_CHUNK, sizeof(struct call));
+		if (chunk == NULL)
+			return NULL;
+		w->chunks[w->nchunks++] = chunk;
+		for (unsigned i = 0;  i != CALLS_CHUNK;  i++) {
+			chunk[i].next = w->free;
+			w->free = &chunk[i];
+		}
+	}
+	struct call *c = w->free;
+	w->free = c->next;
+	return c;
+}
+
+void worker_tick(struct kq_timer *t)
+{
+	struct worker *w = (void*)((char*)t - offsetof(struct worker, tick));
+	unsigned long long now = kq_now_us();
+	if (now >= t_end) {
+		if (w->inflight == 0 || now >= t_end + GRACE_MS * 1000)
+			kq_stop(&w->loop); // the requests still in flight are abandoned
+		else
+			kq_timer_add(&w->loop, &w->tick, 10);
+		return;
+	}
+
+	// closed loop: keep CONCURRENCY requests in flight.
+	// A request may fail inside call_send(): it's sent again by the next tick
+	for (unsigned n = w->concurrency - w->inflight;  rate == 0 && n != 0;  n--) {
+		struct call *c = call_alloc(w);
+		if (c == NULL)
+			break;
+		call_send(w, c, now);
+	}
+	kq_timer_add(&w->loop, &w->tick, 10);
+}
+
+// open loop: send the requests scheduled until now.
+// The loop's timers have 1ms resolution, so the requests are paced by timerfd
+void worker_pace(struct context *obj)
+{
+	struct worker *w = (void*)((char*)obj - offsetof(struct worker, pace));
+	unsigned long long expirations;
+	if (sizeof(expirations) != read(obj->fd, &expirations, sizeof(expirations)))
+		return;
+	unsigned long long now = kq_now_us();
+	for (;;) {
+		unsigned long long sched = t_start + w->scheduled * 1000000 / w->rate;
+		if (sched > now || sched >= t_end)
+			break;
+		w->scheduled++;
+		struct call *c = call_alloc(w);
+		if (c == NULL) {
+			if (sched >= t_warm)
+				w->dropped++;
+			continue;
+		}
+		call_send(w, c, sched); // the delay before sending counts as latency too
+	}
+}
+
+// start the pacing timer at t_start
+int worker_pace_start(struct worker *w)
+{
+	w->pace.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (w->pace.fd == -1)
+		return -1;
+	unsigned long long interval = 1000000 / w->rate;
+	if (interval < PACE_MIN_US)
+		interval = PACE_MIN_US;
+	struct itimerspec its = {};
+	its.it_value.tv_sec = t_start / 1000000;
+	its.it_value.tv_nsec = t_start % 1000000 * 1000;
+	its.it_interval.tv_sec = interval / 1000000;
+	its.it_interval.tv_nsec = interval % 1000000 * 1000;
+	w->pace.rhandler = worker_pace;
+	if (0 != timerfd_settime(w->pace.fd, TFD_TIMER_ABSTIME, &its, NULL)
+		|| 0 != kq_attach_listener(&w->loop, &w->pace, 0)) {
+		close(w->pace.fd);
+		w->pace.fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+void* worker_main(void *param)
+{
+	struct worker *w = param;
+	struct kq_client_conf conf = {};
+	conf.max_conns = conns;
+	conf.max_pipeline = pipeline;
+	conf.connect_timeout_ms = conf.response_timeout_ms = 5000;
+	conf.idle_timeout_ms = 60*1000;
+	assert(0 == kq_create_backend(&w->loop, backend, 0));
+	assert(0 == kq_client_create(&w->client, &w->loop, &conf));
+	assert(NULL != (w->pool = kq_client_pool(&w->client, (struct sockaddr*)&dest, sizeof(dest))));
+	kq_hist_reset(&w->hist);
+	w->perf_fd = syscall_counter(0);
+	w->tick.handler = worker_tick;
+
+	pthread_barrier_wait(&barrier); // all workers are ready
+	pthread_barrier_wait(&barrier); // the main thread has set the time
+	worker_tick(&w->tick);
+	if (rate != 0)
+		assert(0 == worker_pace_start(w));
+	assert(0 == kq_run(&w->loop));
+
+	if (rate != 0) {
+		kq_detach(&w->loop, &w->pace);
+		close(w->pace.fd);
+	}
+	kq_client_close(&w->client);
+	kq_close(&w->loop);
+	for (unsigned i = 0;  i != w->nchunks;  i++) {
+		free(w->chunks[i]);
+	}
+	return NULL;
+}
+
+void sleep_until(unsigned long long us)
+{
+	unsigned long long now = kq_now_us();
+	if (us > now)
+		usleep(us - now);
+}
+
+int main(int argc, char **argv)
+{
+	pid_t server_pid = 0;
+	int opt;
+	while (-1 != (opt = getopt(argc, argv, "b:t:c:k:r:p:d:w:e:P:"))) {
+		switch (opt) {
+		case 'b':
+			if (0 == (backend = kq_backend_by_name(optarg))) {
+				fprintf(stderr, "Unsupported backend: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 't':
+			nworkers = atoi(optarg); break;
+		case 'c':
+			conns = atoi(optarg); break;
+		case 'k':
+			concurrency = atoi(optarg); break;
+		case 'r':
+			rate = strtoull(optarg, NULL, 10); break;
+		case 'p':
+			pipeline = atoi(optarg); break;
+		case 'd':
+			duration_s = atoi(optarg); break;
+		case 'w':
+			warmup_s = atoi(optarg); break;
+		case 'e':
+			echo_size = atoi(optarg); break;
+		case 'P':
+			server_pid = atoi(optarg); break;
+		default:
+			fprintf(stderr, "Usage: %s [-b BACKEND] [-t THREADS] [-c CONNS] [-k CONCURRENCY | -r RATE] [-p PIPELINE] [-d DURATION] [-w WARMUP] [-e SIZE] [-P PID] [IP:PORT]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (nworkers == 0 || duration_s == 0 || (rate == 0 && concurrency < nworkers) || (rate != 0 && rate < nworkers)) {
+		fprintf(stderr, "Every thread needs some load\n");
+		return 1;
+	}
+
+	char ip[64] = "127.0.0.1";
+	unsigned port = 64000;
+	dest.sin_family = AF_INET;
+	if ((optind != argc && 2 != sscanf(argv[optind], "%63[^:]:%u", ip, &port))
+		|| 1 != inet_pton(AF_INET, ip, &dest.sin_addr)) {
+		fprintf(stderr, "Invalid address: %s\n", argv[optind]);
+		return 1;
+	}
+	dest.sin_port = htons(port);
+
+	if (echo_size != 0) {
+		req_len = echo_size;
+		assert(NULL != (req_data = malloc(req_len)));
+		memset(req_data, 'x', req_len);
+	} else {
+		assert(NULL != (req_data = malloc(128)));
+		req_len = snprintf(req_data, 128, "GET / HTTP/1.1\r\nHost: %s:%u\r\n\r\n", ip, port);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	struct worker *ws = calloc(nworkers, sizeof(struct worker));
+	assert(ws != NULL);
+	assert(0 == pthread_barrier_init(&barrier, NULL, nworkers + 1));
+	for (unsigned i = 0;  i != nworkers;  i++) {
+		// share the load: the first threads take the remainder
+		ws[i].concurrency = concurrency / nworkers + (i < concurrency % nworkers);
+		ws[i].rate = rate / nworkers + (i < rate % nworkers);
+		assert(0 == pthread_create(&ws[i].thread, NULL, worker_main, &ws[i]));
+	}
+	int server_fds[256];
+	unsigned nserver_fds = (server_pid != 0) ? server_counters(server_pid, server_fds, 256) : 0;
+	int *client_fds = calloc(nworkers, sizeof(int));
+	assert(client_fds != NULL);
+
+	pthread_barrier_wait(&barrier);
+	for (unsigned i = 0;  i != nworkers;  i++) {
+		client_fds[i] = ws[i].perf_fd;
+	}
+	const char *backend_name = kq_backend_name(ws[0].loop.backend);
+	t_start = kq_now_us();
+	t_warm = t_start + warmup_s * 1000000ULL;
+	t_end = t_warm + duration_s * 1000000ULL;
+	pthread_barrier_wait(&barrier);
+
+	sleep_until(t_warm);
+	long long client0 = counters_read(client_fds, nworkers);
+	long long server0 = counters_read(server_fds, nserver_fds);
+	sleep_until(t_end);
+	long long client1 = counters_read(client_fds, nworkers);
+	long long server1 = counters_read(server_fds, nserver_fds);
+
+	struct kq_hist *h = malloc(sizeof(struct kq_hist));
+	assert(h != NULL);
+	kq_hist_reset(h);
+	unsigned long long completed = 0, errors = 0, dropped = 0;
+	int error = 0;
+	for (unsigned i = 0;  i != nworkers;  i++) {
+		pthread_join(ws[i].thread, NULL);
+		kq_hist_merge(h, &ws[i].hist);
+		completed += ws[i].completed;
+		errors += ws[i].errors;
+		dropped += ws[i].dropped;
+		if (error == 0)
+			error = ws[i].error;
+		if (ws[i].perf_fd != -1)
+			close(ws[i].perf_fd);
+	}
+	for (unsigned i = 0;  i != nserver_fds;  i++) {
+		if (server_fds[i] != -1)
+			close(server_fds[i]);
+	}
+
+	printf("%s, %u threads, %u connections, pipeline %u, %s: ", backend_name
+		, nworkers, nworkers * conns, pipeline, (echo_size != 0) ? "echo" : "HTTP");
+	if (rate == 0)
+		printf("closed loop, %u requests in flight\n", concurrency);
+	else
+		printf("open loop, %llu requests/s\n", rate);
+	printf("%llu requests in %us: %.0f requests/s, errors: %llu", completed, duration_s, (double)completed / duration_s, errors);
+	if (error != 0)
+		printf(" (%s)", strerror(error));
+	if (dropped != 0)
+		printf(", not sent: %llu (too many requests in flight)", dropped);
+	printf("\nlatency (usec): p50 %llu, p90 %llu, p99 %llu, p99.9 %llu, max %llu, mean %llu\n"
+		, kq_hist_percentile(h, 50), kq_hist_percentile(h, 90), kq_hist_percentile(h, 99)
+		, kq_hist_percentile(h, 99.9), (h->count != 0) ? h->max : 0, kq_hist_mean(h));
+	printf("syscalls per request: client ");
+	if (client0 >= 0 && client1 >= 0 && completed != 0)
+		printf("%.2f", (double)(client1 - client0) / completed);
+	else
+		printf("n/a");
+	if (server_pid != 0) {
+		printf(", server ");
+		if (server0 >= 0 && server1 >= 0 && completed != 0)
+			printf("%.2f", (double)(server1 - server0) / completed);
+		else
+			printf("n/a");
+	}
+	printf("\n");
+
+	free(h);
+	free(client_fds);
+	free(ws);
+	free(req_data);
+	pthread_barrier_destroy(&barrier);
+	return 0;
+}
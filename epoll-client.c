@@ -0,0 +1,188 @@
+/* Kernel Queue The Complete Guide: epoll-client.c: HTTP/1 client with keep-alive connection pools
+Sends REQUESTS GET requests with up to CONCURRENCY of them in progress at once,
+ distributed between the destinations, and prints the throughput and the latency.
+Usage:
+	$ ./epoll-server
+	$ ./epoll-client [-b BACKEND] [-n REQUESTS] [-k CONCURRENCY] [-c CONNS] [-p PIPELINE] [-C] [-t TIMEOUT] [IP:PORT...]
+Options:
+	-n REQUESTS     total number of requests (default: 10000)
+	-k CONCURRENCY  requests in progress at once (default: 32)
+	-c CONNS        max. connections per destination (default: 16)
+	-p PIPELINE     max. requests in flight per connection (default: 1)
+	-C              new connection for each request (Connection: close)
+	-t TIMEOUT      connect and response timeout in msec (default: 5000)
+	IP:PORT         destinations (default: 127.0.0.1:64000)
+*/
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <assert.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include "kq-client.h"
+
+struct kq_loop loop;
+struct kq_client client;
+struct kq_client_pool *pools[16];
+unsigned npools;
+unsigned total = 10000, started, completed, failed;
+unsigned long long latency_sum, latency_max;
+int conn_close;
+
+struct call {
+	struct kq_request req;
+	char data[128];
+	unsigned long long start;
+};
+
+// find the end of an HTTP/1 response with Content-Length
+int http_parse(struct kq_request *r, const char *data, size_t len)
+{
+	const char *end = memmem(data, len, "\r\n\r\n", 4);
+	if (end == NULL)
+		return 0; // wait for the complete header
+	size_t hdr_len = end + 4 - data;
+
+	long long body_len = -1;
+	const char *line = memmem(data, hdr_len, "\r\n", 2) + 2;
+	while (line < end) {
+		const char *eol = memmem(line, end + 2 - line, "\r\n", 2);
+		if (eol - line > 15 && !strncasecmp(line, "Content-Length:", 15))
+			body_len = strtoll(line + 15, NULL, 10);
+		else if (eol - line >= 17 && !strncasecmp(line, "Connection: close", 17))
+			r->close = 1;
+		line = eol + 2;
+	}
+	if (body_len < 0)
+		return -1; // chunked encoding isn't supported
+	if (hdr_len + body_len > len)
+		return 0;
+	if (conn_close)
+		r->close = 1;
+	return hdr_len + body_len;
+}
+
+void call_start(struct call *c);
+
+void call_complete(struct kq_request *r, const char *resp, size_t len)
+{
+	struct call *c = r->udata;
+	completed++;
+	if (r->error != 0) {
+		if (failed++ == 0)
+			fprintf(stderr, "request failed: %s\n", strerror(r->error));
+	} else {
+		unsigned long long us = (kq_now_us() - c->start);
+		latency_sum += us;
+		if (latency_max < us)
+			latency_max = us;
+	}
+
+	if (started != total)
+		call_start(c); // the next request
+	else if (completed == total)
+		kq_stop(&loop);
+}
+
+void call_start(struct call *c)
+{
+	struct kq_client_pool *p = pools[started++ % npools];
+	c->req.data = c->data;
+	c->req.len = strlen(c->data);
+	c->req.parse = http_parse;
+	c->req.on_complete = call_complete;
+	c->req.udata = c;
+	c->req.idempotent = 1; // GET
+	c->start = kq_now_us();
+	kq_client_request(p, &c->req);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned backend = 0, concurrency = 32;
+	struct kq_client_conf conf = {};
+	conf.max_conns = 16;
+	conf.max_pipeline = 1;
+	conf.connect_timeout_ms = 5000;
+	conf.response_timeout_ms = 5000;
+	conf.idle_timeout_ms = 30*1000;
+
+	int opt;
+	while (-1 != (opt = getopt(argc, argv, "b:n:k:c:p:Ct:"))) {
+		switch (opt) {
+		case 'b':
+			if (0 == (backend = kq_backend_by_name(optarg))) {
+				fprintf(stderr, "Unsupported backend: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'n':
+			total = atoi(optarg); break;
+		case 'k':
+			concurrency = atoi(optarg); break;
+		case 'c':
+			conf.max_conns = atoi(optarg); break;
+		case 'p':
+			conf.max_pipeline = atoi(optarg); break;
+		case 'C':
+			conn_close = 1; break;
+		case 't':
+			conf.connect_timeout_ms = conf.response_timeout_ms = atoi(optarg); break;
+		default:
+			fprintf(stderr, "Usage: %s [-b BACKEND] [-n REQUESTS] [-k CONCURRENCY] [-c CONNS] [-p PIPELINE] [-C] [-t TIMEOUT] [IP:PORT...]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (concurrency == 0 || total == 0)
+		return 0;
+
+	signal(SIGPIPE, SIG_IGN);
+	assert(0 == kq_create_backend(&loop, backend, 0));
+	assert(0 == kq_client_create(&client, &loop, &conf));
+
+	const char *defaults[] = { "127.0.0.1:64000" };
+	char **dests = (optind != argc) ? &argv[optind] : (char**)defaults;
+	unsigned ndests = (optind != argc) ? argc - optind : 1;
+	for (unsigned i = 0;  i != ndests && npools != 16;  i++) {
+		char ip[64];
+		unsigned port;
+		struct sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		if (2 != sscanf(dests[i], "%63[^:]:%u", ip, &port)
+			|| 1 != inet_pton(AF_INET, ip, &addr.sin_addr)) {
+			fprintf(stderr, "Invalid address: %s\n", dests[i]);
+			return 1;
+		}
+		addr.sin_port = htons(port);
+		pools[npools++] = kq_client_pool(&client, (struct sockaddr*)&addr, sizeof(addr));
+		assert(pools[npools - 1] != NULL);
+	}
+
+	if (concurrency > total)
+		concurrency = total;
+	struct call *calls = calloc(concurrency, sizeof(struct call));
+	assert(calls != NULL);
+	unsigned long long start = kq_now_us();
+	for (unsigned i = 0;  i != concurrency;  i++) {
+		snprintf(calls[i].data, sizeof(calls[i].data), "GET / HTTP/1.1\r\nHost: %s\r\n%s\r\n"
+			, dests[i % ndests], (conn_close) ? "Connection: close\r\n" : "");
+		call_start(&calls[i]);
+	}
+	assert(0 == kq_run(&loop));
+	unsigned long long us = kq_now_us() - start;
+
+	unsigned ok = completed - failed;
+	printf("%u requests in %llums: %.0f requests/s, latency: avg %lluus, max %lluus, failed: %u\n"
+		, completed, us / 1000, (double)completed * 1000000 / (us ? us : 1)
+		, (ok) ? latency_sum / ok : 0, latency_max, failed);
+	printf("connections opened: %llu, requests over open connections: %llu, pipelined: %llu, retried: %llu, timeouts: %llu\n"
+		, client.nconnects, client.nreused, client.npipelined, client.nretries, client.ntimeouts);
+
+	kq_client_close(&client);
+	kq_close(&loop);
+	free(calls);
+	return 0;
+}
@@ -24,8 +24,28 @@ struct context {
 	void (*rhandler)(struct context *obj);
 	void (*whandler)(struct context *obj);
 	int data_offset;
+	int ready; // the object is in the ready list
+	struct context *next_ready;
 };
 
+// max. number of bytes to receive per one handler call
+#define READ_BUDGET  (256*1024)
+
+// objects which have more data to process, but have yielded to let the others run
+struct context *ready_first, **ready_last = &ready_first;
+
+// call the object's READ handler once more after all current events are processed.
+// With EPOLLET KQ won't signal again until we read all data, so we must remember it ourselves.
+void obj_yield(struct context *obj)
+{
+	if (obj->ready)
+		return;
+	obj->ready = 1;
+	obj->next_ready = NULL;
+	*ready_last = obj;
+	ready_last = &obj->next_ready;
+}
+
 void obj_write(struct context *obj);
 void obj_read(struct context *obj);
 
@@ -81,24 +101,25 @@ void obj_connect(struct context *obj)
 void obj_write(struct context *obj)
 {
 	const char data[] = "GET / HTTP/1.1\r\nHost: hostname\r\nConnection: close\r\n\r\n";
-	int r = send(obj->sk, data + obj->data_offset, sizeof(data)-1 - obj->data_offset, 0);
-	if (r > 0) {
-		// sent some data
-		obj->data_offset += r;
-		if (obj->data_offset != sizeof(data)-1) {
-			// we need to send the complete request
-			obj_write(obj);
+	// we need to send the complete request
+	while (obj->data_offset != sizeof(data)-1) {
+		int r = send(obj->sk, data + obj->data_offset, sizeof(data)-1 - obj->data_offset, 0);
+		if (r > 0) {
+			// sent some data
+			obj->data_offset += r;
+
+		} else if (r < 0 && errno == EINTR) {
+			continue;
+
+		} else if (r < 0 && errno == EAGAIN) {
+			// the socket's write buffer is full
+			obj->whandler = obj_write;
 			return;
+		} else {
+			assert(0); // fatal error
 		}
-		obj->whandler = NULL;
-
-	} else if (r < 0 && errno == EAGAIN) {
-		// the socket's write buffer is full
-		obj->whandler = obj_write;
-		return;
-	} else {
-		assert(0); // fatal error
 	}
+	obj->whandler = NULL;
 
 	printf("Sent HTTP request.  Receiving HTTP response...\n");
 	obj_read(obj);
@@ -106,23 +127,37 @@ void obj_write(struct context *obj)
 
 void obj_read(struct context *obj)
 {
-	char data[64*1024];
-	int r = recv(obj->sk, data, sizeof(data), 0);
-	if (r > 0) {
-		// received some data
-		printf("%.*s", r, data);
-		obj_read(obj);
-		return;
+	// the data is processed before the next recv() call, so one buffer serves all connections
+	static char data[64*1024];
+	unsigned total = 0;
+	for (;;) {
+		if (total >= READ_BUDGET) {
+			// there may be more data, but the other connections must get their turn too
+			obj->rhandler = obj_read;
+			obj_yield(obj);
+			return;
+		}
 
-	} else if (r == 0) {
-		// server has finished sending data
+		int r = recv(obj->sk, data, sizeof(data), 0);
+		if (r > 0) {
+			// received some data
+			printf("%.*s", r, data);
+			total += r;
 
-	} else if (r < 0 && errno == EAGAIN) {
-		// the socket's read buffer is empty
-		obj->rhandler = obj_read;
-		return;
-	} else {
-		assert(0); // fatal error
+		} else if (r == 0) {
+			// server has finished sending data
+			break;
+
+		} else if (r < 0 && errno == EINTR) {
+			continue;
+
+		} else if (r < 0 && errno == EAGAIN) {
+			// the socket's read buffer is empty
+			obj->rhandler = obj_read;
+			return;
+		} else {
+			assert(0); // fatal error
+		}
 	}
 
 	quit = 1;
@@ -142,10 +177,12 @@ void main()
 	while (!quit) {
 		struct epoll_event events[1];
 		int timeout_ms = -1; // wait indefinitely
+		if (ready_first != NULL)
+			timeout_ms = 0; // just check for new events: there are objects ready to continue
 		int n = epoll_wait(kq, events, 1, timeout_ms);
 		if (n < 0 && errno == EINTR)
 			continue; // epoll_wait() interrupts when UNIX signal is received
-		assert(n > 0);
+		assert(n >= 0);
 
 		// now process each signalled event
 		for (int i = 0;  i != n;  i++) {
@@ -159,6 +196,19 @@ void main()
 				&& o->whandler != NULL)
 				o->whandler(o); // handle write event
 		}
+
+		// now continue with the objects which have yielded;
+		//  those which yield again are processed on the next iteration
+		struct context *o = ready_first;
+		ready_first = NULL;
+		ready_last = &ready_first;
+		while (o != NULL && !quit) {
+			struct context *next = o->next_ready;
+			o->ready = 0;
+			if (o->rhandler != NULL)
+				o->rhandler(o);
+			o = next;
+		}
 	}
 
 	close(obj.sk);
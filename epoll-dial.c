@@ -0,0 +1,159 @@
+/* Kernel Queue The Complete Guide: epoll-dial.c: Bulk dialing with happy eyeballs
+Connects to each endpoint (repeated COUNT times) with up to DIALS connecting at once,
+ prints which address has won and how long it took, then closes the connection.
+A host name is resolved to all its addresses, and the IPv6 and IPv4 candidates race each other:
+ e.g. "localhost:64000" connects over 127.0.0.1 when the server listens only on IPv4,
+ and a black-holed address (e.g. 10.255.255.1:80) fails after the attempt timeout instead of minutes.
+Usage:
+	$ ./epoll-server
+	$ ./epoll-dial [-b BACKEND] [-n COUNT] [-k DIALS] [-d DELAY] [-a TIMEOUT] [-t TIMEOUT] [-r RETRIES] [-q] HOST:PORT...
+Options:
+	-n COUNT    dial each endpoint this many times (default: 1)
+	-k DIALS    dials in progress at once (default: 64)
+	-d DELAY    msec before the next candidate starts (default: 250)
+	-a TIMEOUT  msec per attempt (default: 2000)
+	-t TIMEOUT  msec per dial, including the retries (default: 10000)
+	-r RETRIES  rounds over all candidates after the first one (default: 2)
+	-q          don't print each dial, only the summary
+	HOST:PORT   a name or an address; IPv6 in brackets: [::1]:64000
+*/
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <assert.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "kq-connect.h"
+
+struct kq_loop loop;
+struct kq_dialer dialer;
+unsigned total, completed, quiet;
+
+struct endpoint {
+	const char *name;
+	struct kq_dial d;
+};
+
+void print_addr(const struct sockaddr_storage *ss, char *buf, size_t cap)
+{
+	char ip[INET6_ADDRSTRLEN];
+	if (ss->ss_family == AF_INET6) {
+		const struct sockaddr_in6 *a = (void*)ss;
+		inet_ntop(AF_INET6, &a->sin6_addr, ip, sizeof(ip));
+		snprintf(buf, cap, "[%s]:%u", ip, ntohs(a->sin6_port));
+	} else {
+		const struct sockaddr_in *a = (void*)ss;
+		inet_ntop(AF_INET, &a->sin_addr, ip, sizeof(ip));
+		snprintf(buf, cap, "%s:%u", ip, ntohs(a->sin_port));
+	}
+}
+
+void on_done(struct kq_dial *d, int fd, int error)
+{
+	struct endpoint *e = d->udata;
+	if (!quiet) {
+		char addr[64] = "-";
+		if (fd != -1)
+			print_addr(&d->addrs[d->addr], addr, sizeof(addr));
+		printf("%s: %s %s in %llums, %u attempts\n"
+			, e->name, (fd != -1) ? "connected to" : strerror(error), (fd != -1) ? addr : ""
+			, d->time_ms, d->nattempts);
+	}
+	if (fd != -1)
+		close(fd);
+	if (++completed == total)
+		kq_stop(&loop);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned backend = 0, count = 1;
+	struct kq_dialer_conf conf = {};
+	conf.max_dials = 64;
+	conf.attempt_delay_ms = 250;
+	conf.attempt_timeout_ms = 2000;
+	conf.timeout_ms = 10*1000;
+	conf.retries = 2;
+
+	int opt;
+	while (-1 != (opt = getopt(argc, argv, "b:n:k:d:a:t:r:q"))) {
+		switch (opt) {
+		case 'b':
+			if (0 == (backend = kq_backend_by_name(optarg))) {
+				fprintf(stderr, "Unsupported backend: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'n':
+			count = atoi(optarg); break;
+		case 'k':
+			conf.max_dials = atoi(optarg); break;
+		case 'd':
+			conf.attempt_delay_ms = atoi(optarg); break;
+		case 'a':
+			conf.attempt_timeout_ms = atoi(optarg); break;
+		case 't':
+			conf.timeout_ms = atoi(optarg); break;
+		case 'r':
+			conf.retries = atoi(optarg); break;
+		case 'q':
+			quiet = 1; break;
+		default:
+			fprintf(stderr, "Usage: %s [-b BACKEND] [-n COUNT] [-k DIALS] [-d DELAY] [-a TIMEOUT] [-t TIMEOUT] [-r RETRIES] [-q] HOST:PORT...\n", argv[0]);
+			return 1;
+		}
+	}
+	unsigned nnames = argc - optind;
+	if (nnames == 0 || count == 0)
+		return 1;
+
+	signal(SIGPIPE, SIG_IGN);
+	assert(0 == kq_create_backend(&loop, backend, 0));
+	assert(0 == kq_dialer_create(&dialer, &loop, &conf));
+
+	// resolve each name once, before the loop starts: getaddrinfo() blocks
+	total = nnames * count;
+	struct endpoint *eps = calloc(total, sizeof(struct endpoint));
+	assert(eps != NULL);
+	for (unsigned i = 0;  i != nnames;  i++) {
+		char host[256];
+		unsigned port;
+		const char *name = argv[optind + i];
+		if (2 != sscanf(name, "[%255[^]]]:%u", host, &port)
+			&& 2 != sscanf(name, "%255[^:]:%u", host, &port)) {
+			fprintf(stderr, "Invalid endpoint: %s\n", name);
+			return 1;
+		}
+		struct endpoint *e = &eps[i * count];
+		e->name = name;
+		int r = kq_dial_resolve(&e->d, host, port);
+		if (r != 0) {
+			fprintf(stderr, "%s: %s\n", name, gai_strerror(r));
+			return 1;
+		}
+		for (unsigned k = 1;  k != count;  k++) {
+			e[k] = e[0];
+		}
+	}
+
+	unsigned long long start = kq_now_us();
+	for (unsigned i = 0;  i != total;  i++) {
+		eps[i].d.on_done = on_done;
+		eps[i].d.udata = &eps[i];
+		assert(0 == kq_dial_start(&dialer, &eps[i].d));
+	}
+	if (completed != total)
+		assert(0 == kq_run(&loop));
+	unsigned long long us = kq_now_us() - start;
+
+	printf("%llu dials in %llums: %llu connected, %llu failed (%llu timed out); %llu attempts, %llu attempt timeouts, %llu fallbacks, %llu retries\n"
+		, dialer.ndials, us / 1000, dialer.nconnected, dialer.nfailed, dialer.ntimeouts
+		, dialer.nattempts, dialer.nattempt_timeouts, dialer.nfallbacks, dialer.nretries);
+
+	kq_dialer_close(&dialer);
+	kq_close(&loop);
+	free(eps);
+	return 0;
+}
@@ -0,0 +1,97 @@
+/* Kernel Queue The Complete Guide: epoll-echo.c: Echo server for the benchmarks
+Sends back everything it receives: the cheapest possible request handling,
+ so the benchmark measures the event loop and the kernel rather than the protocol.
+Usage:
+	$ ./epoll-echo [-b BACKEND] [-t THREADS] [-p] [-s | -x]
+	$ ./epoll-bench -e 64
+Options:
+	-b BACKEND  epoll (default), io_uring, poll
+	-t THREADS  number of reactors, each with its own SO_REUSEPORT listener; 0: one per CPU (default: 1)
+	-p          pin each reactor to its own CPU
+	-s          all reactors share one listening socket
+	-x          all reactors share one listening socket attached with EPOLLEXCLUSIVE
+Signals:
+	SIGTERM, SIGINT  graceful shutdown
+*/
+#define _GNU_SOURCE
+#include <assert.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "kq-reactor.h"
+#include "kq-signal.h"
+
+struct kq_loop loop;
+struct kq_reactors rs;
+
+// all received data is processed at once: the responses are sent with one sendmsg() per wakeup
+int echo_on_data(struct kq_conn *c, const char *data, size_t len)
+{
+	if (0 != kq_conn_send(c, data, len))
+		return -1;
+	return len;
+}
+
+void on_shutdown(struct kq_signals *ss, const struct signalfd_siginfo *si)
+{
+	kq_reactors_drain(&rs, 1000);
+	kq_stop(&loop);
+}
+
+int main(int argc, char **argv)
+{
+	struct kq_reactors_conf conf = {};
+	conf.n = 1;
+	conf.server.port = 64000;
+	conf.server.on_data = echo_on_data;
+	conf.server.prealloc_conns = 1024;
+	conf.server.prealloc_bufs = 64;
+	conf.server.out_high = 256*1024; // a client which sends without reading can't make us buffer more
+
+	int opt;
+	while (-1 != (opt = getopt(argc, argv, "b:t:psx"))) {
+		switch (opt) {
+		case 'b':
+			if (0 == (conf.backend = kq_backend_by_name(optarg))) {
+				fprintf(stderr, "Unsupported backend: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 't':
+			conf.n = atoi(optarg); break;
+		case 'p':
+			conf.pin_cpu = 1; break;
+		case 's':
+			conf.listen_mode = KQ_LISTEN_SHARED; break;
+		case 'x':
+			conf.listen_mode = KQ_LISTEN_EXCLUSIVE; break;
+		default:
+			fprintf(stderr, "Usage: %s [-b BACKEND] [-t THREADS] [-p] [-s | -x]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (conf.n == 0)
+		conf.n = sysconf(_SC_NPROCESSORS_ONLN);
+	signal(SIGPIPE, SIG_IGN);
+
+	// the reactors must inherit the blocked signals
+	struct kq_signals sigs;
+	kq_signals_init(&sigs);
+	kq_signals_on(&sigs, SIGTERM, on_shutdown);
+	kq_signals_on(&sigs, SIGINT, on_shutdown);
+	assert(0 == kq_signals_block(&sigs));
+
+	assert(0 == kq_reactors_start(&rs, &conf));
+	printf("Echo server on port %u with %u reactors (%s)\n"
+		, conf.server.port, rs.n, kq_backend_name(rs.r[0].loop.backend));
+
+	assert(0 == kq_create(&loop, 0));
+	assert(0 == kq_signals_enable(&sigs, &loop));
+	kq_run(&loop);
+	kq_signals_close(&sigs);
+	kq_close(&loop);
+	kq_reactors_wait(&rs);
+	kq_reactors_close(&rs);
+	return 0;
+}
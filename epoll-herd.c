@@ -0,0 +1,154 @@
+/* Kernel Queue The Complete Guide: epoll-herd.c: Thundering herd benchmark for a shared listening socket
+Several reactor threads attach the same listening socket to their own KQ objects.
+For each mode the benchmark opens connections one by one and then reports per connection:
+ how many times the reactors returned from epoll_wait() for the listening socket,
+ how many of these wakeups didn't accept anything,
+ how many wakeups found the connection taken already (the first accept() failed with EAGAIN),
+ and how many times the reactor threads were put to sleep (voluntary context switches).
+The last one includes the wakeups which the kernel hides from us:
+ if the connection was already taken by another thread, epoll_wait() doesn't return and the thread just sleeps again.
+Usage:
+	$ ./epoll-herd [-t THREADS] [-c CONNECTIONS]
+*/
+#define _GNU_SOURCE
+#include <assert.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <arpa/inet.h>
+#include "kq-reactor.h"
+
+unsigned short port = 64000;
+
+int http_on_data(struct kq_conn *c, const char *data, size_t len)
+{
+	const char *end = memmem(data, len, "\r\n\r\n", 4);
+	if (end == NULL)
+		return 0;
+
+	static const char resp[] = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nHello";
+	if (0 != kq_conn_send(c, resp, sizeof(resp)-1))
+		return -1;
+	c->closing = 1;
+	return end + 4 - data;
+}
+
+// perform one request-response exchange with the server using a blocking socket
+void client_request()
+{
+	int sk = socket(AF_INET, SOCK_STREAM, 0);
+	assert(sk != -1);
+	struct sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	assert(0 == connect(sk, (struct sockaddr*)&addr, sizeof(addr)));
+
+	static const char req[] = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+	assert(sizeof(req)-1 == send(sk, req, sizeof(req)-1, 0));
+
+	char buf[1000];
+	while (recv(sk, buf, sizeof(buf), 0) > 0) {
+		// read until the server closes connection
+	}
+	close(sk);
+}
+
+// get the total number of voluntary context switches of all threads except the main one
+unsigned long long reactors_ctxsw()
+{
+	unsigned long long total = 0;
+	DIR *d = opendir("/proc/self/task");
+	assert(d != NULL);
+	struct dirent *de;
+	while (NULL != (de = readdir(d))) {
+		if (de->d_name[0] == '.' || atoi(de->d_name) == getpid())
+			continue;
+
+		char fn[64], buf[4096];
+		snprintf(fn, sizeof(fn), "/proc/self/task/%s/status", de->d_name);
+		FILE *f = fopen(fn, "r");
+		if (f == NULL)
+			continue;
+		unsigned long long n;
+		while (NULL != fgets(buf, sizeof(buf), f)) {
+			if (1 == sscanf(buf, "voluntary_ctxt_switches: %llu", &n))
+				total += n;
+		}
+		fclose(f);
+	}
+	closedir(d);
+	return total;
+}
+
+void bench(enum KQ_LISTEN mode, unsigned threads, unsigned conns)
+{
+	struct kq_reactors_conf conf = {};
+	conf.n = threads;
+	conf.listen_mode = mode;
+	conf.server.port = port;
+	conf.server.on_data = http_on_data;
+
+	struct kq_reactors rs;
+	assert(0 == kq_reactors_start(&rs, &conf));
+	usleep(100*1000); // wait until all reactors are in epoll_wait()
+	unsigned long long ctxsw = reactors_ctxsw();
+
+	for (unsigned i = 0;  i != conns;  i++) {
+		client_request();
+	}
+	usleep(100*1000); // let the reactors finish processing the wakeups
+	ctxsw = reactors_ctxsw() - ctxsw;
+
+	// the reactor threads are idle now, so it's safe to read their counters
+	unsigned long long accepted = 0, wakeups = 0, spurious = 0, failed = 0;
+	for (unsigned i = 0;  i != rs.n;  i++) {
+		struct kq_server *s = &rs.r[i].srv;
+		accepted += s->naccepted;
+		wakeups += s->nwakeups;
+		spurious += s->nspurious;
+		failed += s->naccept_failed;
+	}
+
+	printf("%-21s accepted:%llu  wakeups/conn:%.2f  spurious/conn:%.2f  failed accepts/conn:%.2f  sleeps/conn:%.2f\n"
+		, (mode == KQ_LISTEN_EXCLUSIVE) ? "shared+EPOLLEXCLUSIVE" : "shared"
+		, accepted
+		, (double)wakeups / conns
+		, (double)spurious / conns
+		, (double)failed / conns
+		, (double)ctxsw / conns);
+
+	kq_reactors_stop(&rs);
+	kq_reactors_wait(&rs);
+	kq_reactors_close(&rs);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned threads = 4, conns = 1000;
+	int opt;
+	while (-1 != (opt = getopt(argc, argv, "t:c:"))) {
+		switch (opt) {
+		case 't':
+			threads = atoi(optarg); break;
+		case 'c':
+			conns = atoi(optarg); break;
+		default:
+			fprintf(stderr, "Usage: %s [-t THREADS] [-c CONNECTIONS]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (threads == 0 || conns == 0)
+		return 1;
+
+	signal(SIGPIPE, SIG_IGN);
+	printf("%u reactors, %u sequential connections\n", threads, conns);
+
+	enum KQ_LISTEN modes[] = { KQ_LISTEN_SHARED, KQ_LISTEN_EXCLUSIVE };
+	for (int i = 0;  i != 2;  i++) {
+		bench(modes[i], threads, conns);
+	}
+	return 0;
+}
@@ -0,0 +1,391 @@
+/* Kernel Queue The Complete Guide: epoll-server.c: HTTP/1 server handling many connections
+Usage:
+	$ ./epoll-server [-b BACKEND] [-n EVENTS] [-t THREADS] [-p] [-s | -x] [-i IDLE] [-d DRAIN] [-m SIZE | -f FILE] [-z] [-S PATH] [-T FILE]
+	$ curl 127.0.0.1:64000/ 127.0.0.1:64000/
+Options:
+	-b BACKEND  epoll (default), io_uring, poll
+	-n EVENTS   max. events per epoll_wait() call
+	-t THREADS  number of reactors, each with its own SO_REUSEPORT listener; 0: one per CPU
+	-p          pin each reactor to its own CPU
+	-s          all reactors share one listening socket
+	-x          all reactors share one listening socket attached with EPOLLEXCLUSIVE
+	-i IDLE     close keep-alive connections after IDLE seconds of inactivity (default: 60); 0: never
+	-d DRAIN    on shutdown, wait no longer than DRAIN seconds for the active connections (default: 10); 0: no limit
+	-m SIZE     respond with a SIZE-byte document from memory (not copied to the output buffer)
+	-f FILE     respond with the file contents (sent with sendfile())
+	-z          send large documents from memory with MSG_ZEROCOPY
+	-S PATH     record the loop statistics in each reactor and report them on the Unix socket PATH:
+	            $ socat - UNIX-CONNECT:PATH
+	-T FILE     record the last events of each reactor in memory and write them to FILE on SIGQUIT:
+	            $ kill -QUIT $(pidof epoll-server)  &&  ./epoll-trace FILE
+Signals:
+	SIGTERM, SIGINT  graceful shutdown: stop accepting, finish the active connections, exit
+	SIGHUP           reload the document without interrupting any connections
+	SIGUSR1          print status
+	SIGQUIT          write the trace (-T)
+	SIGUSR2          hot upgrade: start the new binary, pass the listening sockets to it, then shut down gracefully
+Hot upgrade:
+	$ cp new-epoll-server epoll-server  &&  kill -USR2 $(pidof epoll-server)
+*/
+#define _GNU_SOURCE
+#include <assert.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "kq-handoff.h"
+#include "kq-http.h"
+#include "kq-reactor.h"
+#include "kq-signal.h"
+
+// the document: from memory or from file.
+// The main thread holds a reference to the latest document, each reactor to its current one,
+//  and each response being sent holds another one: after reload the old document is freed when nobody uses it.
+struct document {
+	atomic_uint refs;
+	char header[128], header_close[128]; // the latter: the last response on the connection
+	unsigned header_len, header_close_len;
+	char *body; // from memory
+	size_t body_len;
+	int fd; // from file; -1: from memory
+};
+
+const char *doc_file;
+size_t doc_size = 5;
+unsigned ndocs;
+
+// the new document has one reference: the caller's
+struct document* doc_load()
+{
+	struct document *d = calloc(1, sizeof(struct document));
+	if (d == NULL)
+		return NULL;
+	d->fd = -1;
+	if (doc_file != NULL) {
+		struct stat st;
+		d->fd = open(doc_file, O_RDONLY | O_CLOEXEC);
+		if (d->fd == -1 || 0 != fstat(d->fd, &st)) {
+			perror(doc_file);
+			if (d->fd != -1)
+				close(d->fd);
+			free(d);
+			return NULL;
+		}
+		d->body_len = st.st_size;
+	} else {
+		d->body_len = doc_size;
+		if (NULL == (d->body = malloc(doc_size))) {
+			free(d);
+			return NULL;
+		}
+		memset(d->body, 'x', doc_size);
+		if (doc_size == 5)
+			memcpy(d->body, "Hello", 5);
+	}
+	d->header_len = snprintf(d->header, sizeof(d->header), "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n\r\n", d->body_len);
+	d->header_close_len = snprintf(d->header_close, sizeof(d->header_close)
+		, "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", d->body_len);
+	atomic_init(&d->refs, 1);
+	ndocs++;
+	return d;
+}
+
+void doc_ref(struct document *d)
+{
+	atomic_fetch_add_explicit(&d->refs, 1, memory_order_relaxed);
+}
+
+// called by any reactor
+void doc_unref(void *udata)
+{
+	struct document *d = udata;
+	if (1 != atomic_fetch_sub(&d->refs, 1))
+		return;
+	if (d->fd != -1)
+		close(d->fd);
+	free(d->body);
+	free(d);
+}
+
+// respond to an invalid request and close the connection
+int http_error(struct kq_conn *c, int status)
+{
+	char buf[128];
+	const char *reason = (status == 431) ? "Request Header Fields Too Large"
+		: (status == 501) ? "Not Implemented"
+		: (status == 505) ? "HTTP Version Not Supported"
+		: (status == 413) ? "Content Too Large"
+		: "Bad Request";
+	int n = snprintf(buf, sizeof(buf), "HTTP/1.1 %d %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", status, reason);
+	if (0 != kq_conn_send(c, buf, n))
+		return -1;
+	kq_conn_finish(c);
+	return 0;
+}
+
+// respond to each complete request with a fixed document.
+// The requests may be pipelined: each call handles one of them.
+int http_on_data(struct kq_conn *c, const char *data, size_t len)
+{
+	struct kq_http_parser *p = c->udata; // resumes where the previous call has stopped
+	struct kq_http_header headers[64];
+	struct kq_http_request req = {};
+	req.headers = headers;
+	req.max_headers = 64;
+	int n = kq_http_parse(p, data, len, &req);
+	if (n == 0)
+		return 0; // wait for the complete request
+	if (n < 0)
+		return (0 == http_error(c, -n)) ? (int)len : -1;
+
+	// the header is copied; the body is sent directly from memory or from file
+	struct document *d = c->srv->conf.udata;
+	int r = (req.keep_alive)
+		? kq_conn_send(c, d->header, d->header_len)
+		: kq_conn_send(c, d->header_close, d->header_close_len);
+	if (r != 0)
+		return -1;
+	if (!(req.method.len == 4 && !memcmp(req.method.ptr, "HEAD", 4))) {
+		doc_ref(d); // released when the body is sent
+		r = (d->fd != -1)
+			? kq_conn_sendfile(c, d->fd, 0, d->body_len, doc_unref, d)
+			: kq_conn_send_ref(c, d->body, d->body_len, doc_unref, d);
+		if (r != 0)
+			return -1;
+	}
+	if (!req.keep_alive)
+		kq_conn_finish(c);
+	return n;
+}
+
+// the reactor has switched to the new document.
+// Called under the reactors' lock, so the main thread can't release the new document before we take our reference
+void http_on_reload(struct kq_server *s, const struct kq_server_conf *old)
+{
+	doc_ref(s->conf.udata);
+	doc_unref(old->udata);
+}
+
+struct kq_loop loop;
+struct kq_reactors rs;
+struct kq_reactors_conf conf = {};
+unsigned drain_ms = 10*1000;
+char **args;
+struct kq_handoff upgrade;
+int upgrading;
+const char *stats_path;
+struct kq_stats_sock stats_sock;
+const char *trace_path;
+
+void shutdown_gracefully()
+{
+	kq_reactors_drain(&rs, drain_ms);
+	kq_stop(&loop); // now wait for the reactors to exit
+}
+
+void on_shutdown(struct kq_signals *ss, const struct signalfd_siginfo *si)
+{
+	printf("Received signal %u: finishing the active connections...\n", si->ssi_signo);
+	if (upgrading)
+		kq_handoff_close(&upgrade); // the new process can't confirm and shuts down too
+	shutdown_gracefully();
+}
+
+void on_upgraded(struct kq_handoff *h, int ok)
+{
+	upgrading = 0;
+	if (!ok) {
+		printf("The new process %d has failed to start: continuing\n", (int)h->pid);
+		return;
+	}
+	printf("The new process %d is accepting the connections: finishing the active connections...\n", (int)h->pid);
+	shutdown_gracefully();
+}
+
+// the new process shares our listening sockets, so the port is never closed
+void on_upgrade(struct kq_signals *ss, const struct signalfd_siginfo *si)
+{
+	if (upgrading)
+		return;
+	int fds[KQ_HANDOFF_MAX];
+	unsigned n = kq_reactors_listeners(&rs, fds, KQ_HANDOFF_MAX);
+	upgrade.on_complete = on_upgraded;
+	if (0 != kq_handoff_start(&upgrade, &loop, args, fds, n)) {
+		perror("upgrade");
+		return;
+	}
+	upgrading = 1;
+	printf("Started the new process %d\n", (int)upgrade.pid);
+}
+
+void on_reload(struct kq_signals *ss, const struct signalfd_siginfo *si)
+{
+	struct document *d = doc_load(), *prev = conf.server.udata;
+	if (d == NULL)
+		return; // keep the current document
+	conf.server.udata = d;
+	kq_reactors_reload(&rs, &conf.server);
+	// the reactors which have already switched hold their own references;
+	//  a reactor which skips this document because of a newer reload never takes one
+	doc_unref(prev);
+	printf("Reloaded the document: %zu bytes\n", d->body_len);
+}
+
+void on_status(struct kq_signals *ss, const struct signalfd_siginfo *si)
+{
+	struct document *d = conf.server.udata;
+	printf("%u reactors, document: %zu bytes, loaded %u times, signals received: %llu\n"
+		, rs.n, d->body_len, ndocs, ss->nsignals);
+}
+
+void on_trace_dump(struct kq_signals *ss, const struct signalfd_siginfo *si)
+{
+	if (trace_path == NULL)
+		return;
+	if (0 != kq_trace_dump(trace_path)) {
+		perror("trace");
+		return;
+	}
+	printf("The trace is written to %s\n", trace_path);
+}
+
+void on_child(struct kq_signals *ss, const struct signalfd_siginfo *si)
+{
+	// several children may exit while the signal is pending, but it's delivered only once
+	int status;
+	pid_t pid;
+	while (0 < (pid = waitpid(-1, &status, WNOHANG))) {
+		printf("Child process %d exited with status %d\n", (int)pid, status);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	conf.n = 1;
+	conf.server.port = 64000;
+	conf.server.on_data = http_on_data;
+	conf.server.on_reload = http_on_reload;
+	conf.server.conn_data_size = sizeof(struct kq_http_parser);
+	conf.server.prealloc_conns = 1024;
+	conf.server.prealloc_bufs = 64; // only the connections which are processing data need them
+	conf.server.idle_timeout_ms = 60*1000;
+	conf.server.read_timeout_ms = 10*1000;
+	conf.server.write_timeout_ms = 30*1000;
+	conf.server.out_high = 1024*1024; // stop reading pipelined requests while the client doesn't read the responses
+
+	int opt;
+	while (-1 != (opt = getopt(argc, argv, "b:n:t:psxi:d:m:f:zS:T:"))) {
+		switch (opt) {
+		case 'b':
+			if (0 == (conf.backend = kq_backend_by_name(optarg))) {
+				fprintf(stderr, "Unsupported backend: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'n':
+			conf.nevents = atoi(optarg); break;
+		case 't':
+			conf.n = atoi(optarg); break;
+		case 'p':
+			conf.pin_cpu = 1; break;
+		case 's':
+			conf.listen_mode = KQ_LISTEN_SHARED; break;
+		case 'x':
+			conf.listen_mode = KQ_LISTEN_EXCLUSIVE; break;
+		case 'i':
+			conf.server.idle_timeout_ms = atoi(optarg) * 1000; break;
+		case 'd':
+			drain_ms = atoi(optarg) * 1000; break;
+		case 'm':
+			doc_size = atoi(optarg); break;
+		case 'f':
+			doc_file = optarg; break;
+		case 'z':
+			conf.server.zerocopy_min = 16*1024; break;
+		case 'S':
+			stats_path = optarg;
+			conf.stats = 1;
+			break;
+		case 'T':
+			trace_path = optarg;
+			conf.trace_records = 64*1024;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-b BACKEND] [-n EVENTS] [-t THREADS] [-p] [-s | -x] [-i IDLE] [-d DRAIN] [-m SIZE | -f FILE] [-z] [-S PATH] [-T FILE]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	args = argv;
+	signal(SIGPIPE, SIG_IGN);
+
+	// started by the old process on hot upgrade: use its listening sockets
+	int handoff_sk, fds[KQ_HANDOFF_MAX];
+	int nfds = kq_handoff_inherit(&handoff_sk, fds, KQ_HANDOFF_MAX);
+	if (nfds < 0) {
+		perror("handoff");
+		return 1;
+	}
+	conf.listen_fds = fds;
+	conf.nlisten_fds = nfds;
+	if (conf.n == 0)
+		conf.n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nfds != 0 && conf.listen_mode == KQ_LISTEN_REUSEPORT)
+		conf.n = nfds; // one reactor per inherited socket
+	// one reference for the main thread and one for each reactor
+	if (NULL == (conf.server.udata = doc_load()))
+		return 1;
+	for (unsigned i = 0;  i != conf.n;  i++) {
+		doc_ref(conf.server.udata);
+	}
+
+	// the reactors must inherit the blocked signals
+	struct kq_signals sigs;
+	kq_signals_init(&sigs);
+	kq_signals_on(&sigs, SIGTERM, on_shutdown);
+	kq_signals_on(&sigs, SIGINT, on_shutdown);
+	kq_signals_on(&sigs, SIGHUP, on_reload);
+	kq_signals_on(&sigs, SIGUSR1, on_status);
+	kq_signals_on(&sigs, SIGUSR2, on_upgrade);
+	kq_signals_on(&sigs, SIGQUIT, on_trace_dump);
+	kq_signals_on(&sigs, SIGCHLD, on_child);
+	assert(0 == kq_signals_block(&sigs));
+
+	assert(0 == kq_reactors_start(&rs, &conf));
+	printf("Listening on port %u with %u reactors (%s)%s\n"
+		, conf.server.port, rs.n, kq_backend_name(rs.r[0].loop.backend)
+		, (nfds != 0) ? ", the listening sockets are inherited" : "");
+
+	// the main thread only handles the signals
+	assert(0 == kq_create(&loop, 0));
+	assert(0 == kq_signals_enable(&sigs, &loop));
+	if (stats_path != NULL && 0 != kq_stats_sock_open(&stats_sock, &loop, &rs, stats_path)) {
+		perror("stats socket");
+		stats_path = NULL;
+	}
+	if (handoff_sk != -1 && 0 != kq_handoff_ready(handoff_sk)) {
+		printf("The old process has cancelled the upgrade\n");
+		shutdown_gracefully();
+	}
+	kq_run(&loop);
+	if (stats_path != NULL)
+		kq_stats_sock_close(&stats_sock);
+	kq_signals_close(&sigs);
+	kq_close(&loop);
+
+	kq_reactors_wait(&rs);
+	printf("All connections are closed\n");
+
+	// release the documents which the reactors and the main thread hold
+	for (unsigned i = 0;  i != rs.n;  i++) {
+		doc_unref(rs.r[i].srv.conf.udata);
+	}
+	doc_unref(conf.server.udata);
+	kq_reactors_close(&rs);
+	return 0;
+}
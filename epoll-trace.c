@@ -0,0 +1,341 @@
+/* Kernel Queue The Complete Guide: epoll-trace.c: Per-connection timelines from a trace dump
+Reads the file written by kq_trace_dump() (kq-trace.h), e.g. by `epoll-server -T FILE` on SIGQUIT,
+ and prints the events of each connection in time order: accept or connect, each handler call with its duration, close.
+A connection is identified by its object's address and generation:
+ the memory of a closed connection is reused for a new one with the next generation.
+The handler addresses are resolved to function names with addr2line while the executable is the same.
+Usage:
+	$ ./epoll-trace FILE [-m USEC] [-f FD] [-a] [-l]
+Options:
+	-m USEC  only the connections with a handler call of at least USEC
+	-f FD    only the connections with this descriptor
+	-a       all objects, not only connections: listening sockets, eventfd, signalfd, ...
+	-l       also print the loop of each thread: waits, wakeups, timers, AIO
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "kq-trace.h"
+
+struct thread {
+	struct kq_trace_thread hdr;
+	const struct kq_trace_rec *recs;
+};
+
+struct item {
+	const struct kq_trace_rec *rec;
+	unsigned thread;
+};
+
+// the events of one object: items[first..first+n)
+struct group {
+	size_t first, n;
+	unsigned long long time_ns;
+};
+
+struct sym {
+	unsigned long long addr;
+	char name[64];
+	unsigned conn; // the handler of an accepted or connected object
+};
+
+struct kq_trace_file hdr;
+struct thread *threads;
+struct sym *syms;
+unsigned nsyms;
+unsigned long long t_base = ~0ULL;
+unsigned min_usec;
+int only_fd = -1, all_objects, print_loops;
+
+int item_cmp_obj(const void *a, const void *b)
+{
+	const struct kq_trace_rec *x = ((const struct item*)a)->rec, *y = ((const struct item*)b)->rec;
+	if (x->obj != y->obj)
+		return (x->obj < y->obj) ? -1 : 1;
+	if (x->gen != y->gen)
+		return (x->gen < y->gen) ? -1 : 1;
+	if (x->time_ns != y->time_ns)
+		return (x->time_ns < y->time_ns) ? -1 : 1;
+	return 0;
+}
+
+int group_cmp(const void *a, const void *b)
+{
+	unsigned long long x = ((const struct group*)a)->time_ns, y = ((const struct group*)b)->time_ns;
+	return (x < y) ? -1 : (x > y);
+}
+
+int sym_cmp(const void *a, const void *b)
+{
+	unsigned long long x = ((const struct sym*)a)->addr, y = ((const struct sym*)b)->addr;
+	return (x < y) ? -1 : (x > y);
+}
+
+void sym_add(unsigned long long addr)
+{
+	for (unsigned i = 0;  i != nsyms;  i++) {
+		if (syms[i].addr == addr)
+			return;
+	}
+	syms = realloc(syms, (nsyms + 1) * sizeof(struct sym));
+	syms[nsyms].addr = addr;
+	syms[nsyms].conn = 0;
+	snprintf(syms[nsyms].name, sizeof(syms[nsyms].name), "0x%llx", addr - hdr.load_bias);
+	nsyms++;
+}
+
+// resolve all handler addresses with one addr2line process
+void syms_resolve()
+{
+	if (nsyms == 0 || hdr.exe[0] == '\0' || strchr(hdr.exe, '\'') != NULL || 0 != access(hdr.exe, R_OK))
+		return;
+	size_t cap = 64 + strlen(hdr.exe) + nsyms * 20;
+	char *cmd = malloc(cap);
+	int n = snprintf(cmd, cap, "addr2line -f -e '%s'", hdr.exe);
+	for (unsigned i = 0;  i != nsyms;  i++) {
+		n += snprintf(cmd + n, cap - n, " 0x%llx", syms[i].addr - hdr.load_bias);
+	}
+	FILE *f = popen(cmd, "r");
+	free(cmd);
+	if (f == NULL)
+		return;
+	char func[256], loc[1024];
+	for (unsigned i = 0;  i != nsyms;  i++) {
+		if (NULL == fgets(func, sizeof(func), f) || NULL == fgets(loc, sizeof(loc), f))
+			break;
+		func[strcspn(func, "\n")] = '\0';
+		if (strcmp(func, "??") != 0)
+			snprintf(syms[i].name, sizeof(syms[i].name), "%s", func);
+	}
+	pclose(f);
+}
+
+struct sym* sym_find(unsigned long long addr)
+{
+	struct sym key = { addr };
+	return bsearch(&key, syms, nsyms, sizeof(struct sym), sym_cmp);
+}
+
+const char* sym_name(unsigned long long addr)
+{
+	struct sym *s = sym_find(addr);
+	return (s != NULL) ? s->name : "?";
+}
+
+double rel_ms(unsigned long long t)
+{
+	return (double)(t - t_base) / 1000000;
+}
+
+void print_rec(const struct kq_trace_rec *r)
+{
+	printf("  %12.3f ms  ", rel_ms(r->time_ns));
+	switch (r->type) {
+	case KQ_TRACE_WAIT:
+		printf("wait, timeout %lld ms\n", (long long)r->arg); break;
+	case KQ_TRACE_WAKE:
+		printf("woken, %lld events\n", (long long)r->arg); break;
+	case KQ_TRACE_HANDLER:
+		printf("%-24s %9.3f us  fd %d  obj 0x%llx\n", sym_name(r->arg), r->dur_ns / 1000.0, r->fd, r->obj); break;
+	case KQ_TRACE_ACCEPT:
+		printf("accepted  fd %d\n", r->fd); break;
+	case KQ_TRACE_CONNECT:
+		printf("connected  fd %d, error %lld\n", r->fd, (long long)r->arg); break;
+	case KQ_TRACE_CLOSE:
+		printf("closed  fd %d\n", r->fd); break;
+	case KQ_TRACE_TIMER:
+		printf("timer %-18s late %u ms  timer 0x%llx\n", sym_name(r->arg), r->dur_ns, r->obj); break;
+	case KQ_TRACE_AIO_SUBMIT:
+		printf("io_submit(): %lld\n", (long long)r->arg); break;
+	case KQ_TRACE_AIO_COMPLETE:
+		printf("AIO complete: %lld  req 0x%llx\n", (long long)r->arg, r->obj); break;
+	default:
+		printf("type %u\n", r->type);
+	}
+}
+
+int is_object_event(unsigned type)
+{
+	return type == KQ_TRACE_HANDLER || type == KQ_TRACE_ACCEPT || type == KQ_TRACE_CONNECT || type == KQ_TRACE_CLOSE;
+}
+
+// mark the handlers of the connections whose accept or connect is in the trace
+void mark_conn_handlers(const struct item *items, size_t n)
+{
+	size_t i;
+	for (i = 0;  i != n;  i++) {
+		if (items[i].rec->type == KQ_TRACE_ACCEPT || items[i].rec->type == KQ_TRACE_CONNECT)
+			break;
+	}
+	if (i == n)
+		return;
+	for (i = 0;  i != n;  i++) {
+		if (items[i].rec->type == KQ_TRACE_HANDLER)
+			sym_find(items[i].rec->arg)->conn = 1;
+	}
+}
+
+// print the events of one object: items[0..n) have the same address and generation.
+// The object is a connection if it was accepted or connected,
+//  or if these events were overwritten but it has the same handlers as a connection
+void print_object(const struct item *items, size_t n)
+{
+	int conn = 0, fd = -1;
+	unsigned calls = 0;
+	unsigned long long busy = 0, slowest = 0;
+	for (size_t i = 0;  i != n;  i++) {
+		const struct kq_trace_rec *r = items[i].rec;
+		if (r->type == KQ_TRACE_ACCEPT || r->type == KQ_TRACE_CONNECT)
+			conn = 1;
+		if (r->fd != -1)
+			fd = r->fd;
+		if (r->type == KQ_TRACE_HANDLER) {
+			if (sym_find(r->arg)->conn)
+				conn = 1;
+			calls++;
+			busy += r->dur_ns;
+			if (slowest < r->dur_ns)
+				slowest = r->dur_ns;
+		}
+	}
+	if ((!conn && !all_objects)
+		|| (only_fd != -1 && fd != only_fd)
+		|| slowest < min_usec * 1000ULL)
+		return;
+
+	const struct kq_trace_rec *first = items[0].rec, *last = items[n - 1].rec;
+	const struct thread *th = &threads[items[0].thread];
+	printf("%s fd %d (%s, obj 0x%llx/%u): %u handler calls, busy %.3f us, slowest %.3f us, span %.3f ms\n"
+		, (conn) ? "connection" : "object", fd, th->hdr.name, first->obj, first->gen
+		, calls, busy / 1000.0, slowest / 1000.0, (last->time_ns - first->time_ns) / 1000000.0);
+	for (size_t i = 0;  i != n;  i++) {
+		print_rec(items[i].rec);
+	}
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	while (-1 != (opt = getopt(argc, argv, "m:f:al"))) {
+		switch (opt) {
+		case 'm':
+			min_usec = atoi(optarg); break;
+		case 'f':
+			only_fd = atoi(optarg); break;
+		case 'a':
+			all_objects = 1; break;
+		case 'l':
+			print_loops = 1; break;
+		default:
+			fprintf(stderr, "Usage: %s FILE [-m USEC] [-f FD] [-a] [-l]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind == argc) {
+		fprintf(stderr, "Usage: %s FILE [-m USEC] [-f FD] [-a] [-l]\n", argv[0]);
+		return 1;
+	}
+
+	FILE *f = fopen(argv[optind], "rb");
+	if (f == NULL) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (1 != fread(&hdr, sizeof(hdr), 1, f)
+		|| memcmp(hdr.magic, KQ_TRACE_MAGIC, 8) != 0
+		|| hdr.rec_size != sizeof(struct kq_trace_rec)) {
+		fprintf(stderr, "%s: not a trace file\n", argv[optind]);
+		return 1;
+	}
+	hdr.exe[sizeof(hdr.exe) - 1] = '\0';
+
+	// read all records and collect the handler addresses
+	threads = calloc(hdr.nthreads, sizeof(struct thread));
+	size_t total = 0;
+	for (unsigned i = 0;  i != hdr.nthreads;  i++) {
+		struct thread *th = &threads[i];
+		if (1 != fread(&th->hdr, sizeof(th->hdr), 1, f)) {
+			fprintf(stderr, "%s: truncated\n", argv[optind]);
+			return 1;
+		}
+		th->hdr.name[sizeof(th->hdr.name) - 1] = '\0';
+		struct kq_trace_rec *recs = malloc(th->hdr.nrecs * sizeof(struct kq_trace_rec) + 1);
+		if (th->hdr.nrecs != fread(recs, sizeof(struct kq_trace_rec), th->hdr.nrecs, f)) {
+			fprintf(stderr, "%s: truncated\n", argv[optind]);
+			return 1;
+		}
+		th->recs = recs;
+		total += th->hdr.nrecs;
+		for (unsigned k = 0;  k != th->hdr.nrecs;  k++) {
+			if (t_base > recs[k].time_ns)
+				t_base = recs[k].time_ns;
+			if (recs[k].type == KQ_TRACE_HANDLER || recs[k].type == KQ_TRACE_TIMER)
+				sym_add(recs[k].arg);
+		}
+	}
+	fclose(f);
+	qsort(syms, nsyms, sizeof(struct sym), sym_cmp);
+	syms_resolve();
+
+	printf("%s: %s, %u threads, %zu records\n", argv[optind], hdr.exe, hdr.nthreads, total);
+	for (unsigned i = 0;  i != hdr.nthreads;  i++) {
+		const struct thread *th = &threads[i];
+		if (th->hdr.nrecs == 0) {
+			printf("thread %d (%s): no records\n", th->hdr.tid, th->hdr.name);
+			continue;
+		}
+		printf("thread %d (%s): %u records from %.3f ms to %.3f ms\n", th->hdr.tid, th->hdr.name, th->hdr.nrecs
+			, rel_ms(th->recs[0].time_ns), rel_ms(th->recs[th->hdr.nrecs - 1].time_ns));
+	}
+	printf("\n");
+
+	if (print_loops) {
+		for (unsigned i = 0;  i != hdr.nthreads;  i++) {
+			const struct thread *th = &threads[i];
+			printf("thread %d (%s):\n", th->hdr.tid, th->hdr.name);
+			for (unsigned k = 0;  k != th->hdr.nrecs;  k++) {
+				print_rec(&th->recs[k]);
+			}
+			printf("\n");
+		}
+	}
+
+	// group the events of each object
+	struct item *items = malloc(total * sizeof(struct item) + 1);
+	size_t n = 0;
+	for (unsigned i = 0;  i != hdr.nthreads;  i++) {
+		for (unsigned k = 0;  k != threads[i].hdr.nrecs;  k++) {
+			if (!is_object_event(threads[i].recs[k].type))
+				continue;
+			items[n].rec = &threads[i].recs[k];
+			items[n].thread = i;
+			n++;
+		}
+	}
+	qsort(items, n, sizeof(struct item), item_cmp_obj);
+	struct group *groups = malloc(n * sizeof(struct group) + 1);
+	size_t ngroups = 0;
+	for (size_t i = 0;  i != n;  ) {
+		size_t k = i + 1;
+		while (k != n && items[k].rec->obj == items[i].rec->obj && items[k].rec->gen == items[i].rec->gen)
+			k++;
+		groups[ngroups].first = i;
+		groups[ngroups].n = k - i;
+		groups[ngroups].time_ns = items[i].rec->time_ns;
+		ngroups++;
+		i = k;
+	}
+
+	for (size_t i = 0;  i != ngroups;  i++) {
+		mark_conn_handlers(&items[groups[i].first], groups[i].n);
+	}
+
+	// in the order of their first events
+	qsort(groups, ngroups, sizeof(struct group), group_cmp);
+	for (size_t i = 0;  i != ngroups;  i++) {
+		print_object(&items[groups[i].first], groups[i].n);
+	}
+	return 0;
+}
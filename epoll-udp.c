@@ -0,0 +1,197 @@
+/* Kernel Queue The Complete Guide: epoll-udp.c: UDP receiver and sender with batched I/O
+The receiver binds one socket per thread to the same port (SO_REUSEPORT),
+ each socket on its own loop, and counts the datagrams (or sends them back with -e).
+The sender floods the destination with same-size datagrams from one socket per thread.
+Both print every second how many datagrams each system call has moved:
+ recvmmsg()/sendmmsg() batches and GRO/GSO coalescing together.
+Usage:
+	$ ./epoll-udp [-b BACKEND] [-t THREADS] [-B BATCH] [-e] [-G]
+	$ ./epoll-udp -c IP:PORT [-b BACKEND] [-t THREADS] [-B BATCH] [-l LENGTH] [-d SECONDS] [-G]
+Options:
+	-b BACKEND  epoll (default), io_uring, poll
+	-t THREADS  threads, each with its own loop and socket (default: 1)
+	-B BATCH    messages per recvmmsg()/sendmmsg() call (default: 64)
+	-e          receiver: send each datagram back
+	-G          don't use UDP_GRO and UDP_SEGMENT: one datagram per message
+	-c IP:PORT  sender: the destination
+	-l LENGTH   sender: datagram size (default: 64)
+	-d SECONDS  sender: stop after this time (default: 10)
+*/
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "kq-udp.h"
+
+struct worker {
+	pthread_t thread;
+	struct kq_loop loop;
+	struct kq_udp udp;
+	struct context pump; // sender: queues the datagrams on each iteration
+	struct kq_timer tick;
+	unsigned long long recv_calls, recv_dgrams, send_calls, send_dgrams; // reported already
+};
+
+unsigned backend, nworkers = 1, batch = 64, echo, nogso, sender, duration_s = 10;
+size_t dgram_len = 64;
+struct sockaddr_in dest;
+char payload[KQ_UDP_DGRAM_MAX];
+atomic_ullong total_recv_calls, total_recv_dgrams, total_send_calls, total_send_dgrams, total_errors;
+atomic_uint stopped;
+unsigned long long t_end;
+
+void on_datagram(struct kq_udp *u, const char *data, size_t len, const struct sockaddr *from, socklen_t from_len)
+{
+	if (echo)
+		kq_udp_send(u, data, len, from, from_len); // when the queue is full, the datagram is dropped
+}
+
+// queue the datagrams until the queue is full, then let the loop send them
+void pump(struct context *obj)
+{
+	struct worker *w = (void*)((char*)obj - offsetof(struct worker, pump));
+	for (unsigned i = 0;  i != 64 * 1024;  i++) {
+		if (0 != kq_udp_send(&w->udp, payload, dgram_len, (struct sockaddr*)&dest, sizeof(dest)))
+			break;
+	}
+	if (!w->udp.blocked)
+		kq_yield(&w->loop, &w->pump, KQ_READY_R);
+	// otherwise the socket's buffer is full: continue on the next tick
+}
+
+// publish the counters
+void tick(struct kq_timer *t)
+{
+	struct worker *w = (void*)((char*)t - offsetof(struct worker, tick));
+	struct kq_udp *u = &w->udp;
+	atomic_fetch_add(&total_recv_calls, u->nrecv_calls - w->recv_calls);
+	atomic_fetch_add(&total_recv_dgrams, u->nrecv_datagrams - w->recv_dgrams);
+	atomic_fetch_add(&total_send_calls, u->nsend_calls - w->send_calls);
+	atomic_fetch_add(&total_send_dgrams, u->nsend_datagrams - w->send_dgrams);
+	w->recv_calls = u->nrecv_calls;
+	w->recv_dgrams = u->nrecv_datagrams;
+	w->send_calls = u->nsend_calls;
+	w->send_dgrams = u->nsend_datagrams;
+
+	if (sender) {
+		if (kq_now_ms() >= t_end) {
+			kq_stop(&w->loop);
+			return;
+		}
+		if (w->udp.blocked || w->pump.ready == 0)
+			pump(&w->pump);
+	}
+	kq_timer_add(&w->loop, &w->tick, (sender) ? 1 : 100);
+}
+
+void* worker_main(void *param)
+{
+	struct worker *w = param;
+	struct kq_udp_conf conf = {};
+	conf.port = (sender) ? 0 : 64000;
+	conf.reuseport = !sender;
+	conf.gro = conf.gso = !nogso;
+	conf.batch = batch;
+	conf.rcvbuf = conf.sndbuf = 4*1024*1024;
+	conf.on_datagram = on_datagram;
+	assert(0 == kq_create_backend(&w->loop, backend, 0));
+	if (0 != kq_udp_open(&w->udp, &w->loop, &conf)) {
+		perror("socket");
+		exit(1);
+	}
+	w->tick.handler = tick;
+	kq_timer_add(&w->loop, &w->tick, 1);
+	if (sender) {
+		w->pump.fd = -1;
+		w->pump.rhandler = pump;
+		kq_yield(&w->loop, &w->pump, KQ_READY_R);
+	}
+	assert(0 == kq_run(&w->loop));
+
+	atomic_fetch_add(&total_errors, w->udp.nsend_errors + w->udp.ntruncated);
+	kq_udp_close(&w->udp);
+	kq_close(&w->loop);
+	atomic_fetch_add(&stopped, 1);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	while (-1 != (opt = getopt(argc, argv, "b:t:B:eGc:l:d:"))) {
+		switch (opt) {
+		case 'b':
+			if (0 == (backend = kq_backend_by_name(optarg))) {
+				fprintf(stderr, "Unsupported backend: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 't':
+			nworkers = atoi(optarg); break;
+		case 'B':
+			batch = atoi(optarg); break;
+		case 'e':
+			echo = 1; break;
+		case 'G':
+			nogso = 1; break;
+		case 'c': {
+			char ip[64];
+			unsigned port;
+			dest.sin_family = AF_INET;
+			if (2 != sscanf(optarg, "%63[^:]:%u", ip, &port)
+				|| 1 != inet_pton(AF_INET, ip, &dest.sin_addr)) {
+				fprintf(stderr, "Invalid address: %s\n", optarg);
+				return 1;
+			}
+			dest.sin_port = htons(port);
+			sender = 1;
+			break;
+		}
+		case 'l':
+			dgram_len = atoi(optarg); break;
+		case 'd':
+			duration_s = atoi(optarg); break;
+		default:
+			fprintf(stderr, "Usage: %s [-b BACKEND] [-t THREADS] [-B BATCH] [-e] [-G] [-c IP:PORT [-l LENGTH] [-d SECONDS]]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (nworkers == 0 || dgram_len > KQ_UDP_DGRAM_MAX)
+		return 1;
+	memset(payload, 'x', dgram_len);
+	t_end = kq_now_ms() + duration_s * 1000;
+
+	struct worker *ws = calloc(nworkers, sizeof(struct worker));
+	assert(ws != NULL);
+	for (unsigned i = 0;  i != nworkers;  i++) {
+		assert(0 == pthread_create(&ws[i].thread, NULL, worker_main, &ws[i]));
+	}
+	if (sender)
+		printf("Sending %zu-byte datagrams to %s:%u from %u sockets\n"
+			, dgram_len, inet_ntoa(dest.sin_addr), ntohs(dest.sin_port), nworkers);
+	else
+		printf("Receiving on port 64000 with %u sockets\n", nworkers);
+
+	while (atomic_load(&stopped) != nworkers) {
+		sleep(1);
+		unsigned long long rc = atomic_exchange(&total_recv_calls, 0), rd = atomic_exchange(&total_recv_dgrams, 0);
+		unsigned long long sc = atomic_exchange(&total_send_calls, 0), sd = atomic_exchange(&total_send_dgrams, 0);
+		if (rd != 0)
+			printf("received: %llu datagrams/s, %.1f per recvmmsg()\n", rd, (double)rd / rc);
+		if (sd != 0)
+			printf("sent: %llu datagrams/s, %.1f per sendmmsg()\n", sd, (double)sd / sc);
+		fflush(stdout);
+	}
+	for (unsigned i = 0;  i != nworkers;  i++) {
+		pthread_join(ws[i].thread, NULL);
+	}
+	printf("errors: %llu\n", (unsigned long long)atomic_load(&total_errors));
+	free(ws);
+	return 0;
+}
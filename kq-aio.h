@@ -0,0 +1,292 @@
+/* Kernel Queue The Complete Guide: kq-aio.h: File I/O engine with Linux AIO
+One file operation at a time can't keep a fast disk busy: NVMe needs dozens of requests in flight.
+The engine keeps up to `depth` O_DIRECT reads and writes in flight and signals completions via eventfd
+ which is attached to the loop, as in epoll-file.c.
+The requests added by the handlers during one wakeup are submitted together with one io_submit() call.
+The aligned I/O buffers are taken from the engine's pool and are reused for the next requests.
+
+When the kernel can't perform AIO on a file (io_submit() fails with ENOSYS or EINVAL)
+ the operation is passed to the thread pool (kq-offload.h), if the engine has one,
+ or else it's performed synchronously and its handler is called immediately.
+Without O_DIRECT the kernel performs AIO synchronously inside io_submit(),
+ so the requests for such files (r->offload = 1) go to the thread pool directly.
+Not thread-safe: each loop has its own engine.
+See epoll-aio.c.
+*/
+#pragma once
+#include "kq.h"
+#include "kq-bufpool.h"
+#include "kq-offload.h"
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>
+
+// GLIBC doesn't have wrappers for these syscalls, so we make our own wrappers
+static inline int kq_io_setup(unsigned nr_events, aio_context_t *ctx_idp)
+{
+	return syscall(SYS_io_setup, nr_events, ctx_idp);
+}
+static inline int kq_io_destroy(aio_context_t ctx_id)
+{
+	return syscall(SYS_io_destroy, ctx_id);
+}
+static inline int kq_io_submit(aio_context_t ctx_id, long nr, struct iocb **iocbpp)
+{
+	return syscall(SYS_io_submit, ctx_id, nr, iocbpp);
+}
+static inline int kq_io_getevents(aio_context_t ctx_id, long min_nr, long nr, struct io_event *events, struct timespec *timeout)
+{
+	return syscall(SYS_io_getevents, ctx_id, min_nr, nr, events, timeout);
+}
+
+enum {
+	KQ_AIO_ALIGN = 4096, // O_DIRECT: buffer address, file offset and size must be aligned to the logical block size
+	KQ_AIO_EVENTS = 64, // max. completions per io_getevents() call
+};
+
+struct kq_aio_req {
+	struct iocb cb;
+	void (*handler)(struct kq_aio_req *r);
+	ssize_t result; // bytes transferred; -1: error
+	int error;
+	void *udata;
+	unsigned offload; // set by the user: the file isn't opened with O_DIRECT
+	struct kq_fop fop; // the operation is performed by the thread pool
+};
+
+struct kq_aio {
+	aio_context_t ctx;
+	struct context obj; // eventfd
+	unsigned depth; // max. requests in flight and queued
+	unsigned inflight;
+	struct iocb **queue; // added but not yet submitted
+	unsigned nqueued;
+	int submitting;
+	struct kq_bufpool bufs;
+	struct kq_offload *pool; // set by the user; NULL: perform the operations synchronously when AIO doesn't work
+
+	unsigned long long nsubmits; // io_submit() calls
+	unsigned long long nops; // operations submitted
+	unsigned long long nwakeups; // eventfd signals
+	unsigned long long nsync; // operations performed synchronously
+	unsigned long long noffload; // operations passed to the thread pool
+};
+
+static void kq_aio_submit(struct kq_aio *a);
+
+static inline void kq_aio_complete(struct kq_aio_req *r, ssize_t res)
+{
+	KQ_PROBE2(aio_complete, r, res);
+	kq_trace_add(KQ_TRACE_AIO_COMPLETE, r, -1, 0, res);
+	r->result = res;
+	r->error = 0;
+	if (res < 0) {
+		r->error = -res;
+		r->result = -1;
+	}
+	r->handler(r);
+}
+
+// receive all completed events and call the handlers
+static void kq_aio_read_events(struct context *obj)
+{
+	struct kq_aio *a = (void*)((char*)obj - offsetof(struct kq_aio, obj));
+	uint64_t val;
+	if (sizeof(val) != read(obj->fd, &val, sizeof(val)))
+		return; // spurious: another call has already received the events
+	a->nwakeups++;
+
+	// don't submit the requests that the handlers add, until all events are processed
+	a->submitting = 1;
+	for (;;) {
+		struct io_event events[KQ_AIO_EVENTS];
+		struct timespec timeout = {};
+		int r = kq_io_getevents(a->ctx, 1, KQ_AIO_EVENTS, events, &timeout);
+		if (r < 0 && errno == EINTR)
+			continue; // interrupted due to UNIX signal
+		if (r <= 0)
+			break; // no more events
+
+		a->inflight -= r;
+		for (int i = 0;  i != r;  i++) {
+			struct kq_aio_req *req = (void*)(size_t)events[i].data;
+			kq_aio_complete(req, events[i].res);
+		}
+		if (r != KQ_AIO_EVENTS)
+			break;
+	}
+	a->submitting = 0;
+
+	kq_aio_submit(a); // one syscall for all the requests added by the handlers
+}
+
+// depth: max. requests in flight
+// buf_size: I/O buffer size; rounded up to KQ_AIO_ALIGN
+static int kq_aio_create(struct kq_aio *a, struct kq_loop *loop, unsigned depth, size_t buf_size)
+{
+	memset(a, 0, sizeof(*a));
+	a->depth = depth;
+	a->obj.fd = -1;
+	buf_size = (buf_size + KQ_AIO_ALIGN-1) & ~(size_t)(KQ_AIO_ALIGN-1);
+	kq_bufpool_init(&a->bufs, buf_size, depth, depth);
+
+	if (NULL == (a->queue = malloc(depth * sizeof(struct iocb*))))
+		return -1;
+	if (0 != kq_io_setup(depth, &a->ctx))
+		goto err;
+	if (-1 == (a->obj.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)))
+		goto err;
+	a->obj.rhandler = kq_aio_read_events;
+	// eventfd is only ever read: attach it like a listening socket
+	if (0 != kq_attach_listener(loop, &a->obj, 0))
+		goto err;
+	return 0;
+
+err:
+	if (a->obj.fd != -1)
+		close(a->obj.fd);
+	if (a->ctx != 0)
+		kq_io_destroy(a->ctx);
+	free(a->queue);
+	return -1;
+}
+
+// wait for the requests in flight (their handlers aren't called) and free all memory.
+// The operations passed to the thread pool must be completed before.
+static void kq_aio_close(struct kq_aio *a)
+{
+	kq_detach(a->obj.loop, &a->obj);
+	close(a->obj.fd);
+	kq_io_destroy(a->ctx); // waits for the requests in flight
+	kq_bufpool_close(&a->bufs);
+	free(a->queue);
+}
+
+// get an aligned I/O buffer of the engine's buffer size; NULL: all `depth` buffers are in use
+static inline void* kq_aio_buf(struct kq_aio *a)
+{
+	return kq_bufpool_get(&a->bufs);
+}
+
+static inline void kq_aio_buf_free(struct kq_aio *a, void *buf)
+{
+	kq_bufpool_put(&a->bufs, buf);
+}
+
+static void kq_aio_fallback(struct kq_aio *a, struct iocb *cb);
+
+static int kq_aio_add(struct kq_aio *a, struct kq_aio_req *r, unsigned op, int fd, void *buf, size_t len, uint64_t off)
+{
+	if (a->inflight + a->nqueued == a->depth) {
+		errno = EAGAIN;
+		return -1;
+	}
+	memset(&r->cb, 0, sizeof(r->cb));
+	r->cb.aio_data = (size_t)r;
+	r->cb.aio_lio_opcode = op;
+	r->cb.aio_fildes = fd;
+	r->cb.aio_buf = (size_t)buf;
+	r->cb.aio_nbytes = len;
+	r->cb.aio_offset = off;
+	r->cb.aio_flags = IOCB_FLAG_RESFD;
+	r->cb.aio_resfd = a->obj.fd;
+	if (r->offload && a->pool != NULL) {
+		kq_aio_fallback(a, &r->cb);
+		return 0;
+	}
+	a->queue[a->nqueued++] = &r->cb;
+	return 0;
+}
+
+// add a read request; r->handler is called when it completes.
+// The request is submitted by kq_aio_submit() or, if added from a handler, after all the current completions are processed.
+// Return -1 with EAGAIN if `depth` requests are already in flight or queued.
+static inline int kq_aio_read(struct kq_aio *a, struct kq_aio_req *r, int fd, void *buf, size_t len, uint64_t off)
+{
+	return kq_aio_add(a, r, IOCB_CMD_PREAD, fd, buf, len, off);
+}
+
+static inline int kq_aio_write(struct kq_aio *a, struct kq_aio_req *r, int fd, const void *buf, size_t len, uint64_t off)
+{
+	return kq_aio_add(a, r, IOCB_CMD_PWRITE, fd, (void*)buf, len, off);
+}
+
+// the thread pool has completed the operation
+static void kq_aio_fop_done(struct kq_fop *f)
+{
+	struct kq_aio_req *r = (void*)((char*)f - offsetof(struct kq_aio_req, fop));
+	struct kq_aio *a = f->udata;
+	a->inflight--;
+
+	int submitting = a->submitting;
+	a->submitting = 1;
+	kq_aio_complete(r, (f->result >= 0) ? f->result : -f->error);
+	a->submitting = submitting;
+	kq_aio_submit(a);
+}
+
+// the operation can't be performed with AIO: pass it to the thread pool or perform it on the loop's thread
+static void kq_aio_fallback(struct kq_aio *a, struct iocb *cb)
+{
+	if (a->pool != NULL) {
+		struct kq_aio_req *req = (void*)(size_t)cb->aio_data;
+		a->noffload++;
+		a->inflight++;
+		req->fop.handler = kq_aio_fop_done;
+		req->fop.udata = a;
+		if (cb->aio_lio_opcode == IOCB_CMD_PREAD)
+			kq_offload_pread(a->pool, a->obj.loop, &req->fop, cb->aio_fildes, (void*)(size_t)cb->aio_buf, cb->aio_nbytes, cb->aio_offset);
+		else
+			kq_offload_pwrite(a->pool, a->obj.loop, &req->fop, cb->aio_fildes, (void*)(size_t)cb->aio_buf, cb->aio_nbytes, cb->aio_offset);
+		return;
+	}
+
+	a->nsync++;
+	ssize_t r;
+	if (cb->aio_lio_opcode == IOCB_CMD_PREAD)
+		r = pread(cb->aio_fildes, (void*)(size_t)cb->aio_buf, cb->aio_nbytes, cb->aio_offset);
+	else
+		r = pwrite(cb->aio_fildes, (void*)(size_t)cb->aio_buf, cb->aio_nbytes, cb->aio_offset);
+	kq_aio_complete((void*)(size_t)cb->aio_data, (r >= 0) ? r : -errno);
+}
+
+// submit all queued requests with as few io_submit() calls as possible
+static void kq_aio_submit(struct kq_aio *a)
+{
+	if (a->submitting)
+		return; // the caller will submit
+	a->submitting = 1;
+	while (a->nqueued != 0) {
+		int r = kq_io_submit(a->ctx, a->nqueued, a->queue);
+		KQ_PROBE2(aio_submit, a, r);
+		kq_trace_add(KQ_TRACE_AIO_SUBMIT, a, -1, 0, r);
+		if (r > 0) {
+			a->nsubmits++;
+			a->nops += r;
+			a->inflight += r;
+			a->nqueued -= r;
+			memmove(a->queue, a->queue + r, a->nqueued * sizeof(struct iocb*));
+			continue;
+		}
+
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 && errno == EAGAIN && a->inflight != 0)
+			break; // no resources: submit after the next completion
+
+		// the first request can't be performed asynchronously
+		struct iocb *cb = a->queue[0];
+		a->nqueued--;
+		memmove(a->queue, a->queue + 1, a->nqueued * sizeof(struct iocb*));
+		if (r < 0 && (errno == EAGAIN || errno == ENOSYS || errno == EINVAL)) {
+			// no resources to complete this I/O operation
+			// or the system can't perform AIO on this file
+			kq_aio_fallback(a, cb);
+		} else {
+			kq_aio_complete((void*)(size_t)cb->aio_data, (r < 0) ? -errno : -EIO);
+		}
+	}
+	a->submitting = 0;
+}
@@ -0,0 +1,161 @@
+/* Kernel Queue The Complete Guide: kq-bufpool.h: Pool of fixed-size buffers for one loop
+A connection needs a receive buffer only from the moment the data arrives until it's processed.
+Most of the time the connections are idle, so instead of a buffer per connection
+ the loop keeps a pool of buffers which connections take on READ event and return when the input is consumed.
+The memory for idle connections is then just the size of their objects.
+The buffers are allocated in page-aligned chunks and are never returned to malloc() until the pool is closed.
+The pool can also supply the buffers for an io_uring provided-buffer ring (kq_uring_bufs_create_pool()).
+Not thread-safe: each loop has its own pool.
+*/
+#pragma once
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct kq_bufpool_chunk {
+	struct kq_bufpool_chunk *next;
+	char *mem;
+};
+
+struct kq_bufpool {
+	size_t size; // buffer size
+	unsigned chunk_bufs; // buffers allocated at once
+	unsigned max_bufs; // 0: unlimited
+	void *free; // free buffers; the first pointer-size bytes of a free buffer are used for the list
+	struct kq_bufpool_chunk *chunks;
+	unsigned nbufs, nfree;
+};
+
+// size: buffer size
+// chunk_bufs: the number of buffers to allocate at once when there are no free buffers
+// max_bufs: the max. total number of buffers; 0: unlimited
+static void kq_bufpool_init(struct kq_bufpool *p, size_t size, unsigned chunk_bufs, unsigned max_bufs)
+{
+	p->size = (size < sizeof(void*)) ? sizeof(void*) : size;
+	p->chunk_bufs = (chunk_bufs != 0) ? chunk_bufs : 64;
+	p->max_bufs = max_bufs;
+	p->free = NULL;
+	p->chunks = NULL;
+	p->nbufs = p->nfree = 0;
+}
+
+static int kq_bufpool_grow(struct kq_bufpool *p, unsigned n)
+{
+	if (p->max_bufs != 0) {
+		if (p->nbufs == p->max_bufs) {
+			errno = ENOBUFS;
+			return -1;
+		}
+		if (n > p->max_bufs - p->nbufs)
+			n = p->max_bufs - p->nbufs;
+	}
+
+	struct kq_bufpool_chunk *c = malloc(sizeof(struct kq_bufpool_chunk));
+	if (c == NULL)
+		return -1;
+	size_t cap = ((size_t)n * p->size + 4095) & ~(size_t)4095;
+	c->mem = aligned_alloc(4096, cap);
+	if (c->mem == NULL) {
+		free(c);
+		return -1;
+	}
+	c->next = p->chunks;
+	p->chunks = c;
+
+	for (unsigned i = n;  i != 0;  i--) {
+		void *buf = c->mem + (size_t)(i - 1) * p->size;
+		*(void**)buf = p->free;
+		p->free = buf;
+	}
+	p->nbufs += n;
+	p->nfree += n;
+	return 0;
+}
+
+// allocate in advance to avoid any malloc() calls in the processing loop
+static int kq_bufpool_reserve(struct kq_bufpool *p, unsigned n)
+{
+	if (n <= p->nfree)
+		return 0;
+	return kq_bufpool_grow(p, n - p->nfree);
+}
+
+// get a free buffer; NULL: the limit is reached or no memory
+static inline void* kq_bufpool_get(struct kq_bufpool *p)
+{
+	if (p->free == NULL
+		&& 0 != kq_bufpool_grow(p, p->chunk_bufs))
+		return NULL;
+	void *buf = p->free;
+	p->free = *(void**)buf;
+	p->nfree--;
+	return buf;
+}
+
+static inline void kq_bufpool_put(struct kq_bufpool *p, void *buf)
+{
+	*(void**)buf = p->free;
+	p->free = buf;
+	p->nfree++;
+}
+
+// return the buffer to the pool, or free it if it was enlarged
+static void kq_bufpool_buf_free(struct kq_bufpool *p, char **buf, size_t *cap)
+{
+	if (*buf == NULL)
+		return;
+	if (*cap == p->size)
+		kq_bufpool_put(p, *buf);
+	else
+		free(*buf);
+	*buf = NULL;
+	*cap = 0;
+}
+
+// make the buffer large enough for `need` bytes, preserving `used` bytes of data.
+// The buffer is taken from the pool; if the data doesn't fit, it's moved to a larger buffer from the heap.
+static int kq_bufpool_buf_grow(struct kq_bufpool *p, char **buf, size_t *cap, size_t used, size_t need)
+{
+	if (need <= *cap)
+		return 0;
+	if (*buf == NULL && need <= p->size) {
+		if (NULL == (*buf = kq_bufpool_get(p)))
+			return -1;
+		*cap = p->size;
+		return 0;
+	}
+
+	size_t ncap = p->size * 2;
+	while (ncap < need)
+		ncap *= 2;
+	char *b;
+	if (*buf != NULL && *cap != p->size) {
+		if (NULL == (b = realloc(*buf, ncap)))
+			return -1;
+	} else {
+		if (NULL == (b = malloc(ncap)))
+			return -1;
+		if (*buf != NULL) {
+			memcpy(b, *buf, used);
+			kq_bufpool_put(p, *buf);
+		}
+	}
+	*buf = b;
+	*cap = ncap;
+	return 0;
+}
+
+// free all memory; the buffers which are still in use become invalid
+static void kq_bufpool_close(struct kq_bufpool *p)
+{
+	struct kq_bufpool_chunk *c = p->chunks;
+	while (c != NULL) {
+		struct kq_bufpool_chunk *next = c->next;
+		free(c->mem);
+		free(c);
+		c = next;
+	}
+	p->chunks = NULL;
+	p->free = NULL;
+	p->nbufs = p->nfree = 0;
+}
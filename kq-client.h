@@ -0,0 +1,628 @@
+/* Kernel Queue The Complete Guide: kq-client.h: Asynchronous client with keep-alive connection pools
+Each destination (address) has its own pool of connections which stay open between requests,
+ so most requests don't pay for a TCP handshake.
+A request is sent over an idle connection of the pool, or else over a new connection,
+ or, when the pool has reached its limit of connections, it's pipelined behind the other requests
+ on the least loaded connection; if that's not allowed either, the request waits in the pool's queue.
+
+The connection is the same state machine as in epoll-connect.c: asynchronous connect(),
+ then sending the requests, then receiving the responses, all with non-blocking handlers.
+The requests which are added during one loop iteration are sent with one sendmsg() call per connection:
+ the connection yields (kq_yield()), and the loop calls its WRITE handler after the current events are processed.
+The client doesn't know the protocol: the user's parse() function finds the end of each response.
+
+Each connection has one timer: connect timeout, then response timeout while there are requests in flight
+ (restarted whenever data is received), then idle timeout which closes the unused connections.
+A server may close a keep-alive connection at any moment:
+ if the connection had served requests before and fails without any response data,
+ an idempotent request is sent once more over another connection.
+Not thread-safe: each loop has its own client.
+See epoll-client.c.
+*/
+#pragma once
+#include "kq.h"
+#include "kq-slab.h"
+#include "kq-bufpool.h"
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+struct kq_client;
+struct kq_client_pool;
+
+struct kq_request {
+	// the request data; must stay valid until on_complete() is called
+	const void *data;
+	size_t len;
+
+	// find the end of the response which starts at `data`.
+	// Return its length;  0: the response is incomplete;  -1: invalid response
+	int (*parse)(struct kq_request *r, const char *data, size_t len);
+
+	// called once when the response is received or the request has failed (error != 0).
+	// The response data is valid only during the call.
+	void (*on_complete)(struct kq_request *r, const char *resp, size_t len);
+	void *udata;
+
+	unsigned idempotent :1; // may be sent once more if the connection fails before the response arrives
+	unsigned close :1; // set by parse(): the server closes the connection after this response
+	int error; // 0: success;  ETIMEDOUT, ECONNREFUSED, ECONNRESET, EPROTO, EMSGSIZE, ...
+
+	// internal
+	struct kq_request *next;
+	size_t sent;
+	unsigned retried :1;
+};
+
+struct kq_client_conn {
+	struct context obj; // must be the first member
+	struct kq_client *cl;
+	struct kq_client_pool *pool;
+	struct kq_client_conn *prev, *next; // in the pool's idle or busy list
+
+	// the requests in order: the first one waits for its response
+	struct kq_request *reqs, **reqs_last;
+	struct kq_request *unsent; // the first request which isn't completely sent; NULL: all are sent
+	unsigned nreqs;
+	unsigned nsent; // requests sent
+	unsigned nserved; // responses received
+
+	// received data which wasn't yet processed; NULL: no data
+	char *in;
+	size_t in_len, in_cap;
+
+	struct kq_timer timer; // connect, response or idle timeout
+	unsigned connecting :1;
+	unsigned idle :1; // in the idle list
+	unsigned closing :1; // the server closes the connection: don't send any more requests;
+		// it doesn't process the requests behind the last response, so they can be sent again
+};
+
+struct kq_client_pool {
+	struct kq_client *cl;
+	struct kq_client_pool *next;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	struct kq_client_conn *idle; // the most recently used first: the others time out sooner
+	struct kq_client_conn *busy; // connecting or have requests in flight
+	unsigned nconns;
+	struct kq_request *queue, **queue_last; // waiting for a connection
+};
+
+struct kq_client_conf {
+	unsigned max_conns; // connections per destination; 0: default
+	unsigned max_pipeline; // requests in flight per connection; 0 or 1: no pipelining
+
+	// 0: no timeout
+	unsigned connect_timeout_ms;
+	unsigned response_timeout_ms; // no data is received while waiting for a response
+	unsigned idle_timeout_ms; // close a pooled connection which isn't used
+
+	size_t in_bufsize; // size of the buffers in the pool
+	size_t in_maxsize; // fail the request if its response is larger
+	size_t read_budget; // max. bytes to receive per one handler call; 0: default
+};
+
+struct kq_client {
+	struct kq_loop *loop;
+	struct kq_client_conf conf;
+	struct kq_client_pool *pools;
+	struct kq_slab conns;
+	struct kq_bufpool bufs;
+
+	unsigned long long nrequests;
+	unsigned long long nconnects; // connections opened
+	unsigned long long nreused; // requests sent over an already open connection
+	unsigned long long npipelined; // requests sent while another request was waiting for its response
+	unsigned long long nretries;
+	unsigned long long nerrors;
+	unsigned long long ntimeouts;
+};
+
+enum {
+	KQ_CLIENT_IOV_MAX = 64,
+};
+
+static void kq_client_conn_read(struct context *obj);
+static void kq_client_conn_write(struct context *obj);
+static void kq_client_conn_connected(struct context *obj);
+static void kq_client_conn_timeout(struct kq_timer *t);
+static void kq_client_dispatch(struct kq_client_pool *p);
+
+static void kq_client_conn_link(struct kq_client_conn **list, struct kq_client_conn *c)
+{
+	c->prev = NULL;
+	c->next = *list;
+	if (*list != NULL)
+		(*list)->prev = c;
+	*list = c;
+}
+
+static void kq_client_conn_unlink(struct kq_client_conn **list, struct kq_client_conn *c)
+{
+	if (c->prev != NULL)
+		c->prev->next = c->next;
+	else
+		*list = c->next;
+	if (c->next != NULL)
+		c->next->prev = c->prev;
+}
+
+// return the object to the slab: called by the loop after the current batch of events is processed
+static void kq_client_conn_release(struct context *obj)
+{
+	struct kq_client_conn *c = (struct kq_client_conn*)obj;
+	kq_bufpool_buf_free(&c->cl->bufs, &c->in, &c->in_cap);
+	kq_slab_free(&c->cl->conns, c);
+}
+
+// move the connection to the idle or busy list according to its state and restart its timer
+static void kq_client_conn_update(struct kq_client_conn *c)
+{
+	struct kq_client_pool *p = c->pool;
+	unsigned idle = (!c->connecting && c->nreqs == 0);
+	if (idle != c->idle) {
+		kq_client_conn_unlink((c->idle) ? &p->idle : &p->busy, c);
+		kq_client_conn_link((idle) ? &p->idle : &p->busy, c);
+		c->idle = idle;
+	}
+
+	const struct kq_client_conf *conf = &c->cl->conf;
+	unsigned ms = (c->connecting) ? conf->connect_timeout_ms
+		: (c->nreqs != 0) ? conf->response_timeout_ms
+		: conf->idle_timeout_ms;
+	if (ms != 0)
+		kq_timer_add(c->cl->loop, &c->timer, ms);
+	else
+		kq_timer_remove(c->cl->loop, &c->timer);
+}
+
+// start connecting to the pool's destination
+static struct kq_client_conn* kq_client_conn_open(struct kq_client_pool *p)
+{
+	struct kq_client *cl = p->cl;
+	struct kq_client_conn *c = kq_slab_alloc(&cl->conns);
+	if (c == NULL)
+		return NULL;
+	// preserve the generation left from the previous connection in this slot
+	unsigned gen = c->obj.gen;
+	memset(c, 0, sizeof(*c));
+	c->obj.gen = gen;
+	c->cl = cl;
+	c->pool = p;
+	c->reqs_last = &c->reqs;
+	c->timer.handler = kq_client_conn_timeout;
+
+	c->obj.fd = socket(p->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (c->obj.fd == -1)
+		goto err;
+	int val = 1;
+	setsockopt(c->obj.fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+
+	// KQ signals WRITE when the connection is established, READ and WRITE if it has failed
+	c->obj.rhandler = kq_client_conn_read;
+	c->obj.whandler = kq_client_conn_connected;
+	if (0 != kq_attach(cl->loop, &c->obj))
+		goto err;
+	c->obj.release = kq_client_conn_release;
+	if (0 != connect(c->obj.fd, (struct sockaddr*)&p->addr, p->addr_len)
+		&& errno != EINPROGRESS) {
+		// KQ may still return an event for it
+		int e = errno;
+		kq_retire(cl->loop, &c->obj);
+		errno = e;
+		return NULL;
+	}
+	c->connecting = 1;
+	cl->nconnects++;
+
+	p->nconns++;
+	kq_client_conn_link(&p->busy, c);
+	kq_client_conn_update(c);
+	return c;
+
+err:
+	if (c->obj.fd != -1) {
+		int e = errno;
+		close(c->obj.fd);
+		errno = e;
+	}
+	kq_slab_free(&cl->conns, c);
+	return NULL;
+}
+
+// remove the connection from its pool and close it
+static void kq_client_conn_close(struct kq_client_conn *c)
+{
+	struct kq_client_pool *p = c->pool;
+	kq_client_conn_unlink((c->idle) ? &p->idle : &p->busy, c);
+	p->nconns--;
+	kq_timer_remove(c->cl->loop, &c->timer);
+	kq_retire(c->cl->loop, &c->obj);
+}
+
+static void kq_client_request_fail(struct kq_client *cl, struct kq_request *r, int error)
+{
+	r->error = error;
+	cl->nerrors++;
+	r->on_complete(r, NULL, 0);
+}
+
+// close the connection and decide the fate of its requests:
+//  the requests which were never sent (or which the server has refused to process) go back to the queue;
+//  the idempotent requests go back to the queue once, if `retry` is set
+//  and the connection had served other requests before (it was probably closed by the server while idle);
+//  the others fail with `err`.
+static void kq_client_conn_fail(struct kq_client_conn *c, int err, int retry)
+{
+	struct kq_client *cl = c->cl;
+	struct kq_client_pool *p = c->pool;
+	struct kq_request *r = c->reqs;
+	int never_connected = c->connecting;
+	int unprocessed = c->closing;
+	int partial = (c->in_len != 0); // the first request has received a part of its response
+	retry = retry && (c->nserved != 0);
+	c->reqs = NULL;
+	c->reqs_last = &c->reqs;
+	c->unsent = NULL;
+	c->nreqs = 0;
+	kq_client_conn_close(c);
+
+	struct kq_request *again = NULL, **again_last = &again;
+	struct kq_request *failed = NULL, **failed_last = &failed;
+	for (int first = 1;  r != NULL;  first = 0) {
+		struct kq_request *next = r->next;
+		r->next = NULL;
+		if ((r->sent == 0 && !never_connected) || unprocessed) {
+			r->sent = 0;
+			*again_last = r;
+			again_last = &r->next;
+		} else if (retry && r->idempotent && !r->retried && !(first && partial)) {
+			r->retried = 1;
+			r->sent = 0;
+			cl->nretries++;
+			*again_last = r;
+			again_last = &r->next;
+		} else {
+			*failed_last = r;
+			failed_last = &r->next;
+		}
+		r = next;
+	}
+
+	// the requests to send again go first: they are the oldest
+	if (again != NULL) {
+		*again_last = p->queue;
+		if (p->queue == NULL)
+			p->queue_last = again_last;
+		p->queue = again;
+	}
+	kq_client_dispatch(p);
+
+	while (failed != NULL) {
+		r = failed;
+		failed = r->next;
+		kq_client_request_fail(cl, r, err);
+	}
+}
+
+// send as much of the requests as the socket accepts
+static void kq_client_conn_flush(struct kq_client_conn *c)
+{
+	while (c->unsent != NULL) {
+		struct iovec iov[KQ_CLIENT_IOV_MAX];
+		unsigned n = 0;
+		for (struct kq_request *r = c->unsent;  r != NULL && n != KQ_CLIENT_IOV_MAX;  r = r->next) {
+			iov[n].iov_base = (char*)r->data + r->sent;
+			iov[n].iov_len = r->len - r->sent;
+			n++;
+		}
+		struct msghdr m = {};
+		m.msg_iov = iov;
+		m.msg_iovlen = n;
+		ssize_t sent = sendmsg(c->obj.fd, &m, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				// the socket's write buffer is full
+				c->obj.whandler = kq_client_conn_write;
+				return;
+			}
+			kq_client_conn_fail(c, errno, 1);
+			return;
+		}
+
+		while (sent != 0) {
+			struct kq_request *r = c->unsent;
+			if (r->sent == 0) {
+				if (c->nsent++ != 0)
+					c->cl->nreused++;
+				if (r != c->reqs)
+					c->cl->npipelined++; // the previous request is still waiting for its response
+			}
+			size_t left = r->len - r->sent;
+			if ((size_t)sent < left) {
+				r->sent += sent;
+				break;
+			}
+			r->sent = r->len;
+			sent -= left;
+			c->unsent = r->next;
+		}
+	}
+	c->obj.whandler = NULL; // we don't want any more signals from KQ
+}
+
+static void kq_client_conn_write(struct context *obj)
+{
+	kq_client_conn_flush((struct kq_client_conn*)obj);
+}
+
+// the result of the asynchronous connect()
+static void kq_client_conn_connected(struct context *obj)
+{
+	struct kq_client_conn *c = (struct kq_client_conn*)obj;
+	int err = 0;
+	socklen_t len = sizeof(err);
+	if (0 != getsockopt(obj->fd, SOL_SOCKET, SO_ERROR, &err, &len))
+		err = errno;
+	KQ_PROBE3(connect, obj, obj->fd, err);
+	kq_trace_add(KQ_TRACE_CONNECT, obj, obj->fd, obj->gen, err);
+	if (err != 0) {
+		kq_client_conn_fail(c, err, 0);
+		return;
+	}
+	c->connecting = 0;
+	kq_client_conn_flush(c);
+	if (c->obj.fd != -1)
+		kq_client_conn_update(c);
+}
+
+// complete the requests whose responses are received.
+// Return -1 if the connection is closed
+static int kq_client_conn_process(struct kq_client_conn *c)
+{
+	size_t off = 0;
+	while (c->reqs != NULL && off != c->in_len) {
+		struct kq_request *r = c->reqs;
+		int n = r->parse(r, c->in + off, c->in_len - off);
+		if (n == 0)
+			break; // need more data
+		if (n < 0) {
+			kq_client_conn_fail(c, EPROTO, 0);
+			return -1;
+		}
+
+		if (c->unsent == r)
+			r->close = 1; // the server has responded before receiving the whole request
+		if (r->close) {
+			// don't send anything more: the requests behind this one will be sent over another connection
+			c->closing = 1;
+			c->unsent = NULL;
+			c->obj.whandler = NULL;
+		}
+		if (NULL == (c->reqs = r->next))
+			c->reqs_last = &c->reqs;
+		c->nreqs--;
+		c->nserved++;
+		off += n;
+		r->error = 0;
+		r->on_complete(r, c->in + off - n, n);
+	}
+	memmove(c->in, c->in + off, c->in_len - off);
+	c->in_len -= off;
+	return 0;
+}
+
+static void kq_client_conn_read(struct context *obj)
+{
+	struct kq_client_conn *c = (struct kq_client_conn*)obj;
+	struct kq_client *cl = c->cl;
+	size_t nread = 0;
+	int err;
+	for (;;) {
+		if (nread >= cl->conf.read_budget) {
+			// there may be more data: continue after the other connections have been processed
+			kq_yield(cl->loop, &c->obj, KQ_READY_R);
+			break;
+		}
+
+		if (c->in_len == c->in_cap) {
+			if (c->in_cap >= cl->conf.in_maxsize) {
+				err = EMSGSIZE; // the response is too large
+				goto fail;
+			}
+			if (0 != kq_bufpool_buf_grow(&cl->bufs, &c->in, &c->in_cap, c->in_len, c->in_len + 1)) {
+				err = ENOMEM;
+				goto fail;
+			}
+		}
+
+		ssize_t r = recv(c->obj.fd, c->in + c->in_len, c->in_cap - c->in_len, 0);
+		if (r > 0) {
+			if (c->reqs == NULL) {
+				err = EPROTO; // data without a request
+				goto fail;
+			}
+			c->in_len += r;
+			nread += r;
+			if (0 != kq_client_conn_process(c))
+				return;
+
+		} else if (r == 0) {
+			// the server has closed the connection
+			err = ECONNRESET;
+			goto fail;
+
+		} else if (errno == EINTR) {
+			continue;
+
+		} else if (errno == EAGAIN) {
+			// the socket's read buffer is empty
+			break;
+
+		} else {
+			err = errno;
+			goto fail;
+		}
+	}
+
+	if (c->in_len == 0)
+		kq_bufpool_buf_free(&cl->bufs, &c->in, &c->in_cap); // all input is processed
+	if (c->closing && c->nreqs == 0) {
+		kq_client_conn_fail(c, 0, 0);
+		return;
+	}
+	kq_client_conn_update(c);
+	kq_client_dispatch(c->pool); // the connection may take more requests now
+	return;
+
+fail:
+	kq_client_conn_fail(c, err, 1);
+}
+
+static void kq_client_conn_timeout(struct kq_timer *t)
+{
+	struct kq_client_conn *c = (void*)((char*)t - offsetof(struct kq_client_conn, timer));
+	if (c->idle) {
+		kq_client_conn_fail(c, 0, 0); // the connection isn't needed
+		return;
+	}
+	c->cl->ntimeouts++;
+	kq_client_conn_fail(c, ETIMEDOUT, 0);
+}
+
+// send the queued requests over the pool's connections
+static void kq_client_dispatch(struct kq_client_pool *p)
+{
+	struct kq_client *cl = p->cl;
+	while (p->queue != NULL) {
+		struct kq_client_conn *c = p->idle;
+		if (c == NULL && p->nconns < cl->conf.max_conns) {
+			if (NULL == (c = kq_client_conn_open(p))) {
+				// e.g. no more descriptors: fail the request instead of waiting forever
+				struct kq_request *r = p->queue;
+				if (NULL == (p->queue = r->next))
+					p->queue_last = &p->queue;
+				kq_client_request_fail(cl, r, errno);
+				continue;
+			}
+		}
+		if (c == NULL) {
+			// pipeline the request behind the others on the least loaded connection
+			for (struct kq_client_conn *i = p->busy;  i != NULL;  i = i->next) {
+				if (!i->closing && i->nreqs < cl->conf.max_pipeline
+					&& (c == NULL || i->nreqs < c->nreqs))
+					c = i;
+			}
+			if (c == NULL)
+				break; // all connections are busy: the requests wait in the queue
+		}
+
+		struct kq_request *r = p->queue;
+		if (NULL == (p->queue = r->next))
+			p->queue_last = &p->queue;
+		r->next = NULL;
+		*c->reqs_last = r;
+		c->reqs_last = &r->next;
+		if (c->unsent == NULL)
+			c->unsent = r;
+		c->nreqs++;
+		if (c->nreqs == 1)
+			kq_client_conn_update(c); // becomes busy
+
+		if (!c->connecting && c->obj.whandler == NULL) {
+			// send all the requests added during this iteration together
+			c->obj.whandler = kq_client_conn_write;
+			kq_yield(cl->loop, &c->obj, KQ_READY_W);
+		}
+	}
+}
+
+// get the pool of connections for the address; the unused bytes of `addr` (e.g. sin_zero) must be zero
+static struct kq_client_pool* kq_client_pool(struct kq_client *cl, const struct sockaddr *addr, socklen_t addr_len)
+{
+	struct kq_client_pool *p;
+	for (p = cl->pools;  p != NULL;  p = p->next) {
+		if (p->addr_len == addr_len && !memcmp(&p->addr, addr, addr_len))
+			return p;
+	}
+	if (addr_len > sizeof(p->addr)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (NULL == (p = calloc(1, sizeof(struct kq_client_pool))))
+		return NULL;
+	p->cl = cl;
+	memcpy(&p->addr, addr, addr_len);
+	p->addr_len = addr_len;
+	p->queue_last = &p->queue;
+	p->next = cl->pools;
+	cl->pools = p;
+	return p;
+}
+
+// send the request to the pool's destination.
+// r->on_complete() is called by the loop when the response is received or the request has failed;
+//  it's called from inside this function only if a new connection can't be created.
+// on_complete() may send new requests.
+static void kq_client_request(struct kq_client_pool *p, struct kq_request *r)
+{
+	r->next = NULL;
+	r->sent = 0;
+	r->retried = 0;
+	r->close = 0;
+	r->error = 0;
+	p->cl->nrequests++;
+	*p->queue_last = r;
+	p->queue_last = &r->next;
+	kq_client_dispatch(p);
+}
+
+static int kq_client_create(struct kq_client *cl, struct kq_loop *loop, const struct kq_client_conf *conf)
+{
+	memset(cl, 0, sizeof(*cl));
+	cl->loop = loop;
+	cl->conf = *conf;
+	if (cl->conf.max_conns == 0)
+		cl->conf.max_conns = 16;
+	if (cl->conf.max_pipeline == 0)
+		cl->conf.max_pipeline = 1;
+	if (cl->conf.in_bufsize == 0)
+		cl->conf.in_bufsize = 4*1024;
+	if (cl->conf.in_maxsize < cl->conf.in_bufsize)
+		cl->conf.in_maxsize = 1024*1024;
+	if (cl->conf.read_budget == 0)
+		cl->conf.read_budget = 256*1024;
+	kq_slab_init(&cl->conns, sizeof(struct kq_client_conn), 0);
+	kq_bufpool_init(&cl->bufs, cl->conf.in_bufsize, 0, 0);
+	return 0;
+}
+
+// close all connections and free the memory.
+// Call it after the loop has stopped: the requests in progress are abandoned without calling on_complete().
+static void kq_client_close(struct kq_client *cl)
+{
+	struct kq_client_pool *p = cl->pools;
+	while (p != NULL) {
+		struct kq_client_pool *next = p->next;
+		struct kq_client_conn **lists[] = { &p->idle, &p->busy };
+		for (unsigned i = 0;  i != 2;  i++) {
+			for (struct kq_client_conn *c = *lists[i];  c != NULL;  c = c->next) {
+				kq_timer_remove(cl->loop, &c->timer);
+				kq_detach(cl->loop, &c->obj);
+				close(c->obj.fd);
+				kq_bufpool_buf_free(&cl->bufs, &c->in, &c->in_cap);
+			}
+		}
+		free(p);
+		p = next;
+	}
+	cl->pools = NULL;
+	kq_slab_close(&cl->conns);
+	kq_bufpool_close(&cl->bufs);
+}
@@ -0,0 +1,491 @@
+/* Kernel Queue The Complete Guide: kq-connect.h: Asynchronous connect engine with happy eyeballs
+A dial connects to one endpoint which has several candidate addresses, e.g. the IPv6 and IPv4 addresses of a host name,
+ and returns the first socket which has connected (RFC 8305 "Happy Eyeballs"):
+ the candidates are tried in order, the next one starts when the previous one fails
+ or hasn't connected within the attempt delay (250ms), and the slower attempts are closed when one succeeds.
+kq_dial_resolve() orders the candidates the RFC way: the families alternate, starting with the preferred one.
+
+Each attempt has its own deadline, so a black-holed address costs attempt_timeout_ms
+ instead of the kernel's SYN retries (about 2 minutes).
+When all candidates have failed, the dial starts over after a backoff which doubles on each retry (with jitter),
+ until the retries are exhausted or the dial's own deadline expires.
+The dialer runs any number of dials at once, and max_dials limits how many are in progress: the others wait in order.
+Not thread-safe: each loop has its own dialer.
+See epoll-dial.c.
+*/
+#pragma once
+#include "kq.h"
+#include "kq-slab.h"
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+struct kq_dialer;
+struct kq_dial;
+
+enum {
+	KQ_DIAL_ADDRS = 8, // candidate addresses per dial
+};
+
+struct kq_dial_attempt {
+	struct context obj; // must be the first member
+	struct kq_dialer *dl;
+	struct kq_dial *d;
+	struct kq_dial_attempt *next; // in the dial's list
+	struct kq_timer timer; // attempt deadline
+	unsigned addr; // index of the candidate
+};
+
+struct kq_dial {
+	// the candidates in order of preference; see kq_dial_add(), kq_dial_resolve()
+	struct sockaddr_storage addrs[KQ_DIAL_ADDRS];
+	socklen_t addr_lens[KQ_DIAL_ADDRS];
+	unsigned naddrs;
+
+	// called once when the dial has completed.
+	// fd: the connected socket (non-blocking, not attached to any loop), which now belongs to the user;
+	//  -1 if the dial has failed with `error` (ETIMEDOUT, ECONNREFUSED, ENETUNREACH, ...)
+	void (*on_done)(struct kq_dial *d, int fd, int error);
+	void *udata;
+
+	// the result
+	int addr; // index of the candidate which has connected;  -1: none
+	unsigned nattempts; // connect() calls
+	unsigned long long time_ms; // from the start (not from the queue) to the result
+
+	// internal
+	struct kq_dialer *dl;
+	struct kq_dial *prev, *next; // in the dialer's active list or queue
+	struct kq_dial_attempt *attempts; // in progress
+	unsigned nactive;
+	unsigned next_addr; // the next candidate to try in this round
+	unsigned round; // 0: the first try;  N: N-th retry
+	int last_error;
+	unsigned long long start_ms;
+	struct kq_timer next_timer; // start the next attempt: attempt delay or backoff
+	struct kq_timer deadline;
+	unsigned queued :1;
+	unsigned active :1;
+};
+
+struct kq_dialer_conf {
+	unsigned attempt_delay_ms; // start the next candidate if the current attempt is still in progress; 0: default (250)
+	unsigned attempt_timeout_ms; // close an attempt which hasn't connected; 0: default (2000)
+	unsigned timeout_ms; // fail the dial with ETIMEDOUT; 0: no limit except the retries
+	unsigned retries; // rounds over all candidates after the first one has failed
+	unsigned backoff_ms; // before the first retry, then doubled; 0: default (100)
+	unsigned backoff_max_ms; // 0: default (5000)
+	unsigned max_dials; // dials in progress at once; 0: no limit
+};
+
+struct kq_dialer {
+	struct kq_loop *loop;
+	struct kq_dialer_conf conf;
+	struct kq_slab attempts;
+	struct kq_dial *active; // in progress
+	struct kq_dial *queue, *queue_last; // waiting for max_dials
+	unsigned nactive;
+	unsigned seed; // backoff jitter
+
+	unsigned long long ndials;
+	unsigned long long nconnected;
+	unsigned long long nfailed;
+	unsigned long long nattempts; // connect() calls
+	unsigned long long nattempt_timeouts;
+	unsigned long long nfallbacks; // dials won by a candidate other than the first one
+	unsigned long long nretries;
+	unsigned long long ntimeouts; // dials which have reached timeout_ms
+};
+
+static void kq_dial_next(struct kq_dial *d);
+static void kq_dial_begin(struct kq_dial *d);
+
+// add a candidate address after the others
+static int kq_dial_add(struct kq_dial *d, const struct sockaddr *addr, socklen_t addr_len)
+{
+	if (d->naddrs == KQ_DIAL_ADDRS || addr_len > sizeof(d->addrs[0])) {
+		errno = ENOSPC;
+		return -1;
+	}
+	memcpy(&d->addrs[d->naddrs], addr, addr_len);
+	d->addr_lens[d->naddrs] = addr_len;
+	d->naddrs++;
+	return 0;
+}
+
+// replace the candidates with the TCP addresses of the host:
+//  getaddrinfo() sorts them by preference (RFC 6724),
+//  and the address families are interleaved starting with the first one (RFC 8305 section 4).
+// getaddrinfo() blocks while resolving a name: call it before the loop starts, or from another thread.
+// Return 0 or EAI_* (see gai_strerror())
+static int kq_dial_resolve(struct kq_dial *d, const char *host, unsigned port)
+{
+	struct addrinfo hints = {}, *res;
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_ADDRCONFIG | AI_NUMERICSERV;
+	char service[8];
+	snprintf(service, sizeof(service), "%u", port);
+	int r = getaddrinfo(host, service, &hints, &res);
+	if (r != 0)
+		return r;
+
+	// split by family, keeping the order, then take one from each in turn
+	struct addrinfo *fam[2][KQ_DIAL_ADDRS];
+	unsigned n[2] = {};
+	for (struct addrinfo *ai = res;  ai != NULL;  ai = ai->ai_next) {
+		unsigned i = (ai->ai_family != res->ai_family);
+		if (n[i] != KQ_DIAL_ADDRS)
+			fam[i][n[i]++] = ai;
+	}
+	d->naddrs = 0;
+	for (unsigned k = 0;  k != KQ_DIAL_ADDRS;  k++) {
+		for (unsigned i = 0;  i != 2;  i++) {
+			if (k < n[i])
+				kq_dial_add(d, fam[i][k]->ai_addr, fam[i][k]->ai_addrlen);
+		}
+	}
+	freeaddrinfo(res);
+	return 0;
+}
+
+static void kq_dial_link(struct kq_dial **list, struct kq_dial *d)
+{
+	d->prev = NULL;
+	d->next = *list;
+	if (*list != NULL)
+		(*list)->prev = d;
+	*list = d;
+}
+
+static void kq_dial_unlink(struct kq_dial **list, struct kq_dial *d)
+{
+	if (d->prev != NULL)
+		d->prev->next = d->next;
+	else
+		*list = d->next;
+	if (d->next != NULL)
+		d->next->prev = d->prev;
+}
+
+// return the object to the slab: called by the loop after the current batch of events is processed
+static void kq_dial_attempt_release(struct context *obj)
+{
+	struct kq_dial_attempt *a = (struct kq_dial_attempt*)obj;
+	kq_slab_free(&a->dl->attempts, a); // the dial may be gone already
+}
+
+// remove the attempt from its dial and close its socket, unless the socket is taken (fd = -1)
+static void kq_dial_attempt_close(struct kq_dial_attempt *a)
+{
+	struct kq_dial *d = a->d;
+	struct kq_dial_attempt **pa = &d->attempts;
+	while (*pa != a)
+		pa = &(*pa)->next;
+	*pa = a->next;
+	d->nactive--;
+	kq_timer_remove(d->dl->loop, &a->timer);
+	kq_retire(d->dl->loop, &a->obj);
+}
+
+// the dial has completed: close the other attempts, report the result and start the queued dials
+static void kq_dial_finish(struct kq_dial *d, int fd, int error)
+{
+	struct kq_dialer *dl = d->dl;
+	while (d->attempts != NULL)
+		kq_dial_attempt_close(d->attempts);
+	kq_timer_remove(dl->loop, &d->next_timer);
+	kq_timer_remove(dl->loop, &d->deadline);
+	kq_dial_unlink(&dl->active, d);
+	d->active = 0;
+	dl->nactive--;
+	d->time_ms = kq_now_ms() - d->start_ms;
+	if (fd != -1) {
+		dl->nconnected++;
+		if (d->addr != 0)
+			dl->nfallbacks++;
+	} else {
+		dl->nfailed++;
+	}
+	d->on_done(d, fd, error); // may free `d` or start it again
+
+	while (dl->queue != NULL
+		&& (dl->conf.max_dials == 0 || dl->nactive < dl->conf.max_dials)) {
+		struct kq_dial *q = dl->queue;
+		kq_dial_unlink(&dl->queue, q);
+		if (dl->queue == NULL)
+			dl->queue_last = NULL;
+		q->queued = 0;
+		kq_dial_begin(q);
+	}
+}
+
+// all candidates of this round have failed: start over after the backoff or give up
+static void kq_dial_round_failed(struct kq_dial *d)
+{
+	struct kq_dialer *dl = d->dl;
+	if (d->round == dl->conf.retries) {
+		kq_dial_finish(d, -1, d->last_error);
+		return;
+	}
+	unsigned ms = dl->conf.backoff_ms;
+	for (unsigned i = 0;  i != d->round && ms < dl->conf.backoff_max_ms;  i++) {
+		ms *= 2;
+	}
+	if (ms > dl->conf.backoff_max_ms)
+		ms = dl->conf.backoff_max_ms;
+	// 50%..100% of the backoff: the dials which have failed together don't retry together
+	dl->seed = dl->seed * 1103515245 + 12345;
+	ms = ms / 2 + (dl->seed >> 8) % (ms / 2 + 1);
+	if (dl->conf.timeout_ms != 0
+		&& kq_now_ms() + ms >= d->start_ms + dl->conf.timeout_ms) {
+		kq_dial_finish(d, -1, d->last_error); // won't have time for another round
+		return;
+	}
+	d->round++;
+	d->next_addr = 0;
+	dl->nretries++;
+	kq_timer_add(dl->loop, &d->next_timer, (ms != 0) ? ms : 1);
+}
+
+// an attempt has failed: try the next candidate right away
+static void kq_dial_attempt_fail(struct kq_dial_attempt *a, int err)
+{
+	struct kq_dial *d = a->d;
+	d->last_error = err;
+	kq_dial_attempt_close(a);
+	if (d->next_addr != d->naddrs) {
+		kq_timer_remove(d->dl->loop, &d->next_timer);
+		kq_dial_next(d);
+	} else if (d->nactive == 0) {
+		kq_dial_round_failed(d);
+	}
+}
+
+// the result of the asynchronous connect()
+static void kq_dial_attempt_connected(struct context *obj)
+{
+	struct kq_dial_attempt *a = (struct kq_dial_attempt*)obj;
+	struct kq_dial *d = a->d;
+	int err = 0;
+	socklen_t len = sizeof(err);
+	if (0 != getsockopt(obj->fd, SOL_SOCKET, SO_ERROR, &err, &len))
+		err = errno;
+	KQ_PROBE3(connect, obj, obj->fd, err);
+	kq_trace_add(KQ_TRACE_CONNECT, obj, obj->fd, obj->gen, err);
+	if (err != 0) {
+		kq_dial_attempt_fail(a, err);
+		return;
+	}
+
+	// hand the socket over to the user
+	int fd = obj->fd;
+	kq_detach(d->dl->loop, obj);
+	obj->fd = -1;
+	d->addr = a->addr;
+	kq_dial_attempt_close(a);
+	kq_dial_finish(d, fd, 0);
+}
+
+static void kq_dial_attempt_timeout(struct kq_timer *t)
+{
+	struct kq_dial_attempt *a = (void*)((char*)t - offsetof(struct kq_dial_attempt, timer));
+	a->d->dl->nattempt_timeouts++;
+	kq_dial_attempt_fail(a, ETIMEDOUT);
+}
+
+// start connecting to the candidate.
+// Return -1 if connect() has failed right away, e.g. with ENETUNREACH
+static int kq_dial_attempt_open(struct kq_dial *d, unsigned i)
+{
+	struct kq_dialer *dl = d->dl;
+	struct kq_dial_attempt *a = kq_slab_alloc(&dl->attempts);
+	if (a == NULL)
+		return -1;
+	// preserve the generation left from the previous attempt in this slot
+	unsigned gen = a->obj.gen;
+	memset(a, 0, sizeof(*a));
+	a->obj.gen = gen;
+	a->dl = dl;
+	a->d = d;
+	a->addr = i;
+	a->timer.handler = kq_dial_attempt_timeout;
+
+	const struct sockaddr *addr = (struct sockaddr*)&d->addrs[i];
+	a->obj.fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (a->obj.fd == -1)
+		goto err;
+	int val = 1;
+	setsockopt(a->obj.fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+
+	// KQ signals WRITE when the connection is established or has failed
+	a->obj.whandler = kq_dial_attempt_connected;
+	if (0 != kq_attach(dl->loop, &a->obj))
+		goto err;
+	a->obj.release = kq_dial_attempt_release;
+	d->nattempts++;
+	dl->nattempts++;
+	if (0 != connect(a->obj.fd, addr, d->addr_lens[i])
+		&& errno != EINPROGRESS) {
+		// KQ may still return an event for it
+		int e = errno;
+		kq_retire(dl->loop, &a->obj);
+		errno = e;
+		return -1;
+	}
+	// even if it has connected already, KQ signals WRITE
+	a->next = d->attempts;
+	d->attempts = a;
+	d->nactive++;
+	kq_timer_add(dl->loop, &a->timer, dl->conf.attempt_timeout_ms);
+	return 0;
+
+err:
+	if (a->obj.fd != -1) {
+		int e = errno;
+		close(a->obj.fd);
+		errno = e;
+	}
+	kq_slab_free(&dl->attempts, a);
+	return -1;
+}
+
+// start the next candidates until one is in progress
+static void kq_dial_next(struct kq_dial *d)
+{
+	struct kq_dialer *dl = d->dl;
+	while (d->next_addr != d->naddrs) {
+		if (0 == kq_dial_attempt_open(d, d->next_addr++)) {
+			if (d->next_addr != d->naddrs)
+				kq_timer_add(dl->loop, &d->next_timer, dl->conf.attempt_delay_ms);
+			return;
+		}
+		d->last_error = errno;
+	}
+	if (d->nactive == 0)
+		kq_dial_round_failed(d);
+}
+
+static void kq_dial_next_timer(struct kq_timer *t)
+{
+	kq_dial_next((void*)((char*)t - offsetof(struct kq_dial, next_timer)));
+}
+
+static void kq_dial_deadline(struct kq_timer *t)
+{
+	struct kq_dial *d = (void*)((char*)t - offsetof(struct kq_dial, deadline));
+	d->dl->ntimeouts++;
+	kq_dial_finish(d, -1, ETIMEDOUT);
+}
+
+static void kq_dial_begin(struct kq_dial *d)
+{
+	struct kq_dialer *dl = d->dl;
+	d->active = 1;
+	kq_dial_link(&dl->active, d);
+	dl->nactive++;
+	d->start_ms = kq_now_ms();
+	if (dl->conf.timeout_ms != 0)
+		kq_timer_add(dl->loop, &d->deadline, dl->conf.timeout_ms);
+	kq_dial_next(d);
+}
+
+// start connecting to the dial's candidates, or queue the dial if max_dials are in progress.
+// d->on_done() is called by the loop when the dial has completed;
+//  it's called from inside this function if none of the candidates can be tried.
+// on_done() may start new dials.
+static int kq_dial_start(struct kq_dialer *dl, struct kq_dial *d)
+{
+	if (d->naddrs == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	d->dl = dl;
+	d->addr = -1;
+	d->nattempts = 0;
+	d->time_ms = 0;
+	d->attempts = NULL;
+	d->nactive = 0;
+	d->next_addr = 0;
+	d->round = 0;
+	d->last_error = 0;
+	d->next_timer.handler = kq_dial_next_timer;
+	d->deadline.handler = kq_dial_deadline;
+	dl->ndials++;
+
+	if (dl->conf.max_dials != 0 && dl->nactive >= dl->conf.max_dials) {
+		// append to the queue
+		d->queued = 1;
+		d->next = NULL;
+		d->prev = dl->queue_last;
+		if (dl->queue_last != NULL)
+			dl->queue_last->next = d;
+		else
+			dl->queue = d;
+		dl->queue_last = d;
+		return 0;
+	}
+
+	kq_dial_begin(d);
+	return 0;
+}
+
+// stop the dial without calling on_done()
+static void kq_dial_cancel(struct kq_dial *d)
+{
+	struct kq_dialer *dl = d->dl;
+	if (d->queued) {
+		if (dl->queue_last == d)
+			dl->queue_last = d->prev;
+		kq_dial_unlink(&dl->queue, d);
+		d->queued = 0;
+		return;
+	}
+	if (!d->active)
+		return;
+	while (d->attempts != NULL)
+		kq_dial_attempt_close(d->attempts);
+	kq_timer_remove(dl->loop, &d->next_timer);
+	kq_timer_remove(dl->loop, &d->deadline);
+	kq_dial_unlink(&dl->active, d);
+	d->active = 0;
+	dl->nactive--;
+}
+
+static int kq_dialer_create(struct kq_dialer *dl, struct kq_loop *loop, const struct kq_dialer_conf *conf)
+{
+	memset(dl, 0, sizeof(*dl));
+	dl->loop = loop;
+	dl->conf = *conf;
+	if (dl->conf.attempt_delay_ms == 0)
+		dl->conf.attempt_delay_ms = 250;
+	if (dl->conf.attempt_timeout_ms == 0)
+		dl->conf.attempt_timeout_ms = 2000;
+	if (dl->conf.backoff_ms == 0)
+		dl->conf.backoff_ms = 100;
+	if (dl->conf.backoff_max_ms == 0)
+		dl->conf.backoff_max_ms = 5000;
+	dl->seed = (unsigned)kq_now_ns();
+	kq_slab_init(&dl->attempts, sizeof(struct kq_dial_attempt), 0);
+	return 0;
+}
+
+// close all attempts and free the memory.
+// Call it after the loop has stopped: the dials in progress are abandoned without calling on_done().
+static void kq_dialer_close(struct kq_dialer *dl)
+{
+	for (struct kq_dial *d = dl->active;  d != NULL;  d = d->next) {
+		for (struct kq_dial_attempt *a = d->attempts;  a != NULL;  a = a->next) {
+			kq_timer_remove(dl->loop, &a->timer);
+			kq_detach(dl->loop, &a->obj);
+			close(a->obj.fd);
+		}
+		kq_timer_remove(dl->loop, &d->next_timer);
+		kq_timer_remove(dl->loop, &d->deadline);
+	}
+	dl->active = dl->queue = dl->queue_last = NULL;
+	kq_slab_close(&dl->attempts);
+}
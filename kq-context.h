@@ -0,0 +1,128 @@
+/* Kernel Queue The Complete Guide: kq-context.h: The object associated with a descriptor
+Common part for all KQ backends.
+The object pointer is passed to KQ together with the safety flag in its lowest bit,
+ so the events cached for an object that was closed while processing the same batch are skipped:
+ see "Processing stale cached events" in the guide.
+The flag is the lowest bit of the object's generation which is incremented each time the object is closed.
+When the memory is reused for a new object, the generation must be preserved (see kq-slab.h):
+ otherwise a new object would start with the same flag as a stale event for the previous one.
+*/
+#pragma once
+#include "kq-trace.h"
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct kq_loop;
+
+// the structure associated with a descriptor
+struct context {
+	int fd;
+	void (*rhandler)(struct context *obj);
+	void (*whandler)(struct context *obj);
+	struct kq_loop *loop;
+
+	// generation: incremented when the object is closed.
+	// Its lowest bit is the safety flag which is passed to KQ as the lowest bit of the object pointer.
+	unsigned gen;
+
+	// completion-based KQ (io_uring): the result of the operation that has just completed
+	int result;
+	unsigned result_flags;
+	unsigned inflight; // operations submitted to the kernel but not yet completed
+
+	unsigned kq_index; // poll(): index in the descriptors array
+	unsigned kq_events; // io_uring readiness mode: the events the object is attached for
+
+	// the object has yielded (see kq_yield()): KQ_READY_R and/or KQ_READY_W
+	unsigned ready;
+	struct context *next_ready;
+
+	// called by the loop to free the object after it was retired
+	void (*release)(struct context *obj);
+	struct context *next_retired;
+};
+
+static inline unsigned kq_obj_flag(const struct context *obj)
+{
+	return obj->gen & 1;
+}
+
+enum {
+	KQ_READY_R = 1,
+	KQ_READY_W = 2,
+};
+
+// pass the safety flag along with the object pointer to KQ
+static inline void* kq_obj_ptr(struct context *obj)
+{
+	return (void*)((size_t)obj | kq_obj_flag(obj));
+}
+
+// call the handler: the probes and the trace ring see each call (kq-trace.h)
+static inline void kq_obj_call(void (*fn)(struct context *obj), struct context *o)
+{
+	KQ_PROBE3(handler, o, o->fd, fn);
+	if (!kq_trace_on()) {
+		fn(o);
+		KQ_PROBE3(handler_return, o, fn, 0);
+		return;
+	}
+	// the handler may close the object
+	int fd = o->fd;
+	unsigned gen = o->gen;
+	unsigned long long t = kq_trace_now(), dur;
+	fn(o);
+	dur = kq_trace_now() - t;
+	KQ_PROBE3(handler_return, o, fn, dur);
+	kq_trace_add_at(t, KQ_TRACE_HANDLER, o, fd, gen, (size_t)fn, dur);
+}
+
+// call the object's handlers for a readiness event received from KQ
+static inline void kq_obj_handle(void *ptr, int readable, int writable)
+{
+	struct context *o = (void*)((size_t)ptr & ~(size_t)1); // clear the lowest bit
+	unsigned flag = (size_t)ptr & 1;
+	if (flag != kq_obj_flag(o))
+		return; // the object was closed while processing previous events
+
+	if (readable && o->rhandler != NULL)
+		kq_obj_call(o->rhandler, o); // handle read event
+
+	// READ handler may have closed the object
+	if (flag != kq_obj_flag(o))
+		return;
+
+	if (writable && o->whandler != NULL)
+		kq_obj_call(o->whandler, o); // handle write event
+}
+
+// add the closed object to the list of objects to be freed
+static inline void kq_obj_retire(struct context **list, struct context *obj)
+{
+	obj->rhandler = NULL;
+	obj->whandler = NULL;
+	obj->gen++; // turn over the safety flag
+	obj->next_retired = *list;
+	*list = obj;
+}
+
+// free the retired objects which don't have any operations in flight
+//  and which are not in the ready list
+static void kq_obj_release_retired(struct context **list)
+{
+	struct context **prev = list;
+	struct context *obj = *list;
+	while (obj != NULL) {
+		struct context *next = obj->next_retired;
+		if (obj->inflight == 0 && obj->ready == 0) {
+			*prev = next;
+			if (obj->release != NULL)
+				obj->release(obj);
+		} else {
+			prev = &obj->next_retired;
+		}
+		obj = next;
+	}
+}
@@ -0,0 +1,81 @@
+/* Kernel Queue The Complete Guide: kq-epoll.h: epoll backend for kq.h
+Objects are attached once with EPOLLIN | EPOLLOUT | EPOLLET,
+ so handlers must always read or write until EAGAIN.
+Many events are received per one epoll_wait() call.
+*/
+#pragma once
+#include "kq-context.h"
+#include "kq-stats.h"
+#include <sys/epoll.h>
+
+struct kq_epoll {
+	int fd;
+
+	// events received by one epoll_wait() call
+	struct epoll_event *events;
+	unsigned nevents;
+};
+
+static int kq_epoll_create(struct kq_epoll *ep, unsigned nevents)
+{
+	ep->events = malloc(nevents * sizeof(struct epoll_event));
+	if (ep->events == NULL)
+		return -1;
+	ep->nevents = nevents;
+
+	ep->fd = epoll_create1(EPOLL_CLOEXEC);
+	if (ep->fd == -1) {
+		free(ep->events);
+		return -1;
+	}
+	return 0;
+}
+
+static void kq_epoll_close(struct kq_epoll *ep)
+{
+	close(ep->fd);
+	ep->fd = -1;
+	free(ep->events);
+	ep->events = NULL;
+}
+
+// attach object's descriptor to KQ for both READ and WRITE events
+static inline int kq_epoll_attach(struct kq_epoll *ep, struct context *obj)
+{
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	event.data.ptr = kq_obj_ptr(obj);
+	return epoll_ctl(ep->fd, EPOLL_CTL_ADD, obj->fd, &event);
+}
+
+// attach a listening socket for READ events.
+// exclusive: the socket is attached to several KQ objects (one per thread),
+//  and the kernel should wake up only one of the threads waiting for it (EPOLLEXCLUSIVE)
+static inline int kq_epoll_attach_listener(struct kq_epoll *ep, struct context *obj, int exclusive)
+{
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLET;
+	if (exclusive)
+		event.events |= EPOLLEXCLUSIVE;
+	event.data.ptr = kq_obj_ptr(obj);
+	return epoll_ctl(ep->fd, EPOLL_CTL_ADD, obj->fd, &event);
+}
+
+// receive events and call the handlers
+// st: record the statistics;  NULL: don't
+static inline int kq_epoll_wait(struct kq_epoll *ep, int timeout_ms, struct kq_stats *st)
+{
+	int n = epoll_wait(ep->fd, ep->events, ep->nevents, timeout_ms);
+	kq_stats_woken(st, n);
+	kq_trace_wake(n);
+	if (n < 0)
+		return -1;
+
+	for (int i = 0;  i != n;  i++) {
+		unsigned ev = ep->events[i].events;
+		kq_stats_handle(st, ep->events[i].data.ptr
+			, ev & (EPOLLIN | EPOLLERR | EPOLLHUP)
+			, ev & (EPOLLOUT | EPOLLERR | EPOLLHUP));
+	}
+	return n;
+}
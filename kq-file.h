@@ -0,0 +1,224 @@
+/* Kernel Queue The Complete Guide: kq-file.h: Asynchronous reading of buffered files with io_uring
+Linux AIO (kq-aio.h) is asynchronous only with O_DIRECT which bypasses the page cache:
+ each read goes to disk even if the file was just read, and the buffer, offset and size must be aligned.
+io_uring reads from the usual descriptors: if the data is in the page cache the read completes
+ right during submission, otherwise the kernel's worker threads perform it.
+The engine has its own io_uring instance for file reads whatever the loop's backend is:
+ its completions are signalled via eventfd which is registered with the ring and attached to the loop.
+If io_uring isn't available (old kernel, or it's disabled by seccomp or sysctl)
+ the reads are passed to the thread pool (kq-offload.h) or else performed synchronously.
+
+For a sequential stream the kernel is told to use a larger readahead window (POSIX_FADV_SEQUENTIAL),
+ and the next part of the file is requested in advance (POSIX_FADV_WILLNEED)
+ so that the data is already in the cache when we read it.
+Not thread-safe: each loop has its own engine.
+See uring-file.c.
+*/
+#pragma once
+#include "kq.h"
+#include "kq-uring.h"
+#include "kq-offload.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+
+struct kq_file;
+
+struct kq_file_req {
+	struct context obj; // io_uring request; must be the first member
+	void (*handler)(struct kq_file_req *r);
+	ssize_t result; // bytes read; -1: error
+	int error;
+	void *udata;
+	struct kq_fop fop; // the read is performed by the thread pool
+	struct kq_file_req *next; // completed synchronously, the handler isn't yet called
+};
+
+// sequential reading of one file
+struct kq_file_stream {
+	int fd;
+	uint64_t ra_off; // the data is requested in advance up to this offset
+};
+
+struct kq_file {
+	struct kq_loop *loop;
+	struct kq_uring ring;
+	int uring; // io_uring is used
+	struct context obj; // eventfd
+	struct kq_offload *pool; // set by the user; NULL: read synchronously when io_uring isn't used
+	unsigned ra_window; // how far to request the data in advance for sequential streams; 0: disabled
+	int processing;
+	struct kq_file_req *done, **done_last;
+
+	unsigned long long nreads;
+	unsigned long long nsubmits; // io_uring_enter() calls
+	unsigned long long nwakeups; // eventfd signals
+	unsigned long long nadvise; // readahead requests
+	unsigned long long noffload; // reads passed to the thread pool
+	unsigned long long nsync; // reads performed synchronously
+};
+
+static void kq_file_submit(struct kq_file *f);
+
+static inline void kq_file_complete(struct kq_file_req *r, ssize_t res)
+{
+	r->result = res;
+	r->error = 0;
+	if (res < 0) {
+		r->error = -res;
+		r->result = -1;
+	}
+	r->handler(r);
+}
+
+static void kq_file_uring_done(struct context *obj)
+{
+	kq_file_complete((struct kq_file_req*)obj, obj->result);
+}
+
+static void kq_file_fop_done(struct kq_fop *fop)
+{
+	struct kq_file_req *r = (void*)((char*)fop - offsetof(struct kq_file_req, fop));
+	kq_file_complete(r, (fop->result >= 0) ? fop->result : -fop->error);
+}
+
+// receive all completions and call the handlers
+static void kq_file_read_events(struct context *obj)
+{
+	struct kq_file *f = (void*)((char*)obj - offsetof(struct kq_file, obj));
+	uint64_t val;
+	while (sizeof(val) == read(obj->fd, &val, sizeof(val))) {
+		f->nwakeups++;
+	}
+
+	// don't submit the reads that the handlers add, until all completions are processed
+	f->processing = 1;
+	kq_uring_dispatch(&f->ring, NULL);
+	f->processing = 0;
+
+	kq_file_submit(f); // one syscall for all the reads added by the handlers
+}
+
+// entries: io_uring submission queue size; 0: don't use io_uring
+static int kq_file_create(struct kq_file *f, struct kq_loop *loop, unsigned entries)
+{
+	memset(f, 0, sizeof(*f));
+	f->loop = loop;
+	f->obj.fd = -1;
+	f->ra_window = 2*1024*1024;
+	f->done_last = &f->done;
+
+	// the completions must be posted (and eventfd signalled) without waiting for us to call io_uring_enter():
+	//  no IORING_SETUP_DEFER_TASKRUN
+	if (entries == 0
+		|| 0 != kq_uring_create_flags(&f->ring, entries, IORING_SETUP_SINGLE_ISSUER))
+		return 0; // io_uring isn't available
+	f->uring = 1;
+
+	if (-1 == (f->obj.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)))
+		goto err;
+	if (0 != io_uring_register(f->ring.fd, IORING_REGISTER_EVENTFD, &f->obj.fd, 1))
+		goto err;
+	f->obj.rhandler = kq_file_read_events;
+	// eventfd is only ever read: attach it like a listening socket
+	if (0 != kq_attach_listener(loop, &f->obj, 0))
+		goto err;
+	return 0;
+
+err:
+	if (f->obj.fd != -1)
+		close(f->obj.fd);
+	kq_uring_close(&f->ring);
+	return -1;
+}
+
+// the reads in flight must be completed before
+static void kq_file_close(struct kq_file *f)
+{
+	if (!f->uring)
+		return;
+	kq_detach(f->loop, &f->obj);
+	close(f->obj.fd);
+	kq_uring_close(&f->ring);
+}
+
+// read from the file at the specified offset; r->handler is called when the read completes,
+//  but never from inside this function.
+// The read is submitted by kq_file_submit() or, if added from a handler, after all the current completions are processed.
+static int kq_file_read(struct kq_file *f, struct kq_file_req *r, int fd, void *buf, size_t len, uint64_t off)
+{
+	f->nreads++;
+	if (f->uring) {
+		r->obj.fd = fd;
+		r->obj.rhandler = kq_file_uring_done;
+		return kq_uring_read(&f->ring, &r->obj, buf, len, off);
+	}
+
+	if (f->pool != NULL) {
+		f->noffload++;
+		r->fop.handler = kq_file_fop_done;
+		kq_offload_pread(f->pool, f->loop, &r->fop, fd, buf, len, off);
+		return 0;
+	}
+
+	f->nsync++;
+	ssize_t n = pread(fd, buf, len, off);
+	r->result = (n >= 0) ? n : -errno;
+	r->next = NULL;
+	*f->done_last = r;
+	f->done_last = &r->next;
+	return 0;
+}
+
+// prepare the file for sequential reading
+static void kq_file_stream_init(struct kq_file *f, struct kq_file_stream *s, int fd)
+{
+	s->fd = fd;
+	s->ra_off = 0;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL); // only sets the readahead window size, doesn't block
+}
+
+// read the next part of a sequential stream and request the following part in advance
+static int kq_file_stream_read(struct kq_file *f, struct kq_file_stream *s, struct kq_file_req *r, void *buf, size_t len, uint64_t off)
+{
+	uint64_t end = off + len;
+	if (f->uring && f->ra_window != 0
+		&& end + f->ra_window / 2 > s->ra_off) {
+		uint64_t from = (s->ra_off > end) ? s->ra_off : end;
+		uint64_t to = end + f->ra_window;
+		// posix_fadvise(POSIX_FADV_WILLNEED) may block, so the kernel's worker performs it
+		if (0 == kq_uring_fadvise(&f->ring, s->fd, from, to - from, POSIX_FADV_WILLNEED)) {
+			f->nadvise++;
+			s->ra_off = to;
+		}
+	}
+	return kq_file_read(f, r, s->fd, buf, len, off);
+}
+
+// submit all queued reads with one syscall and call the handlers of the reads which have completed right away
+static void kq_file_submit(struct kq_file *f)
+{
+	if (f->processing)
+		return; // the caller will submit
+	f->processing = 1;
+	for (;;) {
+		if (f->uring) {
+			if (f->ring.to_submit == 0)
+				break;
+			f->nsubmits++;
+			if (0 != kq_uring_submit(&f->ring))
+				break; // e.g. the completion ring is full: submit after processing it
+			// the reads of cached data are complete already
+			kq_uring_dispatch(&f->ring, NULL);
+
+		} else {
+			struct kq_file_req *r = f->done;
+			if (r == NULL)
+				break;
+			if (NULL == (f->done = r->next))
+				f->done_last = &f->done;
+			kq_file_complete(r, r->result);
+		}
+	}
+	f->processing = 0;
+}
@@ -0,0 +1,237 @@
+/* Kernel Queue The Complete Guide: kq-handoff.h: Passing the listening sockets to a new process
+Hot upgrade without refusing any connections:
+ the running process starts the new binary and passes its listening sockets to it
+ over a Unix socket with SCM_RIGHTS.
+The new process attaches the same sockets to its own KQ objects instead of creating new ones,
+ so the port is never closed: the connections which arrive meanwhile wait in the socket's accept queue,
+ and both processes accept them until the old one stops.
+When the new process is ready, it sends one byte back, and the old process stops accepting and drains.
+If the new process fails to start, the old one receives EOF and continues as before.
+
+The old process is the parent of the new one: it receives SIGCHLD when the new process exits.
+See epoll-server.c.
+*/
+#pragma once
+#include "kq.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#define KQ_HANDOFF_ENV  "KQ_HANDOFF_FD" // the descriptor of the Unix socket in the new process
+#define KQ_HANDOFF_MAX  253 // max. descriptors per message (the kernel's SCM_MAX_FD)
+
+extern char **environ;
+
+struct kq_handoff {
+	struct context obj; // our end of the Unix socket
+	pid_t pid; // the new process
+	void (*on_complete)(struct kq_handoff *h, int ok);
+	void *udata;
+};
+
+// send the descriptors with one message
+static int kq_handoff_send(int sk, const int *fds, unsigned n)
+{
+	if (n == 0 || n > KQ_HANDOFF_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	union {
+		char buf[CMSG_SPACE(KQ_HANDOFF_MAX * sizeof(int))];
+		struct cmsghdr align;
+	} ctl;
+	unsigned count = n;
+	struct iovec iov = { &count, sizeof(count) };
+	struct msghdr m = {};
+	m.msg_iov = &iov;
+	m.msg_iovlen = 1;
+	m.msg_control = ctl.buf;
+	m.msg_controllen = CMSG_SPACE(n * sizeof(int));
+	struct cmsghdr *cm = CMSG_FIRSTHDR(&m);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(n * sizeof(int));
+	memcpy(CMSG_DATA(cm), fds, n * sizeof(int));
+
+	ssize_t r;
+	while (-1 == (r = sendmsg(sk, &m, MSG_NOSIGNAL)) && errno == EINTR) {
+	}
+	return (r == sizeof(count)) ? 0 : -1;
+}
+
+// receive the descriptors (blocking).
+// The new descriptors are close-on-exec.
+// Return the number of descriptors
+static int kq_handoff_recv(int sk, int *fds, unsigned max)
+{
+	union {
+		char buf[CMSG_SPACE(KQ_HANDOFF_MAX * sizeof(int))];
+		struct cmsghdr align;
+	} ctl;
+	unsigned count = 0;
+	struct iovec iov = { &count, sizeof(count) };
+	struct msghdr m = {};
+	m.msg_iov = &iov;
+	m.msg_iovlen = 1;
+	m.msg_control = ctl.buf;
+	m.msg_controllen = sizeof(ctl.buf);
+
+	ssize_t r;
+	while (-1 == (r = recvmsg(sk, &m, MSG_CMSG_CLOEXEC)) && errno == EINTR) {
+	}
+	if (r != sizeof(count)) {
+		if (r >= 0)
+			errno = EPROTO;
+		return -1;
+	}
+
+	unsigned n = 0;
+	for (struct cmsghdr *cm = CMSG_FIRSTHDR(&m);  cm != NULL;  cm = CMSG_NXTHDR(&m, cm)) {
+		if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+			continue;
+		unsigned k = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (unsigned i = 0;  i != k;  i++) {
+			int fd;
+			memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+			if (n < max)
+				fds[n++] = fd;
+			else
+				close(fd);
+		}
+	}
+	if ((m.msg_flags & MSG_CTRUNC) || n != count || n == 0) {
+		for (unsigned i = 0;  i != n;  i++) {
+			close(fds[i]);
+		}
+		errno = EPROTO;
+		return -1;
+	}
+	return n;
+}
+
+// the new process has replied, or it has exited
+static void kq_handoff_read(struct context *obj)
+{
+	struct kq_handoff *h = (void*)((char*)obj - offsetof(struct kq_handoff, obj));
+	char c;
+	ssize_t r = read(obj->fd, &c, 1);
+	if (r < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+
+	kq_retire(obj->loop, obj); // the loop may still have an event for it
+	h->on_complete(h, (r == 1));
+}
+
+// start the new process with the same command line and pass the listening sockets to it.
+// on_complete(ok=1) is called by the loop when the new process is ready to accept the connections;
+//  ok=0: it has failed.
+// argv[0] must be a path to the executable: normally it's the new binary which has replaced the current one.
+static int kq_handoff_start(struct kq_handoff *h, struct kq_loop *loop, char **argv, const int *fds, unsigned n)
+{
+	memset(&h->obj, 0, sizeof(h->obj));
+	h->obj.fd = -1;
+	h->pid = 0;
+	int sk[2];
+	if (0 != socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sk))
+		return -1;
+
+	// prepare the environment before fork():
+	//  the child of a multi-threaded process may only call async-signal-safe functions
+	char var[64];
+	snprintf(var, sizeof(var), KQ_HANDOFF_ENV "=%d", sk[1]);
+	unsigned nenv = 0;
+	while (environ[nenv] != NULL)
+		nenv++;
+	char **envp = malloc((nenv + 2) * sizeof(char*));
+	if (envp == NULL)
+		goto err;
+	unsigned k = 0;
+	for (unsigned i = 0;  i != nenv;  i++) {
+		if (0 != strncmp(environ[i], KQ_HANDOFF_ENV "=", sizeof(KQ_HANDOFF_ENV)))
+			envp[k++] = environ[i];
+	}
+	envp[k++] = var;
+	envp[k] = NULL;
+
+	// the descriptors wait in the socket buffer until the new process receives them
+	if (0 != kq_handoff_send(sk[0], fds, n)) {
+		free(envp);
+		goto err;
+	}
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		// don't pass our blocked signals to the new process
+		sigset_t mask;
+		sigemptyset(&mask);
+		sigprocmask(SIG_SETMASK, &mask, NULL);
+		fcntl(sk[1], F_SETFD, 0); // the only descriptor which the new process inherits
+		execve(argv[0], argv, envp);
+		_exit(127);
+	}
+	free(envp);
+	if (pid == -1)
+		goto err;
+	close(sk[1]);
+
+	h->pid = pid;
+	h->obj.fd = sk[0];
+	h->obj.rhandler = kq_handoff_read;
+	fcntl(sk[0], F_SETFL, O_NONBLOCK);
+	if (0 != kq_attach_listener(loop, &h->obj, 0)) {
+		close(sk[0]);
+		h->obj.fd = -1;
+		return -1; // the new process receives EOF and exits
+	}
+	return 0;
+
+err:
+	close(sk[0]);
+	close(sk[1]);
+	return -1;
+}
+
+// stop waiting for the new process (after kq_handoff_start())
+static void kq_handoff_close(struct kq_handoff *h)
+{
+	if (h->obj.fd == -1)
+		return;
+	kq_detach(h->obj.loop, &h->obj);
+	close(h->obj.fd);
+	h->obj.fd = -1;
+}
+
+// in the new process: receive the listening sockets from the old process.
+// *sk: the Unix socket for kq_handoff_ready()
+// Return the number of descriptors;  0: the process wasn't started by kq_handoff_start()
+static int kq_handoff_inherit(int *sk, int *fds, unsigned max)
+{
+	*sk = -1;
+	const char *val = getenv(KQ_HANDOFF_ENV);
+	if (val == NULL)
+		return 0;
+	int fd = atoi(val);
+	unsetenv(KQ_HANDOFF_ENV); // not for our own children
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	int n = kq_handoff_recv(fd, fds, max);
+	if (n < 0) {
+		close(fd);
+		return -1;
+	}
+	*sk = fd;
+	return n;
+}
+
+// in the new process: the sockets are attached, tell the old process to stop accepting
+static int kq_handoff_ready(int sk)
+{
+	char c = 1;
+	ssize_t r = write(sk, &c, 1);
+	close(sk);
+	return (r == 1) ? 0 : -1;
+}
@@ -0,0 +1,96 @@
+/* Kernel Queue The Complete Guide: kq-hist.h: Latency histogram with fixed relative precision
+An HDR-style log-linear histogram: each power of two is divided into 2^(KQ_HIST_BITS-1) linear sub-buckets,
+ so any recorded value is known with the relative error below 1/2^(KQ_HIST_BITS-1) (< 1%),
+ from microseconds to hours, in a fixed array of counters.
+Recording is O(1): one bit scan and one increment, no allocation, no locking -
+ each thread records to its own histogram, and they are merged for the report.
+*/
+#pragma once
+#include <string.h>
+
+enum {
+	KQ_HIST_BITS = 8,
+	KQ_HIST_SUB = 1 << (KQ_HIST_BITS - 1), // sub-buckets per power of two
+	KQ_HIST_MAX_LOG = 40, // the larger values are recorded as 2^40 - 1
+	KQ_HIST_N = (KQ_HIST_MAX_LOG - KQ_HIST_BITS + 2) * KQ_HIST_SUB,
+};
+
+struct kq_hist {
+	unsigned long long count, sum, min, max;
+	unsigned long long buckets[KQ_HIST_N];
+};
+
+static inline void kq_hist_reset(struct kq_hist *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = ~0ULL;
+}
+
+static inline unsigned kq_hist_index(unsigned long long v)
+{
+	if (v < 2 * KQ_HIST_SUB)
+		return v; // exact
+	if (v >= 1ULL << KQ_HIST_MAX_LOG)
+		v = (1ULL << KQ_HIST_MAX_LOG) - 1;
+	unsigned log = 63 - __builtin_clzll(v);
+	unsigned shift = log - KQ_HIST_BITS + 1;
+	return (shift + 1) * KQ_HIST_SUB + (v >> shift) - KQ_HIST_SUB;
+}
+
+// the largest value which is recorded in bucket `i`
+static inline unsigned long long kq_hist_value(unsigned i)
+{
+	if (i < 2 * KQ_HIST_SUB)
+		return i;
+	unsigned shift = i / KQ_HIST_SUB - 1;
+	unsigned long long sub = i % KQ_HIST_SUB + KQ_HIST_SUB;
+	return ((sub + 1) << shift) - 1;
+}
+
+static inline void kq_hist_add(struct kq_hist *h, unsigned long long v)
+{
+	h->buckets[kq_hist_index(v)]++;
+	h->count++;
+	h->sum += v;
+	if (h->min > v)
+		h->min = v;
+	if (h->max < v)
+		h->max = v;
+}
+
+static void kq_hist_merge(struct kq_hist *dst, const struct kq_hist *src)
+{
+	for (unsigned i = 0;  i != KQ_HIST_N;  i++) {
+		dst->buckets[i] += src->buckets[i];
+	}
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (dst->min > src->min)
+		dst->min = src->min;
+	if (dst->max < src->max)
+		dst->max = src->max;
+}
+
+// the value below which `percent` of the recorded values are (e.g. 99.9);  0: no values
+static unsigned long long kq_hist_percentile(const struct kq_hist *h, double percent)
+{
+	if (h->count == 0)
+		return 0;
+	unsigned long long rank = (unsigned long long)(h->count * percent / 100 + 0.5);
+	if (rank == 0)
+		rank = 1;
+	unsigned long long n = 0;
+	for (unsigned i = 0;  i != KQ_HIST_N;  i++) {
+		n += h->buckets[i];
+		if (n >= rank) {
+			unsigned long long v = kq_hist_value(i);
+			return (v < h->max) ? v : h->max;
+		}
+	}
+	return h->max;
+}
+
+static inline unsigned long long kq_hist_mean(const struct kq_hist *h)
+{
+	return (h->count != 0) ? h->sum / h->count : 0;
+}
@@ -0,0 +1,320 @@
+/* Kernel Queue The Complete Guide: kq-http.h: Incremental HTTP/1.1 request parser
+The request may arrive in any number of parts: the parser keeps its position between the calls,
+ so each call parses only the new lines, and the data is never copied:
+ the method, the target, the header names and values and the body are returned as slices of the receive buffer.
+The parser state holds only offsets, so the buffer may be moved between the calls (e.g. enlarged).
+The header slices are stored in the caller's array when the request is complete;
+ if the request has arrived in several parts, the header lines from the previous parts are scanned once more.
+
+The bytes are scanned with SSE2 16 at a time, looking for the delimiter and for any control character
+ (which includes CR and LF), so the line end is found and the characters are validated in one pass.
+
+Pipelining: kq_http_parse() returns the length of the complete request (header and body),
+ the data behind it belongs to the next request, which is parsed by the next call.
+Keep-alive: `keep_alive` is set according to the version and the Connection header.
+The body is delimited by Content-Length; a chunked request body isn't supported (501).
+*/
+#pragma once
+#include <limits.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#if defined(__SSE2__)
+	#include <emmintrin.h>
+#endif
+
+struct kq_str {
+	const char *ptr;
+	size_t len;
+};
+
+struct kq_http_header {
+	struct kq_str name, value;
+};
+
+// the result
+struct kq_http_request {
+	struct kq_str method, target;
+	unsigned version; // 10: HTTP/1.0;  11: HTTP/1.1
+	struct kq_http_header *headers; // set by the user: the array for the headers
+	unsigned max_headers; // set by the user
+	unsigned nheaders;
+	struct kq_str body;
+	unsigned keep_alive :1; // the connection may be used for the next request
+};
+
+enum KQ_HTTP_STATE {
+	KQ_HTTP_REQLINE, // zero: a zeroed parser is ready for the first request
+	KQ_HTTP_HEADERS,
+	KQ_HTTP_BODY,
+	KQ_HTTP_DONE,
+};
+
+// the parser state of one connection
+struct kq_http_parser {
+	enum KQ_HTTP_STATE state;
+	unsigned pos; // the next line starts here: the data before it is parsed
+	unsigned hdr_off; // the first header line
+	unsigned hdr_len; // the complete header, including the empty line
+	unsigned method_off, method_len;
+	unsigned target_off, target_len;
+	unsigned version;
+	unsigned nheaders;
+	unsigned long long content_length;
+	unsigned has_length :1;
+	unsigned conn_close :1; // Connection: close
+	unsigned conn_keep_alive :1; // Connection: keep-alive
+};
+
+static inline void kq_http_init(struct kq_http_parser *p)
+{
+	memset(p, 0, sizeof(*p));
+}
+
+// find the first control character (< 0x20 or DEL) or `stop` character
+static inline const char* kq_http_scan(const char *p, const char *end, char stop)
+{
+#if defined(__SSE2__)
+	const __m128i space = _mm_set1_epi8(0x20);
+	const __m128i del = _mm_set1_epi8(0x7f);
+	const __m128i st = _mm_set1_epi8(stop);
+	while (end - p >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)p);
+		// unsigned x >= 0x20  <=>  max(x, 0x20) == x
+		unsigned printable = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, space), v));
+		unsigned m = (~printable & 0xffff)
+			| _mm_movemask_epi8(_mm_cmpeq_epi8(v, del))
+			| _mm_movemask_epi8(_mm_cmpeq_epi8(v, st));
+		if (m != 0)
+			return p + __builtin_ctz(m);
+		p += 16;
+	}
+#endif
+	for (;  p != end;  p++) {
+		unsigned char c = *p;
+		if (c < 0x20 || c == 0x7f || c == (unsigned char)stop)
+			break;
+	}
+	return p;
+}
+
+// find the end of the line which contains only valid characters (and HTAB).
+// Return the end of the line (CR or LF);  NULL: incomplete;  *next: the next line
+static inline const char* kq_http_eol(const char *p, const char *end, const char **next, int *err)
+{
+	for (;;) {
+		p = kq_http_scan(p, end, '\0');
+		if (p == end)
+			return NULL;
+		if (*p == '\t') {
+			p++;
+			continue;
+		}
+		if (*p == '\n') {
+			*next = p + 1; // a bare LF is accepted
+			return p;
+		}
+		if (*p == '\r') {
+			if (p + 1 == end)
+				return NULL;
+			if (p[1] == '\n') {
+				*next = p + 2;
+				return p;
+			}
+		}
+		*err = 1;
+		return NULL;
+	}
+}
+
+static inline int kq_http_token_eq(const char *s, size_t len, const char *name, size_t name_len)
+{
+	return len == name_len && !strncasecmp(s, name, len);
+}
+
+// apply the header which defines the request framing or the connection's fate
+static int kq_http_header_apply(struct kq_http_parser *p, const struct kq_http_header *h)
+{
+	const char *v = h->value.ptr;
+	size_t vlen = h->value.len;
+	if (kq_http_token_eq(h->name.ptr, h->name.len, "Content-Length", 14)) {
+		if (vlen == 0 || vlen > 18)
+			return -400;
+		unsigned long long n = 0;
+		for (size_t i = 0;  i != vlen;  i++) {
+			if (v[i] < '0' || v[i] > '9')
+				return -400;
+			n = n * 10 + (v[i] - '0');
+		}
+		if (p->has_length && p->content_length != n)
+			return -400; // the request may be interpreted differently by a proxy
+		p->has_length = 1;
+		p->content_length = n;
+
+	} else if (kq_http_token_eq(h->name.ptr, h->name.len, "Transfer-Encoding", 17)) {
+		return -501;
+
+	} else if (kq_http_token_eq(h->name.ptr, h->name.len, "Connection", 10)) {
+		// comma-separated list of options
+		size_t i = 0;
+		while (i != vlen) {
+			while (i != vlen && (v[i] == ' ' || v[i] == '\t' || v[i] == ','))
+				i++;
+			size_t start = i;
+			while (i != vlen && v[i] != ',' && v[i] != ' ' && v[i] != '\t')
+				i++;
+			if (kq_http_token_eq(v + start, i - start, "close", 5))
+				p->conn_close = 1;
+			else if (kq_http_token_eq(v + start, i - start, "keep-alive", 10))
+				p->conn_keep_alive = 1;
+		}
+	}
+	return 0;
+}
+
+// a character allowed in a header name (RFC 9110 tchar)
+static inline int kq_http_tchar(unsigned char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+		|| (c != 0 && NULL != strchr("!#$%&'*+-.^_`|~", c));
+}
+
+// parse the header line [line, eol).  Return 0 or -status
+static inline int kq_http_header_line(const char *line, const char *eol, struct kq_http_header *h)
+{
+	const char *colon = kq_http_scan(line, eol, ':');
+	if (colon == eol || *colon != ':' || colon == line)
+		return -400;
+	// the name must be a token: a line starting with whitespace (obsolete folding) or whitespace before the colon
+	//  would hide the header from us, while a proxy in front of us may interpret it
+	for (const char *c = line;  c != colon;  c++) {
+		if (!kq_http_tchar(*c))
+			return -400;
+	}
+	h->name.ptr = line;
+	h->name.len = colon - line;
+
+	const char *v = colon + 1;
+	while (v != eol && (*v == ' ' || *v == '\t'))
+		v++;
+	const char *ve = eol;
+	while (ve != v && (ve[-1] == ' ' || ve[-1] == '\t'))
+		ve--;
+	h->value.ptr = v;
+	h->value.len = ve - v;
+	return 0;
+}
+
+// parse the request line [line, eol).  Return 0 or -status
+static int kq_http_request_line(struct kq_http_parser *p, const char *data, const char *line, const char *eol)
+{
+	const char *sp = kq_http_scan(line, eol, ' ');
+	if (sp == eol || *sp != ' ' || sp == line)
+		return -400;
+	p->method_off = line - data;
+	p->method_len = sp - line;
+
+	const char *target = sp + 1;
+	sp = kq_http_scan(target, eol, ' ');
+	if (sp == eol || *sp != ' ' || sp == target)
+		return -400;
+	p->target_off = target - data;
+	p->target_len = sp - target;
+
+	const char *ver = sp + 1;
+	if (eol - ver != 8 || memcmp(ver, "HTTP/1.", 7))
+		return (eol - ver == 8 && !memcmp(ver, "HTTP/", 5)) ? -505 : -400;
+	if (ver[7] == '1')
+		p->version = 11;
+	else if (ver[7] == '0')
+		p->version = 10;
+	else
+		return -505;
+	return 0;
+}
+
+// fill the result when the request is complete
+static int kq_http_complete(struct kq_http_parser *p, const char *data, unsigned resume, struct kq_http_request *req)
+{
+	req->method.ptr = data + p->method_off;
+	req->method.len = p->method_len;
+	req->target.ptr = data + p->target_off;
+	req->target.len = p->target_len;
+	req->version = p->version;
+	req->nheaders = p->nheaders;
+	req->body.ptr = data + p->hdr_len;
+	req->body.len = p->content_length;
+	req->keep_alive = (p->version == 11) ? !p->conn_close : (p->conn_keep_alive && !p->conn_close);
+
+	// the header lines parsed by the previous calls: their slices pointed into the buffer at that time
+	const char *line = data + p->hdr_off, *end = data + resume;
+	for (unsigned i = 0;  line < end && i != req->max_headers;  i++) {
+		const char *next = end;
+		int err = 0;
+		const char *eol = kq_http_eol(line, end, &next, &err);
+		if (0 != kq_http_header_line(line, eol, &req->headers[i]))
+			return -400; // validated already while parsing: the data has been modified between the calls
+		line = next;
+	}
+
+	p->state = KQ_HTTP_DONE;
+	return p->hdr_len + p->content_length;
+}
+
+// parse the request which starts at `data`, continuing from the previous call.
+// `data` must contain all the bytes passed to the previous calls for this request.
+// Return the length of the complete request (header and body);
+//  0: the request is incomplete, call again when more data is received;
+//  <0: invalid request: -HTTP status code (400, 413, 431, 501, 505) to respond with before closing the connection.
+// The next call after a complete request starts parsing the next request.
+static int kq_http_parse(struct kq_http_parser *p, const char *data, size_t len, struct kq_http_request *req)
+{
+	if (p->state == KQ_HTTP_DONE)
+		kq_http_init(p);
+	if (len > INT_MAX)
+		return -431;
+	unsigned resume = p->pos;
+	const char *end = data + len;
+	int r;
+
+	while (p->state != KQ_HTTP_BODY) {
+		const char *line = data + p->pos, *next;
+		int err = 0;
+		const char *eol = kq_http_eol(line, end, &next, &err);
+		if (eol == NULL)
+			return (err) ? -400 : 0;
+
+		if (p->state == KQ_HTTP_REQLINE) {
+			if (eol != line) {
+				if (0 != (r = kq_http_request_line(p, data, line, eol)))
+					return r;
+				p->state = KQ_HTTP_HEADERS;
+				p->hdr_off = next - data;
+			}
+			// an empty line before the request is ignored
+
+		} else if (eol == line) {
+			// the empty line: the end of the header
+			p->hdr_len = next - data;
+			if (p->hdr_len + p->content_length > INT_MAX)
+				return -413;
+			p->state = KQ_HTTP_BODY;
+
+		} else {
+			if (p->nheaders == req->max_headers)
+				return -431;
+			struct kq_http_header *h = &req->headers[p->nheaders];
+			if (0 != (r = kq_http_header_line(line, eol, h))
+				|| 0 != (r = kq_http_header_apply(p, h)))
+				return r;
+			p->nheaders++;
+		}
+		p->pos = next - data;
+	}
+
+	if (len < p->hdr_len + p->content_length)
+		return 0; // wait for the complete body
+	if (resume <= p->hdr_off)
+		resume = p->hdr_off; // all header lines are parsed by this call
+	return kq_http_complete(p, data, resume, req);
+}
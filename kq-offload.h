@@ -0,0 +1,210 @@
+/* Kernel Queue The Complete Guide: kq-offload.h: Blocking file operations on worker threads
+open(), stat(), fsync() and reading from a file without O_DIRECT may block for the length of a disk access,
+ and there's no KQ event which tells us that they won't.
+Performed on the loop's thread, they stop every other connection.
+Instead, the loop passes them to a pool of worker threads;
+ a worker performs the syscall and posts the completion back to the loop via its task queue (kq-post.h),
+ which wakes the loop with eventfd only if it's sleeping.
+The loop must have the task queue enabled (kq_post_enable()).
+One pool can serve several loops: the completion goes to the loop which has submitted the operation.
+*/
+#pragma once
+#include "kq.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+enum KQ_FOP {
+	KQ_FOP_PREAD,
+	KQ_FOP_PWRITE,
+	KQ_FOP_FSYNC,
+	KQ_FOP_OPEN,
+	KQ_FOP_STAT,
+};
+
+struct kq_fop {
+	struct kq_task task; // completion, posted to the loop
+	struct kq_fop *next; // in the pool's queue
+	struct kq_post *post;
+	unsigned op; // enum KQ_FOP
+
+	int fd;
+	void *buf;
+	size_t len;
+	uint64_t off;
+	const char *name;
+	int flags;
+	struct stat *st;
+
+	ssize_t result; // bytes transferred or new descriptor; -1: error
+	int error;
+	void (*handler)(struct kq_fop *f); // called by the loop
+	void *udata;
+};
+
+struct kq_offload {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct kq_fop *first, **last;
+	int quit;
+
+	pthread_t *threads;
+	unsigned n;
+	unsigned long long nops; // operations performed (updated under lock)
+};
+
+static void kq_fop_perform(struct kq_fop *f)
+{
+	ssize_t r = -1;
+	switch (f->op) {
+	case KQ_FOP_PREAD:
+		r = pread(f->fd, f->buf, f->len, f->off); break;
+	case KQ_FOP_PWRITE:
+		r = pwrite(f->fd, f->buf, f->len, f->off); break;
+	case KQ_FOP_FSYNC:
+		r = fsync(f->fd); break;
+	case KQ_FOP_OPEN:
+		r = open(f->name, f->flags | O_CLOEXEC, 0644); break;
+	case KQ_FOP_STAT:
+		r = (f->fd != -1) ? fstat(f->fd, f->st) : stat(f->name, f->st); break;
+	}
+	f->result = r;
+	f->error = (r < 0) ? errno : 0;
+}
+
+static void* kq_offload_worker(void *param)
+{
+	struct kq_offload *p = param;
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (p->first == NULL && !p->quit) {
+			pthread_cond_wait(&p->cond, &p->lock);
+		}
+		struct kq_fop *f = p->first;
+		if (f == NULL)
+			break; // quit and there are no more operations
+		if (NULL == (p->first = f->next))
+			p->last = &p->first;
+		p->nops++;
+		pthread_mutex_unlock(&p->lock);
+
+		kq_fop_perform(f);
+		kq_post(f->post, &f->task); // the loop calls f->handler()
+
+		pthread_mutex_lock(&p->lock);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+static void kq_offload_close(struct kq_offload *p);
+
+// nthreads: 0: 4
+static int kq_offload_create(struct kq_offload *p, unsigned nthreads)
+{
+	if (nthreads == 0)
+		nthreads = 4;
+	p->first = NULL;
+	p->last = &p->first;
+	p->quit = 0;
+	p->n = 0;
+	p->nops = 0;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+	if (NULL == (p->threads = calloc(nthreads, sizeof(pthread_t))))
+		return -1;
+
+	for (unsigned i = 0;  i != nthreads;  i++) {
+		int e = pthread_create(&p->threads[i], NULL, kq_offload_worker, p);
+		if (e != 0) {
+			kq_offload_close(p);
+			errno = e;
+			return -1;
+		}
+		p->n++;
+	}
+	return 0;
+}
+
+// stop the workers after they perform all queued operations.
+// The loops must process the completions before they're closed.
+static void kq_offload_close(struct kq_offload *p)
+{
+	pthread_mutex_lock(&p->lock);
+	p->quit = 1;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+	for (unsigned i = 0;  i != p->n;  i++) {
+		pthread_join(p->threads[i], NULL);
+	}
+	free(p->threads);
+	p->threads = NULL;
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+}
+
+static void kq_fop_task(struct kq_task *t)
+{
+	struct kq_fop *f = (void*)((char*)t - offsetof(struct kq_fop, task));
+	f->handler(f);
+}
+
+// pass the prepared operation to a worker; f->handler is called by the loop when it's complete
+static void kq_offload_submit(struct kq_offload *p, struct kq_loop *loop, struct kq_fop *f)
+{
+	f->post = loop->post;
+	f->task.handler = kq_fop_task;
+	f->next = NULL;
+	pthread_mutex_lock(&p->lock);
+	*p->last = f;
+	p->last = &f->next;
+	pthread_cond_signal(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+static inline void kq_offload_pread(struct kq_offload *p, struct kq_loop *loop, struct kq_fop *f, int fd, void *buf, size_t len, uint64_t off)
+{
+	f->op = KQ_FOP_PREAD;
+	f->fd = fd;
+	f->buf = buf;
+	f->len = len;
+	f->off = off;
+	kq_offload_submit(p, loop, f);
+}
+
+static inline void kq_offload_pwrite(struct kq_offload *p, struct kq_loop *loop, struct kq_fop *f, int fd, const void *buf, size_t len, uint64_t off)
+{
+	f->op = KQ_FOP_PWRITE;
+	f->fd = fd;
+	f->buf = (void*)buf;
+	f->len = len;
+	f->off = off;
+	kq_offload_submit(p, loop, f);
+}
+
+static inline void kq_offload_fsync(struct kq_offload *p, struct kq_loop *loop, struct kq_fop *f, int fd)
+{
+	f->op = KQ_FOP_FSYNC;
+	f->fd = fd;
+	kq_offload_submit(p, loop, f);
+}
+
+// f->result: the new descriptor; the name must stay valid until the handler is called
+static inline void kq_offload_open(struct kq_offload *p, struct kq_loop *loop, struct kq_fop *f, const char *name, int flags)
+{
+	f->op = KQ_FOP_OPEN;
+	f->name = name;
+	f->flags = flags;
+	kq_offload_submit(p, loop, f);
+}
+
+// fd: -1: stat() the file by name
+static inline void kq_offload_stat(struct kq_offload *p, struct kq_loop *loop, struct kq_fop *f, int fd, const char *name, struct stat *st)
+{
+	f->op = KQ_FOP_STAT;
+	f->fd = fd;
+	f->name = name;
+	f->st = st;
+	kq_offload_submit(p, loop, f);
+}
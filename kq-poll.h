@@ -0,0 +1,129 @@
+/* Kernel Queue The Complete Guide: kq-poll.h: poll() backend for kq.h
+A reference implementation which works everywhere, but it passes all descriptors to the kernel on each call,
+ so it's only suitable for a small number of connections and for testing.
+poll() is level-triggered, so on each call we ask only for the events the object has handlers for:
+ READ while rhandler is set, WRITE while whandler is set.
+*/
+#pragma once
+#include "kq-context.h"
+#include "kq-stats.h"
+#include <poll.h>
+
+struct kq_poll {
+	struct pollfd *fds;
+	struct context **objs;
+	unsigned n, cap;
+	unsigned removed; // some objects were detached: compact the arrays before the next call
+};
+
+static int kq_poll_create(struct kq_poll *p)
+{
+	p->n = 0;
+	p->cap = 64;
+	p->removed = 0;
+	p->fds = malloc(p->cap * sizeof(struct pollfd));
+	p->objs = malloc(p->cap * sizeof(struct context*));
+	if (p->fds == NULL || p->objs == NULL) {
+		free(p->fds);
+		free(p->objs);
+		return -1;
+	}
+	return 0;
+}
+
+static void kq_poll_close(struct kq_poll *p)
+{
+	free(p->fds);
+	free(p->objs);
+	p->fds = NULL;
+	p->objs = NULL;
+	p->n = 0;
+}
+
+static int kq_poll_attach(struct kq_poll *p, struct context *obj)
+{
+	if (p->n == p->cap) {
+		unsigned cap = p->cap * 2;
+		struct pollfd *fds = realloc(p->fds, cap * sizeof(struct pollfd));
+		if (fds == NULL)
+			return -1;
+		p->fds = fds;
+		struct context **objs = realloc(p->objs, cap * sizeof(struct context*));
+		if (objs == NULL)
+			return -1;
+		p->objs = objs;
+		p->cap = cap;
+	}
+
+	obj->kq_index = p->n;
+	p->fds[p->n].fd = obj->fd;
+	p->fds[p->n].revents = 0;
+	p->objs[p->n] = obj;
+	p->n++;
+	return 0;
+}
+
+// must be called before the object's descriptor is closed
+static void kq_poll_detach(struct kq_poll *p, struct context *obj)
+{
+	unsigned i = obj->kq_index;
+	if (i >= p->n || p->objs[i] != obj)
+		return;
+	// the arrays may be being iterated now, so just mark the entry as unused
+	p->objs[i] = NULL;
+	p->fds[i].fd = -1;
+	p->removed = 1;
+}
+
+static void kq_poll_compact(struct kq_poll *p)
+{
+	unsigned k = 0;
+	for (unsigned i = 0;  i != p->n;  i++) {
+		if (p->objs[i] == NULL)
+			continue;
+		p->fds[k] = p->fds[i];
+		p->objs[k] = p->objs[i];
+		p->objs[k]->kq_index = k;
+		k++;
+	}
+	p->n = k;
+	p->removed = 0;
+}
+
+// receive events and call the handlers
+// st: record the statistics;  NULL: don't
+static int kq_poll_wait(struct kq_poll *p, int timeout_ms, struct kq_stats *st)
+{
+	if (p->removed)
+		kq_poll_compact(p);
+
+	for (unsigned i = 0;  i != p->n;  i++) {
+		const struct context *o = p->objs[i];
+		p->fds[i].events = ((o->rhandler != NULL) ? POLLIN : 0)
+			| ((o->whandler != NULL) ? POLLOUT : 0);
+		// the kernel always reports POLLHUP and POLLERR, so we skip the descriptors without handlers
+		p->fds[i].fd = (p->fds[i].events != 0) ? o->fd : -1;
+	}
+
+	int r = poll(p->fds, p->n, timeout_ms);
+	kq_stats_woken(st, r);
+	kq_trace_wake(r);
+	if (r <= 0)
+		return r;
+
+	// handlers may attach new objects to the end of the arrays and these may be reallocated
+	unsigned n = p->n, nevents = 0;
+	for (unsigned i = 0;  i != n && nevents != (unsigned)r;  i++) {
+		short ev = p->fds[i].revents;
+		if (ev == 0)
+			continue;
+		nevents++;
+		struct context *o = p->objs[i];
+		if (o == NULL)
+			continue; // detached by the handler of the previous event
+		kq_stats_handle(st, kq_obj_ptr(o)
+			, ev & (POLLIN | POLLERR | POLLHUP | POLLNVAL)
+			, ev & (POLLOUT | POLLERR | POLLHUP | POLLNVAL));
+	}
+	return r;
+}
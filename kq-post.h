@@ -0,0 +1,167 @@
+/* Kernel Queue The Complete Guide: kq-post.h: Posting tasks to the loop from other threads
+Passing the object pointer itself through eventfd (see epoll-user.c) isn't safe with many producers:
+ eventfd adds up the values written concurrently.
+It also costs one write() syscall per message.
+
+Instead, the tasks are put into a lock-free multi-producer single-consumer queue (intrusive, by D. Vyukov):
+ a producer only exchanges the tail pointer and links the previous node to the new one.
+eventfd is used only to wake up the loop, and only if it's actually sleeping:
+ before blocking in KQ the loop sets `sleeping` and checks the queue once more;
+ after adding a task, a producer resets `sleeping` and writes to eventfd only if it was set.
+Both sides use sequentially consistent operations, so either the loop sees the new task
+ or the producer sees that the loop is sleeping.
+On each wakeup the loop processes all the tasks in the queue.
+*/
+#pragma once
+#include "kq-context.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+
+struct kq_task {
+	struct kq_task *_Atomic next;
+	void (*handler)(struct kq_task *t);
+};
+
+struct kq_post {
+	// modified by the producers
+	struct kq_task *_Atomic tail;
+	atomic_uint sleeping; // the loop is going to block in KQ: the next producer must wake it up
+	atomic_ullong nsignals; // eventfd writes
+	char pad1[64];
+
+	// used by the loop only
+	struct kq_task *head;
+	struct kq_task stub;
+	struct context obj; // eventfd
+	unsigned long long ntasks; // tasks processed
+	unsigned long long nwakeups; // eventfd signals received
+};
+
+static void kq_post_read(struct context *obj)
+{
+	uint64_t val;
+	while (sizeof(val) == read(obj->fd, &val, sizeof(val))) {
+		struct kq_post *q = (void*)((char*)obj - offsetof(struct kq_post, obj));
+		q->nwakeups++;
+	}
+}
+
+static int kq_post_create(struct kq_post *q)
+{
+	memset(q, 0, sizeof(*q));
+	atomic_init(&q->stub.next, NULL);
+	atomic_init(&q->tail, &q->stub);
+	atomic_init(&q->sleeping, 0);
+	atomic_init(&q->nsignals, 0);
+	q->head = &q->stub;
+
+	q->obj.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (q->obj.fd == -1)
+		return -1;
+	q->obj.rhandler = kq_post_read;
+	return 0;
+}
+
+static void kq_post_close(struct kq_post *q)
+{
+	close(q->obj.fd);
+	q->obj.fd = -1;
+}
+
+static inline void kq_post_push(struct kq_post *q, struct kq_task *t)
+{
+	atomic_store_explicit(&t->next, NULL, memory_order_relaxed);
+	struct kq_task *prev = atomic_exchange(&q->tail, t);
+	// the consumer can't see `t` until this point
+	atomic_store_explicit(&prev->next, t, memory_order_release);
+}
+
+// add the task to the queue; the loop will call t->handler().
+// Thread-safe.  The task must not be posted again until its handler is called.
+static inline void kq_post(struct kq_post *q, struct kq_task *t)
+{
+	kq_post_push(q, t);
+
+	if (atomic_load(&q->sleeping)
+		&& atomic_exchange(&q->sleeping, 0)) {
+		atomic_fetch_add_explicit(&q->nsignals, 1, memory_order_relaxed);
+		uint64_t one = 1;
+		ssize_t r = write(q->obj.fd, &one, sizeof(one));
+		(void)r; // EAGAIN: the counter is full and the loop is going to be woken up anyway
+	}
+}
+
+// get the first task from the queue; NULL: empty, or a producer hasn't yet finished adding a task
+static inline struct kq_task* kq_post_pop(struct kq_post *q)
+{
+	struct kq_task *head = q->head;
+	struct kq_task *next = atomic_load_explicit(&head->next, memory_order_acquire);
+	if (head == &q->stub) {
+		if (next == NULL)
+			return NULL;
+		q->head = next;
+		head = next;
+		next = atomic_load_explicit(&next->next, memory_order_acquire);
+	}
+	if (next != NULL) {
+		q->head = next;
+		return head;
+	}
+
+	if (head != atomic_load(&q->tail))
+		return NULL; // a producer is between exchanging the tail and linking the new node
+
+	// `head` is the last node: put stub behind it so it can be removed
+	kq_post_push(q, &q->stub);
+	next = atomic_load_explicit(&head->next, memory_order_acquire);
+	if (next != NULL) {
+		q->head = next;
+		return head;
+	}
+	return NULL;
+}
+
+static inline int kq_post_empty(struct kq_post *q)
+{
+	return q->head == &q->stub && atomic_load(&q->tail) == &q->stub;
+}
+
+// call the handlers of all the tasks which are in the queue now.
+// The tasks posted by the handlers themselves are processed on the next iteration.
+static void kq_post_process(struct kq_post *q)
+{
+	if (kq_post_empty(q))
+		return;
+	// stop after this task (the stub is never returned, so then we stop when the queue is empty)
+	struct kq_task *last = atomic_load(&q->tail);
+	for (;;) {
+		struct kq_task *t = kq_post_pop(q);
+		if (t == NULL)
+			break;
+		q->ntasks++;
+		int done = (t == last);
+		t->handler(t); // the handler may free or post the task again
+		if (done)
+			break;
+	}
+}
+
+// the loop is going to block in KQ.
+// Return 0 if the queue isn't empty: don't block.
+static inline int kq_post_sleep(struct kq_post *q)
+{
+	atomic_store(&q->sleeping, 1);
+	if (!kq_post_empty(q)) {
+		atomic_store_explicit(&q->sleeping, 0, memory_order_relaxed);
+		return 0;
+	}
+	return 1;
+}
+
+// the loop has returned from KQ: no need to signal it anymore
+static inline void kq_post_awake(struct kq_post *q)
+{
+	atomic_store_explicit(&q->sleeping, 0, memory_order_relaxed);
+}
@@ -0,0 +1,589 @@
+/* Kernel Queue The Complete Guide: kq-reactor.h: Multi-reactor server
+N worker threads, each with its own KQ object and its own listening socket bound to the same port with SO_REUSEPORT.
+The kernel distributes incoming connections between the listening sockets,
+ so the workers don't share any data and don't need any locks.
+Optionally, each worker is pinned to its own CPU.
+Other threads talk to a worker by posting tasks to its loop (kq-post.h):
+ to stop it, to shut down gracefully (kq_reactors_drain()) or to apply new settings (kq_reactors_reload()).
+When a single listening socket is required,
+ all workers attach the same socket to their KQ objects,
+ and EPOLLEXCLUSIVE prevents the kernel from waking up all of them on each new connection.
+On hot upgrade the listening sockets are passed to the new process (kq-handoff.h, kq_reactors_listeners()),
+ and its workers attach the inherited sockets instead of creating new ones.
+Each worker may record its loop statistics (kq-stats.h);
+ kq_reactors_stats() gets a copy from all workers, and kq_stats_sock serves them on a Unix socket.
+Link with -pthread
+*/
+#pragma once
+#include "kq-server.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+struct kq_reactors;
+
+struct kq_reactor {
+	pthread_t thread;
+	unsigned index;
+	int cpu; // CPU to pin the thread to; -1: don't pin
+	struct kq_reactors *rs;
+	int err;
+	struct kq_loop loop;
+	struct kq_server srv;
+	struct kq_post post; // tasks from other threads
+	struct kq_task stop, drain, reload, stats;
+	atomic_uint reload_posted; // the reload task is in the queue
+	atomic_uint stats_posted; // the stats task is in the queue
+};
+
+// a copy of a worker's statistics
+struct kq_reactor_stats {
+	unsigned ok; // 0: the worker hasn't responded in time
+	unsigned long long time_us; // when the copy was made
+	struct kq_stats loop;
+	unsigned nconns;
+	unsigned long long naccepted, naccept_eagain, nread_eagain, nwrite_eagain, ntimeouts;
+	unsigned long long nthrottled;
+};
+
+enum KQ_LISTEN {
+	KQ_LISTEN_REUSEPORT, // listening socket per reactor
+	KQ_LISTEN_SHARED, // one listening socket attached to all reactors
+	KQ_LISTEN_EXCLUSIVE, // KQ_LISTEN_SHARED + EPOLLEXCLUSIVE
+};
+
+struct kq_reactors_conf {
+	unsigned n; // number of worker threads; 0: number of online CPUs
+	unsigned pin_cpu :1; // pin worker N to CPU N (modulo the number of CPUs)
+	unsigned backend; // KQ_EPOLL, KQ_URING, KQ_POLL; 0: default
+	unsigned nevents; // events per epoll_wait() call
+	unsigned stats :1; // record the loop statistics in each worker (kq-stats.h)
+	unsigned trace_records; // record the events of each worker into its trace ring of this size (kq-trace.h);  0: don't
+	enum KQ_LISTEN listen_mode;
+	struct kq_server_conf server;
+
+	// listening sockets inherited from the previous process; the reactors close them.
+	// KQ_LISTEN_REUSEPORT: one worker per socket, `n` is ignored;  otherwise: only the first one is used.
+	// The array must stay valid until kq_reactors_close().
+	const int *listen_fds;
+	unsigned nlisten_fds;
+};
+
+struct kq_reactors {
+	struct kq_reactor *r;
+	unsigned n;
+	int listen_fd; // the shared listening socket
+	struct kq_reactors_conf conf;
+
+	// startup synchronization
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned ninit; // reactors that have finished initialization
+	int state; // 0: starting;  1: all reactors are ready;  -1: startup failed
+
+	unsigned drain_deadline_ms;
+
+	// kq_reactors_stats() is waiting for the workers to fill this array;  NULL: no request
+	struct kq_reactor_stats *stats_out;
+	unsigned nstats; // workers that have responded
+};
+
+// KQ objects are created by the worker threads themselves:
+//  memory is allocated on the thread's NUMA node,
+//  and io_uring requires that the requests are submitted by the thread that created it
+static void* kq_reactor_main(void *param)
+{
+	struct kq_reactor *r = param;
+	struct kq_reactors *rs = r->rs;
+	if (r->cpu >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(r->cpu, &cpus);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	}
+
+	struct kq_server_conf sconf = rs->conf.server;
+	if (!sconf.shared_listener && rs->conf.nlisten_fds != 0) {
+		// the inherited socket is attached like a shared one and is closed by kq_reactors_close()
+		sconf.shared_listener = 1;
+		sconf.listen_fd = rs->conf.listen_fds[r->index];
+	}
+
+	if (rs->conf.trace_records != 0) {
+		char name[16];
+		snprintf(name, sizeof(name), "reactor %u", r->index);
+		kq_trace_enable(rs->conf.trace_records, name); // no tracing if there's no memory
+	}
+
+	int loop_ok = 0, srv_ok = 0;
+	r->err = 0;
+	if (0 != kq_create_backend(&r->loop, rs->conf.backend, rs->conf.nevents))
+		r->err = errno;
+	else if ((rs->conf.stats && 0 != kq_stats_enable(&r->loop))
+		|| 0 != kq_post_enable(&r->loop, &r->post)) {
+		r->err = errno;
+		kq_close(&r->loop);
+	} else
+		loop_ok = 1;
+	if (loop_ok) {
+		if (0 != kq_server_start(&r->srv, &r->loop, &sconf))
+			r->err = errno;
+		else
+			srv_ok = 1;
+	}
+
+	// report the result and wait until all reactors are ready
+	pthread_mutex_lock(&rs->lock);
+	rs->ninit++;
+	pthread_cond_broadcast(&rs->cond);
+	while (rs->state == 0)
+		pthread_cond_wait(&rs->cond, &rs->lock);
+	int state = rs->state;
+	pthread_mutex_unlock(&rs->lock);
+
+	if (state == 1)
+		kq_run(&r->loop);
+
+	if (srv_ok)
+		kq_server_close(&r->srv);
+	if (loop_ok) {
+		kq_post_disable(&r->loop);
+		kq_close(&r->loop);
+	}
+	kq_trace_disable();
+	return NULL;
+}
+
+static void kq_reactor_stop_handler(struct kq_task *t)
+{
+	struct kq_reactor *r = (void*)((char*)t - offsetof(struct kq_reactor, stop));
+	kq_stop(&r->loop);
+}
+
+// ask all worker threads to exit.  Thread-safe; call it only once.
+static void kq_reactors_stop(struct kq_reactors *rs)
+{
+	for (unsigned i = 0;  i != rs->n;  i++) {
+		struct kq_reactor *r = &rs->r[i];
+		r->stop.handler = kq_reactor_stop_handler;
+		kq_post(&r->post, &r->stop);
+	}
+}
+
+static void kq_reactor_drained(struct kq_server *s)
+{
+	struct kq_reactor *r = (void*)((char*)s - offsetof(struct kq_reactor, srv));
+	kq_stop(&r->loop);
+}
+
+static void kq_reactor_drain_handler(struct kq_task *t)
+{
+	struct kq_reactor *r = (void*)((char*)t - offsetof(struct kq_reactor, drain));
+	kq_server_drain(&r->srv, r->rs->drain_deadline_ms, kq_reactor_drained);
+}
+
+// graceful shutdown: each worker stops accepting, finishes its active connections and exits.
+// deadline_ms: close the remaining connections after this time; 0: no deadline
+// Thread-safe; call it only once.
+static void kq_reactors_drain(struct kq_reactors *rs, unsigned deadline_ms)
+{
+	rs->drain_deadline_ms = deadline_ms;
+	for (unsigned i = 0;  i != rs->n;  i++) {
+		struct kq_reactor *r = &rs->r[i];
+		r->drain.handler = kq_reactor_drain_handler;
+		kq_post(&r->post, &r->drain); // the queue makes `drain_deadline_ms` visible to the worker
+	}
+}
+
+static void kq_reactor_reload_handler(struct kq_task *t)
+{
+	struct kq_reactor *r = (void*)((char*)t - offsetof(struct kq_reactor, reload));
+	struct kq_reactors *rs = r->rs;
+	// reset the flag before reading the settings: a newer reload posts the task again
+	atomic_store(&r->reload_posted, 0);
+	// on_reload() is called under the lock: it can take its own references to the new settings' data
+	//  before a newer reload replaces them and the caller drops its references
+	pthread_mutex_lock(&rs->lock);
+	kq_server_reload(&r->srv, &rs->conf.server);
+	pthread_mutex_unlock(&rs->lock);
+}
+
+// apply new server settings in all workers (see kq_server_reload()).
+// Thread-safe, but must not be called after the workers are stopped or drained.
+static void kq_reactors_reload(struct kq_reactors *rs, const struct kq_server_conf *conf)
+{
+	pthread_mutex_lock(&rs->lock);
+	struct kq_server_conf *c = &rs->conf.server;
+	// keep the settings which can't be changed
+	struct kq_server_conf cur = *c;
+	*c = *conf;
+	c->port = cur.port;
+	c->backlog = cur.backlog;
+	c->reuseport = cur.reuseport;
+	c->shared_listener = cur.shared_listener;
+	c->exclusive = cur.exclusive;
+	c->listen_fd = cur.listen_fd;
+	c->in_bufsize = cur.in_bufsize;
+	c->conn_data_size = cur.conn_data_size;
+	pthread_mutex_unlock(&rs->lock);
+
+	for (unsigned i = 0;  i != rs->n;  i++) {
+		struct kq_reactor *r = &rs->r[i];
+		if (atomic_exchange(&r->reload_posted, 1))
+			continue; // not yet processed: it will read the new settings anyway
+		r->reload.handler = kq_reactor_reload_handler;
+		kq_post(&r->post, &r->reload);
+	}
+}
+
+static void kq_reactor_stats_handler(struct kq_task *t)
+{
+	struct kq_reactor *r = (void*)((char*)t - offsetof(struct kq_reactor, stats));
+	struct kq_reactors *rs = r->rs;
+	atomic_store(&r->stats_posted, 0);
+	pthread_mutex_lock(&rs->lock);
+	// the requester may have stopped waiting already
+	if (rs->stats_out != NULL && !rs->stats_out[r->index].ok) {
+		struct kq_reactor_stats *st = &rs->stats_out[r->index];
+		st->time_us = kq_now_us();
+		if (r->loop.stats != NULL)
+			st->loop = *r->loop.stats;
+		else
+			kq_stats_init(&st->loop);
+		struct kq_server *s = &r->srv;
+		st->nconns = s->nconns;
+		st->naccepted = s->naccepted;
+		st->naccept_eagain = s->naccept_eagain;
+		st->nread_eagain = s->nread_eagain;
+		st->nwrite_eagain = s->nwrite_eagain;
+		st->ntimeouts = s->ntimeouts;
+		st->nthrottled = s->nthrottled;
+		st->ok = 1;
+		rs->nstats++;
+		pthread_cond_broadcast(&rs->cond);
+	}
+	pthread_mutex_unlock(&rs->lock);
+}
+
+// get a copy of the statistics of each worker: `out` is an array of `rs->n` elements.
+// Each worker copies its own data on its thread, so the workers don't share any counters.
+// Wait no longer than timeout_ms: a worker which is stuck in a handler can't respond.
+// Call it from one thread at a time, and not after the workers are stopped or drained.
+// Return the number of workers which have responded (their `ok` is set)
+static unsigned kq_reactors_stats(struct kq_reactors *rs, struct kq_reactor_stats *out, unsigned timeout_ms)
+{
+	pthread_mutex_lock(&rs->lock);
+	for (unsigned i = 0;  i != rs->n;  i++) {
+		out[i].ok = 0;
+	}
+	rs->stats_out = out;
+	rs->nstats = 0;
+	pthread_mutex_unlock(&rs->lock);
+
+	for (unsigned i = 0;  i != rs->n;  i++) {
+		struct kq_reactor *r = &rs->r[i];
+		if (atomic_exchange(&r->stats_posted, 1))
+			continue; // the previous request is still in the queue: it will fill `out`
+		r->stats.handler = kq_reactor_stats_handler;
+		kq_post(&r->post, &r->stats);
+	}
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	pthread_mutex_lock(&rs->lock);
+	while (rs->nstats != rs->n) {
+		if (0 != pthread_cond_timedwait(&rs->cond, &rs->lock, &deadline))
+			break;
+	}
+	unsigned n = rs->nstats;
+	rs->stats_out = NULL;
+	pthread_mutex_unlock(&rs->lock);
+	return n;
+}
+
+static void kq_reactors_close(struct kq_reactors *rs)
+{
+	free(rs->r);
+	rs->r = NULL;
+	rs->n = 0;
+	if (rs->listen_fd != -1) {
+		close(rs->listen_fd);
+		rs->listen_fd = -1;
+	}
+	for (unsigned i = 0;  i != rs->conf.nlisten_fds;  i++) {
+		close(rs->conf.listen_fds[i]);
+	}
+	rs->conf.nlisten_fds = 0;
+	pthread_mutex_destroy(&rs->lock);
+	pthread_cond_destroy(&rs->cond);
+}
+
+// start the worker threads, each creates its KQ object and listening socket
+static int kq_reactors_start(struct kq_reactors *rs, const struct kq_reactors_conf *conf)
+{
+	unsigned ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned n = conf->n;
+	if (n == 0)
+		n = ncpu;
+	if (conf->nlisten_fds != 0 && conf->listen_mode == KQ_LISTEN_REUSEPORT)
+		n = conf->nlisten_fds; // the kernel distributes the connections between these sockets already
+	rs->n = 0;
+	rs->listen_fd = -1;
+	rs->conf = *conf;
+	rs->ninit = 0;
+	rs->state = 0;
+	rs->stats_out = NULL;
+	pthread_mutex_init(&rs->lock, NULL);
+	pthread_cond_init(&rs->cond, NULL);
+	rs->r = calloc(n, sizeof(struct kq_reactor));
+	if (rs->r == NULL)
+		goto err;
+
+	struct kq_server_conf *sconf = &rs->conf.server;
+	if (conf->listen_mode == KQ_LISTEN_REUSEPORT) {
+		sconf->reuseport = (n > 1);
+	} else {
+		if (conf->nlisten_fds != 0) {
+			rs->listen_fd = conf->listen_fds[0];
+			for (unsigned i = 1;  i != conf->nlisten_fds;  i++) {
+				close(conf->listen_fds[i]);
+			}
+			rs->conf.nlisten_fds = 0; // owned as `listen_fd` now
+		} else {
+			rs->listen_fd = kq_listen(sconf->port, sconf->backlog, 0);
+		}
+		if (rs->listen_fd == -1)
+			goto err;
+		sconf->shared_listener = 1;
+		sconf->listen_fd = rs->listen_fd;
+		sconf->exclusive = (conf->listen_mode == KQ_LISTEN_EXCLUSIVE);
+	}
+
+	int ok = 1;
+	for (unsigned i = 0;  i != n;  i++) {
+		struct kq_reactor *r = &rs->r[i];
+		r->index = i;
+		r->cpu = (conf->pin_cpu) ? (int)(i % ncpu) : -1;
+		r->rs = rs;
+		if (0 != pthread_create(&r->thread, NULL, kq_reactor_main, r)) {
+			ok = 0;
+			break;
+		}
+		rs->n++;
+	}
+
+	pthread_mutex_lock(&rs->lock);
+	while (rs->ninit != rs->n)
+		pthread_cond_wait(&rs->cond, &rs->lock);
+	for (unsigned i = 0;  i != rs->n;  i++) {
+		if (rs->r[i].err != 0) {
+			errno = rs->r[i].err;
+			ok = 0;
+		}
+	}
+	rs->state = (ok) ? 1 : -1;
+	pthread_cond_broadcast(&rs->cond);
+	pthread_mutex_unlock(&rs->lock);
+
+	if (!ok) {
+		int e = errno;
+		for (unsigned i = 0;  i != rs->n;  i++) {
+			pthread_join(rs->r[i].thread, NULL);
+		}
+		kq_reactors_close(rs);
+		errno = e;
+		return -1;
+	}
+	return 0;
+
+err:
+	kq_reactors_close(rs);
+	return -1;
+}
+
+// get the listening sockets to pass them to the new process.
+// Call it before the workers are drained or stopped.
+// Return the number of descriptors
+static unsigned kq_reactors_listeners(struct kq_reactors *rs, int *fds, unsigned max)
+{
+	if (rs->listen_fd != -1) {
+		if (max == 0)
+			return 0;
+		fds[0] = rs->listen_fd;
+		return 1;
+	}
+	// the workers have created their sockets before kq_reactors_start() returned
+	unsigned n = 0;
+	for (unsigned i = 0;  i != rs->n && n != max;  i++) {
+		if (rs->r[i].srv.lobj.fd != -1)
+			fds[n++] = rs->r[i].srv.lobj.fd;
+	}
+	return n;
+}
+
+// wait until all worker threads exit
+static void kq_reactors_wait(struct kq_reactors *rs)
+{
+	for (unsigned i = 0;  i != rs->n;  i++) {
+		pthread_join(rs->r[i].thread, NULL);
+	}
+}
+
+
+// Unix socket which reports the workers' statistics to each client and closes the connection:
+//  $ socat - UNIX-CONNECT:PATH
+// It's served by another loop (e.g. the main thread's) which is blocked while the workers respond.
+struct kq_stats_sock {
+	struct context obj; // listening socket
+	struct kq_reactors *rs;
+	struct kq_reactor_stats *snap; // rs->n elements
+	struct kq_stats *total;
+	char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+	dev_t dev;
+	ino_t ino; // the socket file is removed on close only if it's still ours
+	unsigned long long prev_us, prev_naccepted; // the previous report
+};
+
+static void kq_stats_sock_report(struct kq_stats_sock *ss, FILE *f)
+{
+	struct kq_reactors *rs = ss->rs;
+	unsigned n = kq_reactors_stats(rs, ss->snap, 1000);
+	unsigned nconns = 0;
+	unsigned long long naccepted = 0, naccept_eagain = 0, nread_eagain = 0, nwrite_eagain = 0, ntimeouts = 0, nthrottled = 0;
+	kq_stats_init(ss->total);
+	for (unsigned i = 0;  i != rs->n;  i++) {
+		const struct kq_reactor_stats *st = &ss->snap[i];
+		if (!st->ok) {
+			fprintf(f, "reactor %u: not responding\n\n", i);
+			continue;
+		}
+		fprintf(f, "reactor %u: connections: %u, accepted: %llu, EAGAIN on accept/read/write: %llu/%llu/%llu, timeouts: %llu, throttled: %llu\n"
+			, i, st->nconns, st->naccepted, st->naccept_eagain, st->nread_eagain, st->nwrite_eagain, st->ntimeouts, st->nthrottled);
+		kq_stats_print(f, &st->loop);
+		fprintf(f, "\n");
+		kq_stats_merge(ss->total, &st->loop);
+		nconns += st->nconns;
+		naccepted += st->naccepted;
+		naccept_eagain += st->naccept_eagain;
+		nread_eagain += st->nread_eagain;
+		nwrite_eagain += st->nwrite_eagain;
+		ntimeouts += st->ntimeouts;
+		nthrottled += st->nthrottled;
+	}
+
+	// the accept rate since the previous report
+	unsigned long long now = kq_now_us();
+	if (ss->prev_us == 0)
+		ss->prev_us = ss->total->start_us;
+	double rate = (now > ss->prev_us) ? (naccepted - ss->prev_naccepted) * 1000000.0 / (now - ss->prev_us) : 0;
+	ss->prev_us = now;
+	ss->prev_naccepted = naccepted;
+
+	fprintf(f, "total: %u reactors (%u responded), connections: %u, accepted: %llu (%.1f/s), EAGAIN on accept/read/write: %llu/%llu/%llu, timeouts: %llu, throttled: %llu\n"
+		, rs->n, n, nconns, naccepted, rate, naccept_eagain, nread_eagain, nwrite_eagain, ntimeouts, nthrottled);
+	kq_stats_print(f, ss->total);
+}
+
+static void kq_stats_sock_accept(struct context *obj)
+{
+	struct kq_stats_sock *ss = (void*)((char*)obj - offsetof(struct kq_stats_sock, obj));
+	for (;;) {
+		int sk = accept4(obj->fd, NULL, NULL, SOCK_CLOEXEC);
+		if (sk == -1) {
+			if (errno == EINTR)
+				continue;
+			break; // EAGAIN: no more clients
+		}
+
+		char *buf = NULL;
+		size_t len = 0;
+		FILE *f = open_memstream(&buf, &len);
+		if (f != NULL) {
+			kq_stats_sock_report(ss, f);
+			fclose(f);
+			// don't let a client which doesn't read block the loop
+			struct timeval tv = { 1, 0 };
+			setsockopt(sk, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+			for (size_t off = 0;  off != len;  ) {
+				ssize_t r = send(sk, buf + off, len - off, MSG_NOSIGNAL);
+				if (r < 0 && errno == EINTR)
+					continue;
+				if (r <= 0)
+					break;
+				off += r;
+			}
+			free(buf);
+		}
+		close(sk);
+	}
+}
+
+static void kq_stats_sock_close(struct kq_stats_sock *ss);
+
+// listen on the Unix socket `path`: an existing file is replaced.
+// The workers must be started with conf.stats.
+static int kq_stats_sock_open(struct kq_stats_sock *ss, struct kq_loop *loop, struct kq_reactors *rs, const char *path)
+{
+	memset(ss, 0, sizeof(*ss));
+	ss->rs = rs;
+	ss->obj.fd = -1;
+	struct sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	strcpy(ss->path, path);
+
+	ss->snap = malloc(rs->n * sizeof(struct kq_reactor_stats));
+	ss->total = malloc(sizeof(struct kq_stats));
+	if (ss->snap == NULL || ss->total == NULL)
+		goto err;
+
+	if (-1 == (ss->obj.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)))
+		goto err;
+	unlink(path); // left by the previous process
+	struct stat st;
+	if (0 != bind(ss->obj.fd, (struct sockaddr*)&addr, sizeof(addr))
+		|| 0 != stat(path, &st)
+		|| 0 != listen(ss->obj.fd, 16))
+		goto err;
+	ss->dev = st.st_dev;
+	ss->ino = st.st_ino;
+
+	ss->obj.rhandler = kq_stats_sock_accept;
+	if (0 != kq_attach_listener(loop, &ss->obj, 0))
+		goto err;
+	return 0;
+
+err:
+	kq_stats_sock_close(ss);
+	return -1;
+}
+
+static void kq_stats_sock_close(struct kq_stats_sock *ss)
+{
+	if (ss->obj.fd != -1) {
+		if (ss->obj.loop != NULL)
+			kq_detach(ss->obj.loop, &ss->obj);
+		close(ss->obj.fd);
+		ss->obj.fd = -1;
+		// after a hot upgrade the file belongs to the new process
+		struct stat st;
+		if (ss->ino != 0 && 0 == stat(ss->path, &st) && st.st_dev == ss->dev && st.st_ino == ss->ino)
+			unlink(ss->path);
+	}
+	free(ss->snap);
+	ss->snap = NULL;
+	free(ss->total);
+	ss->total = NULL;
+}
@@ -0,0 +1,1071 @@
+/* Kernel Queue The Complete Guide: kq-server.h: Multi-connection TCP server engine
+The listening socket is attached to KQ in edge-triggered mode, so on every READ event
+ we keep calling accept() until it returns EAGAIN.
+Each accepted socket gets its own context object with non-blocking READ/WRITE handlers.
+The objects are allocated from the server's slab (kq-slab.h).
+Input and output buffers are taken from the server's pool (kq-bufpool.h) only while there's unprocessed or unsent data,
+ so idle connections don't hold any buffers, and normally there are no malloc() calls at all.
+The user provides on_data() which parses the received data and queues a response with kq_conn_send().
+The output is a chain of segments: data copied to the connection's buffer, references to the user's memory, and file ranges.
+The memory segments are sent together with one sendmsg() call,
+ large memory segments are sent with MSG_ZEROCOPY and are released when the kernel reports the completion,
+ and file ranges are sent with sendfile().
+A connection receives or sends no more than its budget per handler call and then yields to the others,
+ so a fast client can't make the others wait.
+Each connection has one timer which is restarted when its state changes:
+ write timeout while the output is blocked, read timeout while a request is incomplete, idle timeout otherwise.
+
+Flow control: when more than out_high bytes are queued for sending, the connection stops reading
+ and the client's data stays in the kernel's buffer, so the TCP window closes and the client has to wait;
+ reading resumes when the output has drained to out_low.
+The user may pause and resume reading too (kq_conn_pause()), e.g. a proxy pauses the connection it reads from
+ while the connection it writes to is above its high watermark (on_output_high()/on_output_low()).
+
+Graceful shutdown (kq_server_drain()): the server stops accepting and closes the idle connections at once;
+ the others are closed as soon as their current responses are sent, or when the deadline expires.
+Some settings can be changed while the server is running (kq_server_reload()).
+*/
+#pragma once
+#include "kq.h"
+#include "kq-slab.h"
+#include "kq-bufpool.h"
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/errqueue.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#ifndef SO_ZEROCOPY
+	#define SO_ZEROCOPY  60
+#endif
+#ifndef MSG_ZEROCOPY
+	#define MSG_ZEROCOPY  0x4000000
+#endif
+
+struct kq_server;
+
+enum KQ_SEG {
+	KQ_SEG_COPY, // data in the connection's output buffer
+	KQ_SEG_MEM, // user's memory
+	KQ_SEG_FILE, // file range
+};
+
+// a segment of the output chain
+struct kq_seg {
+	struct kq_seg *next;
+	enum KQ_SEG type;
+	size_t len; // bytes left to send
+	union {
+		size_t off; // KQ_SEG_COPY: offset in the output buffer
+		const char *data; // KQ_SEG_MEM
+		off_t file_off; // KQ_SEG_FILE
+	};
+	int fd; // KQ_SEG_FILE
+
+	// KQ_SEG_MEM: it was sent with MSG_ZEROCOPY:
+	//  the memory is in use until the kernel reports the completion of send number `zc_seq`
+	unsigned zc :1;
+	unsigned zc_seq;
+
+	// called when the segment is sent (or the connection is closed)
+	void (*done)(void *udata);
+	void *udata;
+};
+
+struct kq_conn {
+	struct context obj; // must be the first member
+	struct kq_server *srv;
+	void *udata;
+
+	// received data which wasn't yet processed by on_data(); NULL: no data
+	char *in;
+	size_t in_len, in_cap;
+
+	// data to be sent; NULL: no data.
+	// If the chain is empty, the buffer holds all the output; otherwise it's used by KQ_SEG_COPY segments.
+	char *out;
+	size_t out_off, out_len, out_cap;
+	struct kq_seg *chain, **chain_last;
+
+	// MSG_ZEROCOPY: segments which are sent, but the kernel may still use their memory
+	struct kq_seg *zc_pending, **zc_pending_last;
+	unsigned zc_next; // the number of the next zero-copy send
+	unsigned zc_lo; // all zero-copy sends before this one are complete
+	unsigned long long zc_done; // completions received out of order: bit N = send number zc_lo + N
+	unsigned zerocopy :1; // MSG_ZEROCOPY is enabled for the socket
+
+	struct kq_timer timer; // idle, read or write timeout
+	struct kq_conn *prev, *next; // in the list of the server's connections
+
+	size_t out_pending; // bytes queued for sending: flow control
+
+	unsigned reading :1; // inside READ handler: responses are sent in one batch when it finishes
+	unsigned paused :1; // the user has paused reading
+	unsigned throttled :1; // reading is paused because the output is above the high watermark
+	unsigned closing :1; // close the connection after all pending data is sent
+	unsigned received :1; // some data is received: a just accepted connection may have its first request still in flight
+};
+
+struct kq_server_conf {
+	unsigned short port;
+	int backlog;
+	unsigned reuseport :1; // allow several listening sockets on the same port (SO_REUSEPORT)
+
+	// use the existing listening socket `listen_fd` which is shared with other servers.
+	// The server doesn't close it.
+	unsigned shared_listener :1;
+	unsigned exclusive :1; // wake up only one of the threads waiting for the shared listener
+	int listen_fd;
+	size_t in_bufsize; // size of the buffers in the pool
+	size_t in_maxsize; // close connection if it sends a larger request than this
+	unsigned prealloc_conns; // allocate memory for this many connections at start
+	unsigned prealloc_bufs; // allocate this many buffers at start
+	size_t conn_data_size; // the user's memory in each connection object (kq_conn.udata), zeroed on accept
+
+	// max. number of bytes to receive/send per one handler call; 0: default
+	size_t read_budget, write_budget;
+
+	// send the memory segments of at least this size with MSG_ZEROCOPY; 0: never
+	size_t zerocopy_min;
+
+	// close connection if (0: no timeout):
+	unsigned idle_timeout_ms; // no new requests are received
+	unsigned read_timeout_ms; // a request is received only partially
+	unsigned write_timeout_ms; // the client doesn't read the data we send
+
+	// stop reading while more than out_high bytes are queued for sending; 0: no limit.
+	// Resume when no more than out_low bytes are left;  out_low >= out_high: default (out_high / 2)
+	size_t out_high, out_low;
+
+	// called instead of pausing and resuming the connection itself when its output crosses the watermarks,
+	//  e.g. to pause the connection whose data is forwarded to `c`
+	void (*on_output_high)(struct kq_conn *c);
+	void (*on_output_low)(struct kq_conn *c);
+
+	// called when new data is received from client.
+	// Return the number of bytes processed, the rest stays in input buffer;
+	//  or -1 to close connection.
+	int (*on_data)(struct kq_conn *c, const char *data, size_t len);
+	void (*on_close)(struct kq_conn *c);
+	void *udata;
+
+	// called by kq_server_reload() after the new settings are applied; `old` holds the previous ones
+	void (*on_reload)(struct kq_server *s, const struct kq_server_conf *old);
+};
+
+struct kq_server {
+	struct kq_loop *loop;
+	struct context lobj; // listening socket
+	struct kq_server_conf conf;
+	struct kq_slab conns; // memory for connection objects
+	struct kq_bufpool bufs; // input and output buffers
+	struct kq_slab segs; // output chain segments
+	unsigned nconns;
+	struct kq_conn *list; // active connections
+	unsigned long long naccepted;
+
+	// graceful shutdown
+	unsigned draining :1;
+	struct kq_timer drain_timer;
+	void (*on_drained)(struct kq_server *s);
+
+	unsigned long long nwakeups; // READ events on the listening socket
+	unsigned long long nspurious; // wakeups which didn't accept any connection
+	unsigned long long naccept_eagain; // accept() calls failed with EAGAIN: normally the last call of every wakeup
+	unsigned long long naccept_failed; // the first accept() of a wakeup failed with EAGAIN: another thread took the connection
+	unsigned long long nread_eagain; // recv() calls failed with EAGAIN: the read buffer is drained
+	unsigned long long nwrite_eagain; // send() calls failed with EAGAIN: the client doesn't read fast enough
+	unsigned long long ntimeouts; // connections closed by timeout
+	unsigned long long nthrottled; // reading was paused by the high watermark
+	unsigned long long nzerocopy; // zero-copy sends
+	unsigned long long nzerocopy_copied; // zero-copy sends for which the kernel had to copy the data
+};
+
+static void kq_conn_read(struct context *obj);
+static void kq_conn_write(struct context *obj);
+static void kq_conn_zc_wait(struct context *obj);
+
+// get memory for a new connection object
+static struct kq_conn* kq_conn_alloc(struct kq_server *s)
+{
+	struct kq_conn *c = kq_slab_alloc(&s->conns);
+	if (c == NULL)
+		return NULL;
+
+	// preserve the generation left from the previous connection in this slot
+	unsigned gen = c->obj.gen;
+	memset(c, 0, sizeof(*c) + s->conf.conn_data_size);
+	c->obj.gen = gen;
+	c->srv = s;
+	if (s->conf.conn_data_size != 0)
+		c->udata = c + 1;
+	c->chain_last = &c->chain;
+	c->zc_pending_last = &c->zc_pending;
+	return c;
+}
+
+// return the buffer to the pool, or free it if it was enlarged
+static void kq_conn_buf_free(struct kq_server *s, char **buf, size_t *cap)
+{
+	kq_bufpool_buf_free(&s->bufs, buf, cap);
+}
+
+// make the buffer large enough for `need` bytes, preserving `used` bytes of data
+static int kq_conn_buf_grow(struct kq_server *s, char **buf, size_t *cap, size_t used, size_t need)
+{
+	return kq_bufpool_buf_grow(&s->bufs, buf, cap, used, need);
+}
+
+// return the object to the slab: called by the loop after the current batch of events is processed
+static void kq_conn_release(struct context *obj)
+{
+	struct kq_conn *c = (struct kq_conn*)obj;
+	struct kq_server *s = c->srv;
+	kq_conn_buf_free(s, &c->in, &c->in_cap);
+	kq_conn_buf_free(s, &c->out, &c->out_cap);
+	kq_slab_free(&s->conns, c);
+}
+
+static void kq_seg_done(struct kq_server *s, struct kq_seg *seg)
+{
+	if (seg->done != NULL)
+		seg->done(seg->udata);
+	kq_slab_free(&s->segs, seg);
+}
+
+// release all segments of the list
+static void kq_seg_list_done(struct kq_server *s, struct kq_seg **list, struct kq_seg ***last)
+{
+	struct kq_seg *seg = *list;
+	while (seg != NULL) {
+		struct kq_seg *next = seg->next;
+		kq_seg_done(s, seg);
+		seg = next;
+	}
+	*list = NULL;
+	*last = list;
+}
+
+static void kq_server_drained(struct kq_server *s);
+
+static void kq_conn_close(struct kq_conn *c)
+{
+	if (c->obj.fd == -1)
+		return; // already closed
+	c->closing = 1;
+	if (c->srv->conf.on_close != NULL)
+		c->srv->conf.on_close(c);
+	struct kq_server *s = c->srv;
+	s->nconns--;
+	if (c->prev != NULL)
+		c->prev->next = c->next;
+	else
+		s->list = c->next;
+	if (c->next != NULL)
+		c->next->prev = c->prev;
+	kq_timer_remove(s->loop, &c->timer);
+	kq_retire(s->loop, &c->obj);
+
+	// data sent with MSG_ZEROCOPY may still be in the socket's queue:
+	//  the kernel holds its own references to the pages, but the user shouldn't modify them for a while
+	kq_seg_list_done(s, &c->chain, &c->chain_last);
+	kq_seg_list_done(s, &c->zc_pending, &c->zc_pending_last);
+
+	if (s->draining && s->nconns == 0)
+		kq_server_drained(s);
+}
+
+// restart the connection's timer according to its state
+static void kq_conn_timer_update(struct kq_conn *c)
+{
+	const struct kq_server_conf *conf = &c->srv->conf;
+	unsigned ms = (c->obj.whandler != NULL) ? conf->write_timeout_ms
+		: (c->in_len != 0) ? conf->read_timeout_ms
+		: conf->idle_timeout_ms;
+	if (ms != 0)
+		kq_timer_add(c->srv->loop, &c->timer, ms);
+	else
+		kq_timer_remove(c->srv->loop, &c->timer);
+}
+
+static void kq_conn_timeout(struct kq_timer *t)
+{
+	struct kq_conn *c = (void*)((char*)t - offsetof(struct kq_conn, timer));
+	c->srv->ntimeouts++;
+	kq_conn_close(c);
+}
+
+// start or stop receiving according to the flow control state
+static void kq_conn_read_update(struct kq_conn *c)
+{
+	if (c->obj.fd == -1 || c->closing)
+		return;
+	if (c->paused || c->throttled) {
+		// poll() stops asking for READ, and the events from epoll and io_uring are ignored
+		c->obj.rhandler = NULL;
+	} else if (c->obj.rhandler == NULL) {
+		c->obj.rhandler = kq_conn_read;
+		// with EPOLLET there's no new event for the data which was left in the kernel's buffer
+		kq_yield(c->srv->loop, &c->obj, KQ_READY_R);
+	}
+}
+
+// stop receiving data from the client until kq_conn_resume()
+static void kq_conn_pause(struct kq_conn *c)
+{
+	c->paused = 1;
+	kq_conn_read_update(c);
+}
+
+static void kq_conn_resume(struct kq_conn *c)
+{
+	c->paused = 0;
+	kq_conn_read_update(c);
+}
+
+// `len` bytes were queued for sending
+static void kq_conn_out_added(struct kq_conn *c, size_t len)
+{
+	const struct kq_server_conf *conf = &c->srv->conf;
+	c->out_pending += len;
+	if (conf->out_high == 0 || c->throttled || c->out_pending <= conf->out_high)
+		return;
+	c->throttled = 1;
+	c->srv->nthrottled++;
+	if (conf->on_output_high != NULL)
+		conf->on_output_high(c);
+	else
+		kq_conn_read_update(c);
+}
+
+// `len` bytes were sent
+static void kq_conn_out_sent(struct kq_conn *c, size_t len)
+{
+	const struct kq_server_conf *conf = &c->srv->conf;
+	c->out_pending -= len;
+	if (!c->throttled || c->out_pending > conf->out_low)
+		return;
+	c->throttled = 0;
+	if (conf->on_output_low != NULL)
+		conf->on_output_low(c);
+	else
+		kq_conn_read_update(c);
+}
+
+enum {
+	KQ_IOV_MAX = 64,
+	KQ_ZC_INFLIGHT_MAX = 64, // the number of zero-copy sends waiting for completion
+	KQ_SEND_COPY_MAX = 512, // kq_conn_send_ref(): copy smaller data instead of referencing it
+};
+
+// a zero-copy send is complete
+static void kq_conn_zc_complete(struct kq_conn *c, unsigned lo, unsigned hi)
+{
+	if (lo == c->zc_lo) {
+		unsigned n = hi - lo + 1;
+		c->zc_lo = hi + 1;
+		c->zc_done = (n < 64) ? c->zc_done >> n : 0;
+		while (c->zc_done & 1) {
+			c->zc_done >>= 1;
+			c->zc_lo++;
+		}
+		return;
+	}
+	// out of order
+	for (unsigned seq = lo;  seq != hi + 1;  seq++) {
+		unsigned i = seq - c->zc_lo;
+		if (i < 64)
+			c->zc_done |= 1ULL << i;
+	}
+}
+
+// read MSG_ZEROCOPY completions from the socket's error queue (KQ signals them as an error event)
+//  and release the segments which aren't used by the kernel anymore
+static void kq_conn_zc_reap(struct kq_conn *c)
+{
+	for (;;) {
+		char control[128];
+		struct msghdr msg = {};
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(c->obj.fd, &msg, MSG_ERRQUEUE) < 0)
+			break; // EAGAIN: no more notifications
+
+		for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);  cm != NULL;  cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+				|| (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+				continue;
+			const struct sock_extended_err *ee = (void*)CMSG_DATA(cm);
+			if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+				// the kernel had to copy the data anyway (e.g. loopback): it's cheaper to just copy it
+				c->srv->nzerocopy_copied++;
+				c->zerocopy = 0;
+			}
+			kq_conn_zc_complete(c, ee->ee_info, ee->ee_data);
+		}
+	}
+
+	while (c->zc_pending != NULL
+		&& (int)(c->zc_pending->zc_seq - c->zc_lo) < 0) {
+		struct kq_seg *seg = c->zc_pending;
+		c->zc_pending = seg->next;
+		kq_seg_done(c->srv, seg);
+	}
+	if (c->zc_pending == NULL)
+		c->zc_pending_last = &c->zc_pending;
+}
+
+// remove `n` sent bytes from the beginning of the chain
+static void kq_conn_chain_consume(struct kq_conn *c, size_t n)
+{
+	while (n != 0) {
+		struct kq_seg *seg = c->chain;
+		size_t k = (n < seg->len) ? n : seg->len;
+		switch (seg->type) {
+		case KQ_SEG_COPY:
+			seg->off += k; break;
+		case KQ_SEG_MEM:
+			seg->data += k; break;
+		case KQ_SEG_FILE:
+			seg->file_off += k; break;
+		}
+		seg->len -= k;
+		n -= k;
+		if (seg->len != 0)
+			break;
+
+		c->chain = seg->next;
+		if (c->chain == NULL) {
+			c->chain_last = &c->chain;
+			c->out_off = c->out_len; // all data in the output buffer was in the chain
+		}
+		if (seg->zc) {
+			// wait until the kernel releases the memory
+			seg->next = NULL;
+			*c->zc_pending_last = seg;
+			c->zc_pending_last = &seg->next;
+		} else {
+			kq_seg_done(c->srv, seg);
+		}
+	}
+}
+
+// can the segment be sent with MSG_ZEROCOPY?
+static inline int kq_conn_zc_seg(const struct kq_conn *c, const struct kq_seg *seg)
+{
+	return seg->type == KQ_SEG_MEM
+		&& c->zerocopy
+		&& seg->len >= c->srv->conf.zerocopy_min
+		&& c->zc_next - c->zc_lo < KQ_ZC_INFLIGHT_MAX;
+}
+
+// send the segments from the beginning of the chain with one syscall
+static ssize_t kq_conn_chain_send(struct kq_conn *c)
+{
+	struct kq_seg *seg = c->chain;
+	ssize_t r;
+
+	if (seg->type == KQ_SEG_FILE) {
+		off_t off = seg->file_off;
+		r = sendfile(c->obj.fd, seg->fd, &off, seg->len);
+		if (r == 0) {
+			errno = EIO; // the file is shorter than expected
+			return -1;
+		}
+		if (r > 0)
+			kq_conn_chain_consume(c, r);
+		return r;
+	}
+
+	// Zero-copy send includes only the user's memory segments:
+	//  the kernel may use the memory after sendmsg() returns, but the output buffer is reused.
+	// The data copied to the output buffer is sent with a separate call with MSG_MORE,
+	//  so the kernel doesn't send it in a separate packet.
+	int zc = kq_conn_zc_seg(c, seg);
+	struct iovec iov[KQ_IOV_MAX];
+	unsigned n = 0;
+	for (struct kq_seg *it = seg;  it != NULL && n != KQ_IOV_MAX;  it = it->next) {
+		if (it->type == KQ_SEG_FILE
+			|| (zc && it->type != KQ_SEG_MEM)
+			|| (!zc && kq_conn_zc_seg(c, it)))
+			break;
+		iov[n].iov_base = (it->type == KQ_SEG_COPY) ? c->out + it->off : (char*)it->data;
+		iov[n].iov_len = it->len;
+		n++;
+		seg = it;
+	}
+
+	struct msghdr msg = {};
+	msg.msg_iov = iov;
+	msg.msg_iovlen = n;
+	int flags = MSG_NOSIGNAL;
+	if (seg->next != NULL)
+		flags |= MSG_MORE; // more data follows
+	r = sendmsg(c->obj.fd, &msg, flags | ((zc) ? MSG_ZEROCOPY : 0));
+	if (r < 0 && zc && errno == ENOBUFS) {
+		// the kernel can't pin any more pages for this socket
+		zc = 0;
+		r = sendmsg(c->obj.fd, &msg, flags);
+	}
+	if (r < 0)
+		return -1;
+
+	if (zc) {
+		// the segments which were sent (even partially) must wait for the completion
+		unsigned seq = c->zc_next++;
+		c->srv->nzerocopy++;
+		size_t off = 0;
+		for (struct kq_seg *it = c->chain;  off < (size_t)r;  it = it->next) {
+			it->zc = 1;
+			it->zc_seq = seq;
+			off += it->len;
+		}
+	}
+	kq_conn_chain_consume(c, r);
+	return r;
+}
+
+// send as much pending data as the socket accepts
+static int kq_conn_flush(struct kq_conn *c)
+{
+	size_t sent = 0;
+	while (c->chain != NULL || c->out_off != c->out_len) {
+		if (sent >= c->srv->conf.write_budget) {
+			// continue after the other connections have been processed
+			c->obj.whandler = kq_conn_write;
+			kq_yield(c->srv->loop, &c->obj, KQ_READY_W);
+			kq_conn_timer_update(c);
+			return 0;
+		}
+
+		ssize_t r;
+		if (c->chain == NULL) {
+			// only the data in the output buffer
+			r = send(c->obj.fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+			if (r > 0)
+				c->out_off += r;
+		} else {
+			r = kq_conn_chain_send(c);
+		}
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				// the socket's write buffer is full
+				c->srv->nwrite_eagain++;
+				c->obj.whandler = kq_conn_write;
+				kq_conn_timer_update(c);
+				return 0;
+			}
+			kq_conn_close(c);
+			return -1;
+		}
+		sent += r;
+		kq_conn_out_sent(c, r);
+	}
+
+	c->out_off = c->out_len = 0;
+	kq_conn_buf_free(c->srv, &c->out, &c->out_cap);
+	c->obj.whandler = NULL; // we don't want any more signals from KQ
+	if (c->closing) {
+		if (c->zc_pending != NULL) {
+			// wait for zero-copy completions: the kernel may still be sending the user's memory
+			c->obj.rhandler = kq_conn_zc_wait;
+			kq_conn_timer_update(c);
+			return 0;
+		}
+		kq_conn_close(c);
+		return -1;
+	}
+	if (c->srv->draining && c->in_len == 0 && !c->reading) {
+		// the response is sent and there's no new request: the connection isn't needed anymore
+		kq_conn_close(c);
+		return -1;
+	}
+	kq_conn_timer_update(c);
+	return 0;
+}
+
+static void kq_conn_write(struct context *obj)
+{
+	struct kq_conn *c = (struct kq_conn*)obj;
+	if (c->zc_pending != NULL)
+		kq_conn_zc_reap(c);
+	kq_conn_flush(c);
+}
+
+// rhandler: all data is sent, close the connection after the zero-copy sends are complete
+static void kq_conn_zc_wait(struct context *obj)
+{
+	struct kq_conn *c = (struct kq_conn*)obj;
+	kq_conn_zc_reap(c);
+	if (c->zc_pending == NULL)
+		kq_conn_close(c);
+}
+
+// queue data for sending: the data is copied
+static int kq_conn_send(struct kq_conn *c, const void *data, size_t len)
+{
+	size_t off = c->out_len;
+	struct kq_seg *seg = NULL, *last = NULL;
+	if (c->chain != NULL) {
+		last = (struct kq_seg*)((char*)c->chain_last - offsetof(struct kq_seg, next));
+		if (!(last->type == KQ_SEG_COPY && last->off + last->len == off)) {
+			// a new segment: get it before the data is added, so that a failure leaves nothing half-queued
+			if (NULL == (seg = kq_slab_alloc(&c->srv->segs)))
+				return -1;
+		}
+	}
+
+	if (0 != kq_conn_buf_grow(c->srv, &c->out, &c->out_cap, c->out_len, c->out_len + len)) {
+		if (seg != NULL)
+			kq_slab_free(&c->srv->segs, seg);
+		return -1;
+	}
+	memcpy(c->out + c->out_len, data, len);
+	c->out_len += len;
+
+	if (seg != NULL) {
+		memset(seg, 0, sizeof(*seg));
+		seg->type = KQ_SEG_COPY;
+		seg->off = off;
+		seg->len = len;
+		*c->chain_last = seg;
+		c->chain_last = &seg->next;
+	} else if (last != NULL) {
+		last->len += len; // append to the previous segment
+	}
+	kq_conn_out_added(c, len);
+
+	if (!c->reading && c->obj.whandler == NULL)
+		return kq_conn_flush(c);
+	return 0;
+}
+
+// add a segment to the output chain.
+// On failure the segment's done() is called too.
+static int kq_conn_send_seg(struct kq_conn *c, const struct kq_seg *tmpl)
+{
+	struct kq_seg *seg = kq_slab_alloc(&c->srv->segs);
+	if (seg == NULL)
+		goto err;
+
+	if (c->chain == NULL && c->out_off != c->out_len) {
+		// the data in the output buffer must be sent first
+		struct kq_seg *cseg = kq_slab_alloc(&c->srv->segs);
+		if (cseg == NULL) {
+			kq_slab_free(&c->srv->segs, seg);
+			goto err;
+		}
+		memset(cseg, 0, sizeof(*cseg));
+		cseg->type = KQ_SEG_COPY;
+		cseg->off = c->out_off;
+		cseg->len = c->out_len - c->out_off;
+		*c->chain_last = cseg;
+		c->chain_last = &cseg->next;
+	}
+
+	*seg = *tmpl;
+	seg->next = NULL;
+	*c->chain_last = seg;
+	c->chain_last = &seg->next;
+	kq_conn_out_added(c, seg->len);
+
+	if (!c->reading && c->obj.whandler == NULL)
+		return kq_conn_flush(c);
+	return 0;
+
+err:
+	if (tmpl->done != NULL)
+		tmpl->done(tmpl->udata);
+	return -1;
+}
+
+// queue the user's memory for sending without copying.
+// done(udata) is called when the memory isn't needed anymore: after it's sent, when the connection is closed,
+//  or if the function fails.
+// Large data is sent with MSG_ZEROCOPY (if enabled by zerocopy_min).
+static int kq_conn_send_ref(struct kq_conn *c, const void *data, size_t len, void (*done)(void *udata), void *udata)
+{
+	if (len < KQ_SEND_COPY_MAX) {
+		// copying is cheaper than managing a segment
+		int r = kq_conn_send(c, data, len);
+		if (done != NULL)
+			done(udata);
+		return r;
+	}
+
+	struct kq_seg seg = {};
+	seg.type = KQ_SEG_MEM;
+	seg.data = data;
+	seg.len = len;
+	seg.done = done;
+	seg.udata = udata;
+	return kq_conn_send_seg(c, &seg);
+}
+
+// queue a file range for sending with sendfile().
+// done(udata) is called when the range is sent, when the connection is closed, or if the function fails.
+static int kq_conn_sendfile(struct kq_conn *c, int fd, off_t off, size_t len, void (*done)(void *udata), void *udata)
+{
+	struct kq_seg seg = {};
+	seg.type = KQ_SEG_FILE;
+	seg.fd = fd;
+	seg.file_off = off;
+	seg.len = len;
+	seg.done = done;
+	seg.udata = udata;
+	return kq_conn_send_seg(c, &seg);
+}
+
+// close the connection after all queued data is sent, e.g. after a response with "Connection: close".
+// The requests which are received later are ignored.
+static void kq_conn_finish(struct kq_conn *c)
+{
+	c->closing = 1;
+	if (!c->reading && c->obj.whandler == NULL)
+		kq_conn_flush(c);
+}
+
+// pass the input data to the user and remove the processed part
+static int kq_conn_process(struct kq_conn *c)
+{
+	size_t off = 0;
+	while (off != c->in_len && !c->closing) {
+		int r = c->srv->conf.on_data(c, c->in + off, c->in_len - off);
+		if (r < 0)
+			return -1;
+		if (r == 0)
+			break; // need more data
+		off += r;
+	}
+	memmove(c->in, c->in + off, c->in_len - off);
+	c->in_len -= off;
+	return 0;
+}
+
+static void kq_conn_read(struct context *obj)
+{
+	struct kq_conn *c = (struct kq_conn*)obj;
+	struct kq_server *s = c->srv;
+	size_t nread = 0;
+	if (c->zc_pending != NULL)
+		kq_conn_zc_reap(c); // the error event may be a zero-copy completion
+	c->reading = 1;
+	for (;;) {
+		if (nread >= s->conf.read_budget) {
+			// there may be more data: continue after the other connections have been processed
+			kq_yield(s->loop, &c->obj, KQ_READY_R);
+			break;
+		}
+
+		if (c->in_len == c->in_cap) {
+			// take a buffer from the pool, or enlarge the buffer for a large request
+			if (c->in_cap >= s->conf.in_maxsize)
+				goto err; // the request is too large
+			if (0 != kq_conn_buf_grow(s, &c->in, &c->in_cap, c->in_len, c->in_len + 1))
+				goto err;
+		}
+
+		ssize_t r = recv(c->obj.fd, c->in + c->in_len, c->in_cap - c->in_len, 0);
+		if (r > 0) {
+			c->in_len += r;
+			nread += r;
+			c->received = 1;
+			if (0 != kq_conn_process(c))
+				goto err;
+			if (c->closing || c->obj.rhandler == NULL)
+				break; // or reading is paused
+
+		} else if (r == 0) {
+			// client has finished sending data
+			c->obj.rhandler = NULL;
+			c->closing = 1;
+			break;
+
+		} else if (errno == EINTR) {
+			continue;
+
+		} else if (errno == EAGAIN) {
+			// the socket's read buffer is empty
+			s->nread_eagain++;
+			break;
+
+		} else {
+			goto err;
+		}
+	}
+
+	c->reading = 0;
+	if (c->in_len == 0)
+		kq_conn_buf_free(s, &c->in, &c->in_cap); // all input is processed
+	// while the output is blocked, the write timer keeps running
+	if (c->obj.fd != -1 && c->obj.whandler == NULL)
+		kq_conn_flush(c); // send all responses at once and restart the timer
+	return;
+
+err:
+	c->reading = 0;
+	kq_conn_close(c);
+}
+
+static void kq_accept_handler(struct context *obj)
+{
+	struct kq_server *s = (void*)((char*)obj - offsetof(struct kq_server, lobj));
+	unsigned long long accepted = s->naccepted;
+	int first = 1;
+	s->nwakeups++;
+
+	// accept all pending connections: KQ won't signal us again until we drain the queue
+	for (;;) {
+		int csock = accept4(obj->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (csock == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			// EAGAIN: no more pending connections
+			//  (or another thread sharing the same listening socket has taken them)
+			// EMFILE, ENFILE, ENOBUFS: leave the rest in the queue until the next signal
+			if (errno == EAGAIN) {
+				s->naccept_eagain++;
+				if (first)
+					s->naccept_failed++;
+			}
+			break;
+		}
+		first = 0;
+
+		struct kq_conn *c = kq_conn_alloc(s);
+		if (c == NULL) {
+			close(csock);
+			continue;
+		}
+		c->obj.fd = csock;
+		c->obj.rhandler = kq_conn_read;
+		c->obj.release = kq_conn_release;
+		c->timer.handler = kq_conn_timeout;
+
+		int val = 1;
+		setsockopt(csock, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+		if (s->conf.zerocopy_min != 0)
+			c->zerocopy = (0 == setsockopt(csock, SOL_SOCKET, SO_ZEROCOPY, &val, sizeof(val)));
+
+		if (0 != kq_attach(s->loop, &c->obj)) {
+			close(csock);
+			c->obj.fd = -1;
+			kq_conn_release(&c->obj);
+			continue;
+		}
+		KQ_PROBE3(accept, &s->lobj, &c->obj, csock);
+		kq_trace_add(KQ_TRACE_ACCEPT, &c->obj, csock, c->obj.gen, (size_t)&s->lobj);
+		s->nconns++;
+		s->naccepted++;
+		c->next = s->list;
+		if (s->list != NULL)
+			s->list->prev = c;
+		s->list = c;
+		// no read here: attaching the socket checks its readiness, so KQ reports the data which is already there
+	}
+
+	if (accepted == s->naccepted)
+		s->nspurious++;
+}
+
+// create a non-blocking listening socket on all IPv4 interfaces
+static int kq_listen(unsigned short port, int backlog, int reuseport)
+{
+	int sk = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sk == -1)
+		return -1;
+	int val = 1;
+	setsockopt(sk, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+	if (reuseport
+		&& 0 != setsockopt(sk, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)))
+		goto err;
+
+	struct sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (0 != bind(sk, (struct sockaddr*)&addr, sizeof(addr))
+		|| 0 != listen(sk, (backlog != 0) ? backlog : SOMAXCONN))
+		goto err;
+	return sk;
+
+err:
+	close(sk);
+	return -1;
+}
+
+static int kq_server_start(struct kq_server *s, struct kq_loop *loop, const struct kq_server_conf *conf)
+{
+	s->loop = loop;
+	s->conf = *conf;
+	if (s->conf.backlog == 0)
+		s->conf.backlog = SOMAXCONN;
+	if (s->conf.in_bufsize == 0)
+		s->conf.in_bufsize = 4*1024;
+	if (s->conf.in_maxsize < s->conf.in_bufsize)
+		s->conf.in_maxsize = 64*1024;
+	if (s->conf.read_budget == 0)
+		s->conf.read_budget = 256*1024;
+	if (s->conf.write_budget == 0)
+		s->conf.write_budget = 256*1024;
+	if (s->conf.out_low >= s->conf.out_high)
+		s->conf.out_low = s->conf.out_high / 2;
+	kq_slab_init(&s->conns, sizeof(struct kq_conn) + s->conf.conn_data_size, 0);
+	kq_slab_init(&s->segs, sizeof(struct kq_seg), 0);
+	kq_bufpool_init(&s->bufs, s->conf.in_bufsize, 0, 0);
+	if (0 != kq_slab_reserve(&s->conns, s->conf.prealloc_conns)
+		|| 0 != kq_bufpool_reserve(&s->bufs, s->conf.prealloc_bufs))
+		goto err;
+	s->nconns = 0;
+	s->list = NULL;
+	s->naccepted = 0;
+	s->draining = 0;
+	s->on_drained = NULL;
+	memset(&s->drain_timer, 0, sizeof(s->drain_timer));
+	s->nwakeups = s->nspurious = s->naccept_eagain = s->naccept_failed = 0;
+	s->nread_eagain = s->nwrite_eagain = 0;
+	s->ntimeouts = s->nthrottled = 0;
+	s->nzerocopy = s->nzerocopy_copied = 0;
+
+	memset(&s->lobj, 0, sizeof(s->lobj));
+	s->lobj.rhandler = kq_accept_handler;
+	if (loop->stats != NULL) {
+		kq_stats_name(loop->stats, kq_accept_handler, "kq_accept_handler");
+		kq_stats_name(loop->stats, kq_conn_read, "kq_conn_read");
+		kq_stats_name(loop->stats, kq_conn_write, "kq_conn_write");
+		kq_stats_name(loop->stats, kq_conn_zc_wait, "kq_conn_zc_wait");
+	}
+
+	if (s->conf.shared_listener) {
+		s->lobj.fd = s->conf.listen_fd;
+	} else {
+		s->lobj.fd = kq_listen(s->conf.port, s->conf.backlog, s->conf.reuseport);
+		if (s->lobj.fd == -1)
+			goto err;
+	}
+
+	if (0 != kq_attach_listener(loop, &s->lobj, s->conf.shared_listener && s->conf.exclusive)) {
+		if (!s->conf.shared_listener)
+			close(s->lobj.fd);
+		s->lobj.fd = -1;
+		goto err;
+	}
+	return 0;
+
+err:
+	kq_slab_close(&s->conns);
+	kq_slab_close(&s->segs);
+	kq_bufpool_close(&s->bufs);
+	return -1;
+}
+
+// stop accepting new connections
+static void kq_server_unlisten(struct kq_server *s)
+{
+	if (s->lobj.fd != -1) {
+		kq_detach(s->loop, &s->lobj);
+		if (!s->conf.shared_listener)
+			close(s->lobj.fd);
+		s->lobj.fd = -1;
+	}
+}
+
+// all connections are closed after kq_server_drain()
+static void kq_server_drained(struct kq_server *s)
+{
+	kq_timer_remove(s->loop, &s->drain_timer);
+	void (*on_drained)(struct kq_server *s) = s->on_drained;
+	s->on_drained = NULL;
+	if (on_drained != NULL)
+		on_drained(s);
+}
+
+// the deadline has expired: abort all remaining connections.
+// After close() the kernel would keep sending the queued data to a slow client for a long time;
+//  with zero linger time it discards the data and sends RST.
+static void kq_server_drain_expired(struct kq_timer *t)
+{
+	struct kq_server *s = (void*)((char*)t - offsetof(struct kq_server, drain_timer));
+	while (s->list != NULL) {
+		struct kq_conn *c = s->list;
+		struct linger lg = { 1, 0 };
+		setsockopt(c->obj.fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+		s->ntimeouts++;
+		kq_conn_close(c);
+	}
+}
+
+// graceful shutdown: stop accepting new connections,
+//  close the idle connections now and the others after their current responses are sent.
+// A new connection which hasn't sent anything yet is expected to send a request: it's served and then closed.
+// deadline_ms: close all remaining connections after this time; 0: no deadline
+// on_drained() is called when there are no more connections; it may be called from inside this function.
+static void kq_server_drain(struct kq_server *s, unsigned deadline_ms, void (*on_drained)(struct kq_server *s))
+{
+	kq_server_unlisten(s);
+	s->draining = 1;
+	s->on_drained = on_drained;
+
+	struct kq_conn *c = s->list;
+	while (c != NULL) {
+		struct kq_conn *next = c->next;
+		if (c->received && c->in_len == 0 && c->obj.whandler == NULL && c->obj.ready == 0)
+			kq_conn_close(c); // there's no request in progress
+		c = next;
+	}
+
+	if (s->nconns == 0) {
+		kq_server_drained(s);
+		return;
+	}
+	if (deadline_ms != 0) {
+		s->drain_timer.handler = kq_server_drain_expired;
+		kq_timer_add(s->loop, &s->drain_timer, deadline_ms);
+	}
+}
+
+// apply new settings to the running server: timeouts, budgets, limits, callbacks and user data.
+// The other settings (port, listening socket, buffer size) can't be changed and are ignored.
+// The active connections use the new timeouts from their next state change.
+static void kq_server_reload(struct kq_server *s, const struct kq_server_conf *conf)
+{
+	struct kq_server_conf old = s->conf;
+	struct kq_server_conf *c = &s->conf;
+	c->in_maxsize = (conf->in_maxsize < c->in_bufsize) ? 64*1024 : conf->in_maxsize;
+	c->read_budget = (conf->read_budget != 0) ? conf->read_budget : 256*1024;
+	c->write_budget = (conf->write_budget != 0) ? conf->write_budget : 256*1024;
+	c->zerocopy_min = conf->zerocopy_min;
+	c->idle_timeout_ms = conf->idle_timeout_ms;
+	c->read_timeout_ms = conf->read_timeout_ms;
+	c->write_timeout_ms = conf->write_timeout_ms;
+	c->out_high = conf->out_high;
+	c->out_low = (conf->out_low < conf->out_high) ? conf->out_low : conf->out_high / 2;
+	c->on_output_high = conf->on_output_high;
+	c->on_output_low = conf->on_output_low;
+	c->on_data = conf->on_data;
+	c->on_close = conf->on_close;
+	c->on_reload = conf->on_reload;
+	c->udata = conf->udata;
+	if (c->on_reload != NULL)
+		c->on_reload(s, &old);
+}
+
+// stop accepting new connections.
+// The memory of the connection objects and buffers is freed only if there are no active connections.
+static void kq_server_close(struct kq_server *s)
+{
+	kq_server_unlisten(s);
+	kq_timer_remove(s->loop, &s->drain_timer);
+
+	if (s->nconns == 0) {
+		kq_slab_close(&s->conns);
+		kq_slab_close(&s->segs);
+		kq_bufpool_close(&s->bufs);
+	}
+}
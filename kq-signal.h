@@ -0,0 +1,108 @@
+/* Kernel Queue The Complete Guide: kq-signal.h: UNIX signals as loop events
+A usual signal handler interrupts the program at any point, so it can't safely touch any of the loop's data.
+Instead, the signals are blocked, and the kernel keeps them pending until we read them from signalfd
+ which is attached to the loop like any other descriptor (see epoll-signal.c).
+Then the handlers are called by the loop just like the READ/WRITE handlers.
+
+All pending signals are read on each wakeup, several per read() call.
+Standard signals aren't queued: several SIGCHLD sent at once may arrive as one,
+ so e.g. SIGCHLD handler must reap all exited children with waitpid(WNOHANG).
+The signals must be blocked in all threads, otherwise the kernel delivers them to a thread which doesn't block them:
+ call kq_signals_block() before creating any threads - the new threads inherit the mask.
+*/
+#pragma once
+#include "kq.h"
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/signalfd.h>
+
+struct kq_signals;
+typedef void (*kq_signal_handler)(struct kq_signals *ss, const struct signalfd_siginfo *si);
+
+struct kq_signals {
+	struct context obj; // signalfd
+	sigset_t mask;
+	kq_signal_handler handlers[NSIG];
+	void *udata;
+	unsigned long long nsignals;
+};
+
+static void kq_signals_init(struct kq_signals *ss)
+{
+	memset(ss, 0, sizeof(*ss));
+	ss->obj.fd = -1;
+	sigemptyset(&ss->mask);
+}
+
+// set the handler which the loop calls when the signal is received
+static int kq_signals_on(struct kq_signals *ss, int sig, kq_signal_handler handler)
+{
+	if (sig <= 0 || sig >= NSIG) {
+		errno = EINVAL;
+		return -1;
+	}
+	ss->handlers[sig] = handler;
+	sigaddset(&ss->mask, sig);
+	return 0;
+}
+
+// block the signals in the current thread and in all threads it creates after this call
+static int kq_signals_block(struct kq_signals *ss)
+{
+	int e = pthread_sigmask(SIG_BLOCK, &ss->mask, NULL);
+	if (e != 0) {
+		errno = e;
+		return -1;
+	}
+	return 0;
+}
+
+static void kq_signals_read(struct context *obj)
+{
+	struct kq_signals *ss = (void*)((char*)obj - offsetof(struct kq_signals, obj));
+	for (;;) {
+		struct signalfd_siginfo si[16];
+		ssize_t r = read(obj->fd, si, sizeof(si));
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break; // EAGAIN: no more pending signals
+
+		for (unsigned i = 0;  i != r / sizeof(si[0]);  i++) {
+			ss->nsignals++;
+			unsigned sig = si[i].ssi_signo;
+			if (sig < NSIG && ss->handlers[sig] != NULL)
+				ss->handlers[sig](ss, &si[i]);
+		}
+		if ((size_t)r != sizeof(si))
+			break;
+	}
+}
+
+// start receiving the signals via the loop
+static int kq_signals_enable(struct kq_signals *ss, struct kq_loop *loop)
+{
+	if (0 != kq_signals_block(ss))
+		return -1;
+	ss->obj.fd = signalfd(-1, &ss->mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (ss->obj.fd == -1)
+		return -1;
+	ss->obj.rhandler = kq_signals_read;
+	if (0 != kq_attach_listener(loop, &ss->obj, 0)) {
+		close(ss->obj.fd);
+		ss->obj.fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+// the signals stay blocked
+static void kq_signals_close(struct kq_signals *ss)
+{
+	if (ss->obj.fd == -1)
+		return;
+	kq_detach(ss->obj.loop, &ss->obj);
+	close(ss->obj.fd);
+	ss->obj.fd = -1;
+}
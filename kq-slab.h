@@ -0,0 +1,116 @@
+/* Kernel Queue The Complete Guide: kq-slab.h: Slab allocator for the objects of one loop
+Allocating and freeing an object per connection with malloc() costs time on the accept path and fragments the heap.
+Instead, each loop keeps its objects in pages of equal slots:
+ allocation and freeing just take a slot from the free list and put it back.
+Slots are aligned to the cache line, so the objects used by different code never share a line.
+Not thread-safe: each loop has its own slab.
+
+The memory is never returned to malloc() until the slab is closed, and the allocator doesn't clear it:
+ the stale-events protection relies on the object's generation (see kq-context.h),
+ which must keep increasing when the same slot is reused for a new object.
+The first pointer-size bytes of a free slot are used for the free list.
+Objects are released to the slab by the loop after the current batch of events is processed (kq_retire()),
+ so a slot is never reused while KQ may still return events for its previous object.
+*/
+#pragma once
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+	KQ_CACHE_LINE = 64,
+};
+
+struct kq_slab_page {
+	struct kq_slab_page *next;
+	char data[] __attribute__((aligned(KQ_CACHE_LINE)));
+};
+
+struct kq_slab {
+	size_t size; // slot size
+	unsigned page_slots;
+	void *free; // free slots
+	struct kq_slab_page *pages;
+	unsigned nused, nfree;
+	unsigned npages;
+};
+
+// size: object size
+// page_slots: the number of slots allocated at once when there are no free slots
+static void kq_slab_init(struct kq_slab *s, size_t size, unsigned page_slots)
+{
+	if (size < sizeof(void*))
+		size = sizeof(void*);
+	s->size = (size + KQ_CACHE_LINE - 1) & ~(size_t)(KQ_CACHE_LINE - 1);
+	s->page_slots = (page_slots != 0) ? page_slots : 256;
+	s->free = NULL;
+	s->pages = NULL;
+	s->nused = s->nfree = 0;
+	s->npages = 0;
+}
+
+// allocate a new page and add its slots to the free list
+static int kq_slab_grow(struct kq_slab *s, unsigned n)
+{
+	size_t cap = sizeof(struct kq_slab_page) + n * s->size;
+	struct kq_slab_page *pg = aligned_alloc(KQ_CACHE_LINE, (cap + KQ_CACHE_LINE - 1) & ~(size_t)(KQ_CACHE_LINE - 1));
+	if (pg == NULL)
+		return -1;
+	memset(pg, 0, cap); // new objects start with generation 0
+	pg->next = s->pages;
+	s->pages = pg;
+	s->npages++;
+
+	// link the slots so they're allocated in the order of addresses
+	for (unsigned i = n;  i != 0;  i--) {
+		void *slot = pg->data + (i - 1) * s->size;
+		*(void**)slot = s->free;
+		s->free = slot;
+	}
+	s->nfree += n;
+	return 0;
+}
+
+// allocate in advance to avoid any malloc() calls in the processing loop
+static int kq_slab_reserve(struct kq_slab *s, unsigned n)
+{
+	if (n <= s->nfree)
+		return 0;
+	return kq_slab_grow(s, n - s->nfree);
+}
+
+// get a free slot.
+// The memory isn't cleared: the object's fields except the generation must be initialized by the caller.
+static inline void* kq_slab_alloc(struct kq_slab *s)
+{
+	if (s->free == NULL
+		&& 0 != kq_slab_grow(s, s->page_slots))
+		return NULL;
+	void *slot = s->free;
+	s->free = *(void**)slot;
+	s->nfree--;
+	s->nused++;
+	return slot;
+}
+
+static inline void kq_slab_free(struct kq_slab *s, void *slot)
+{
+	*(void**)slot = s->free;
+	s->free = slot;
+	s->nfree++;
+	s->nused--;
+}
+
+// free all pages; the objects which are still in use become invalid
+static void kq_slab_close(struct kq_slab *s)
+{
+	struct kq_slab_page *pg = s->pages;
+	while (pg != NULL) {
+		struct kq_slab_page *next = pg->next;
+		free(pg);
+		pg = next;
+	}
+	s->pages = NULL;
+	s->free = NULL;
+	s->nused = s->nfree = 0;
+	s->npages = 0;
+}
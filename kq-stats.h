@@ -0,0 +1,207 @@
+/* Kernel Queue The Complete Guide: kq-stats.h: Loop instrumentation
+To tell whether a slow response comes from the kernel, the loop or a handler,
+ the loop can record what it's doing (kq_stats_enable()):
+ the number of events received per wakeup,
+ the time blocked in the KQ waiting function and the time spent processing the events, tasks and timers,
+ the duration of each handler call, per handler function,
+ and how late the timers expire.
+Each loop records to its own structure: there are no atomics and no locks on the hot path.
+Other threads get a copy by posting a task to the loop (see kq_reactors_stats()).
+The cost is 2 clock_gettime() (vDSO) per handler call and per iteration;
+ with the statistics disabled - a NULL pointer check.
+*/
+#pragma once
+#include "kq-context.h"
+#include "kq-hist.h"
+#include "kq-timer.h"
+#include <stdio.h>
+
+enum {
+	KQ_STATS_HANDLERS = 8, // handler functions recorded separately; the others are recorded together
+};
+
+struct kq_stats_handler {
+	void (*fn)(struct context *obj);
+	const char *name; // NULL: print the address
+	struct kq_hist time_ns; // duration of each call
+};
+
+struct kq_stats {
+	unsigned long long start_us; // when the recording has started
+	unsigned long long nwakeups; // returns from the KQ waiting function
+	unsigned long long nidle; // wakeups without any events: timeouts and signals
+	struct kq_hist events; // events per wakeup
+	struct kq_hist wait_ns; // time blocked per wakeup
+	struct kq_hist run_ns; // time from a wakeup to the next wait: handlers, yielded objects, tasks, timers
+	struct kq_hist timer_late_ms; // how late the timers expire (1ms resolution)
+
+	unsigned nhandlers;
+	struct kq_stats_handler handlers[KQ_STATS_HANDLERS];
+	struct kq_stats_handler other; // the handlers which didn't fit
+
+	// the current iteration
+	unsigned long long t_wait, t_wake;
+};
+
+static void kq_stats_reset(struct kq_stats *st)
+{
+	st->start_us = kq_now_us();
+	st->nwakeups = st->nidle = 0;
+	kq_hist_reset(&st->events);
+	kq_hist_reset(&st->wait_ns);
+	kq_hist_reset(&st->run_ns);
+	kq_hist_reset(&st->timer_late_ms);
+	// the handler functions and their names stay
+	for (unsigned i = 0;  i != st->nhandlers;  i++) {
+		kq_hist_reset(&st->handlers[i].time_ns);
+	}
+	kq_hist_reset(&st->other.time_ns);
+	st->t_wait = st->t_wake = kq_now_ns();
+}
+
+static void kq_stats_init(struct kq_stats *st)
+{
+	st->nhandlers = 0;
+	st->other.fn = NULL;
+	st->other.name = "(other)";
+	kq_stats_reset(st);
+}
+
+static inline struct kq_stats_handler* kq_stats_handler(struct kq_stats *st, void (*fn)(struct context *obj))
+{
+	for (unsigned i = 0;  i != st->nhandlers;  i++) {
+		if (st->handlers[i].fn == fn)
+			return &st->handlers[i];
+	}
+	if (st->nhandlers == KQ_STATS_HANDLERS)
+		return &st->other;
+	struct kq_stats_handler *h = &st->handlers[st->nhandlers++];
+	h->fn = fn;
+	h->name = NULL;
+	kq_hist_reset(&h->time_ns);
+	return h;
+}
+
+// set the name under which the handler function is reported
+static void kq_stats_name(struct kq_stats *st, void (*fn)(struct context *obj), const char *name)
+{
+	struct kq_stats_handler *h = kq_stats_handler(st, fn);
+	if (h != &st->other)
+		h->name = name;
+}
+
+// call the handler and record its duration
+static inline void kq_stats_call(struct kq_stats *st, void (*fn)(struct context *obj), struct context *obj)
+{
+	unsigned long long t = kq_now_ns();
+	kq_obj_call(fn, obj);
+	kq_hist_add(&kq_stats_handler(st, fn)->time_ns, kq_now_ns() - t);
+}
+
+// kq_obj_handle() which records the duration of each handler call
+static inline void kq_stats_handle(struct kq_stats *st, void *ptr, int readable, int writable)
+{
+	if (st == NULL) {
+		kq_obj_handle(ptr, readable, writable);
+		return;
+	}
+
+	struct context *o = (void*)((size_t)ptr & ~(size_t)1);
+	unsigned flag = (size_t)ptr & 1;
+	if (flag != kq_obj_flag(o))
+		return;
+	if (readable && o->rhandler != NULL)
+		kq_stats_call(st, o->rhandler, o);
+	if (flag != kq_obj_flag(o))
+		return;
+	if (writable && o->whandler != NULL)
+		kq_stats_call(st, o->whandler, o);
+}
+
+// the loop is going to wait for events
+static inline void kq_stats_wait(struct kq_stats *st)
+{
+	if (st == NULL)
+		return;
+	st->t_wait = kq_now_ns();
+}
+
+// the KQ waiting function has returned `n` events; called by the backends before processing them
+static inline void kq_stats_woken(struct kq_stats *st, int n)
+{
+	if (st == NULL)
+		return;
+	st->t_wake = kq_now_ns();
+	unsigned long long t = st->t_wake - st->t_wait;
+	kq_hist_add(&st->wait_ns, t);
+	if (n <= 0) {
+		n = 0;
+		st->nidle++;
+	}
+	kq_hist_add(&st->events, n);
+	st->nwakeups++;
+}
+
+// the loop has processed everything it has received on this wakeup
+static inline void kq_stats_done(struct kq_stats *st)
+{
+	if (st == NULL)
+		return;
+	unsigned long long t = kq_now_ns() - st->t_wake;
+	kq_hist_add(&st->run_ns, t);
+}
+
+// add the statistics of another loop, e.g. to report all reactors together
+static void kq_stats_merge(struct kq_stats *dst, const struct kq_stats *src)
+{
+	if (dst->start_us > src->start_us)
+		dst->start_us = src->start_us;
+	dst->nwakeups += src->nwakeups;
+	dst->nidle += src->nidle;
+	kq_hist_merge(&dst->events, &src->events);
+	kq_hist_merge(&dst->wait_ns, &src->wait_ns);
+	kq_hist_merge(&dst->run_ns, &src->run_ns);
+	kq_hist_merge(&dst->timer_late_ms, &src->timer_late_ms);
+	for (unsigned i = 0;  i != src->nhandlers;  i++) {
+		const struct kq_stats_handler *sh = &src->handlers[i];
+		struct kq_stats_handler *h = kq_stats_handler(dst, sh->fn);
+		if (h->name == NULL)
+			h->name = sh->name;
+		kq_hist_merge(&h->time_ns, &sh->time_ns);
+	}
+	kq_hist_merge(&dst->other.time_ns, &src->other.time_ns);
+}
+
+static void kq_stats_print_hist(FILE *f, const char *name, const struct kq_hist *h, double div)
+{
+	fprintf(f, "%-24s %12llu %10.1f %10.1f %10.1f %10.1f %10.1f\n"
+		, name, h->count
+		, kq_hist_percentile(h, 50) / div, kq_hist_percentile(h, 90) / div
+		, kq_hist_percentile(h, 99) / div, kq_hist_percentile(h, 99.9) / div
+		, ((h->count != 0) ? h->max : 0) / div);
+}
+
+static void kq_stats_print(FILE *f, const struct kq_stats *st)
+{
+	unsigned long long blocked = st->wait_ns.sum, running = st->run_ns.sum, total = blocked + running;
+	fprintf(f, "wakeups: %llu (%llu without events), blocked: %.1f%%, running: %.1f%%\n"
+		, st->nwakeups, st->nidle
+		, (total != 0) ? blocked * 100.0 / total : 0.0
+		, (total != 0) ? running * 100.0 / total : 0.0);
+	fprintf(f, "%-24s %12s %10s %10s %10s %10s %10s\n", "", "count", "p50", "p90", "p99", "p99.9", "max");
+	kq_stats_print_hist(f, "events per wakeup", &st->events, 1);
+	kq_stats_print_hist(f, "blocked, usec", &st->wait_ns, 1000);
+	kq_stats_print_hist(f, "running, usec", &st->run_ns, 1000);
+	kq_stats_print_hist(f, "timers late, msec", &st->timer_late_ms, 1);
+	for (unsigned i = 0;  i != st->nhandlers;  i++) {
+		const struct kq_stats_handler *h = &st->handlers[i];
+		char name[64];
+		if (h->name != NULL)
+			snprintf(name, sizeof(name), "%s, usec", h->name);
+		else
+			snprintf(name, sizeof(name), "%p, usec", (void*)(size_t)h->fn);
+		kq_stats_print_hist(f, name, &h->time_ns, 1000);
+	}
+	if (st->other.time_ns.count != 0)
+		kq_stats_print_hist(f, "(other), usec", &st->other.time_ns, 1000);
+}
@@ -0,0 +1,227 @@
+/* Kernel Queue The Complete Guide: kq-timer.h: Hierarchical timer wheel
+One system timer per user timer (e.g. timerfd) costs a descriptor and syscalls for each arm/cancel.
+Instead, the loop keeps all its timers in a wheel and sleeps in the KQ waiting function
+ no longer than until the nearest expiration.
+Start, stop and restart are O(1) and don't need any syscalls.
+
+The wheel has 4 levels of 64 slots with 1ms resolution:
+ level 0 holds the timers expiring within 64ms, level 1 - within 64^2 ms, and so on.
+When the current time passes a level's slot boundary,
+ the timers from the higher level slot are redistributed to the lower levels (cascading).
+The non-empty slots are marked in a bitmap per level, so finding the nearest expiration is O(1) too.
+*/
+#pragma once
+#include "kq-hist.h"
+#include "kq-trace.h"
+#include <time.h>
+
+enum {
+	KQ_TIMER_LEVELS = 4,
+	KQ_TIMER_SLOT_BITS = 6,
+	KQ_TIMER_SLOTS = 1 << KQ_TIMER_SLOT_BITS,
+	KQ_TIMER_MASK = KQ_TIMER_SLOTS - 1,
+};
+
+struct kq_timer {
+	struct kq_timer *next, *prev; // NULL: not active
+	unsigned long long expire; // msec
+	void (*handler)(struct kq_timer *t);
+};
+
+struct kq_timer_wheel {
+	unsigned long long now; // msec: the timers until this time (inclusive) are processed
+	unsigned n; // active timers
+	unsigned long long bits[KQ_TIMER_LEVELS]; // non-empty slots
+	struct kq_timer slots[KQ_TIMER_LEVELS][KQ_TIMER_SLOTS]; // list heads
+	struct kq_hist *late; // record how late the timers expire, msec;  NULL: don't
+};
+
+// get monotonic time in msec (without a syscall thanks to vDSO)
+static inline unsigned long long kq_now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// get monotonic time in usec, e.g. to measure latency
+static inline unsigned long long kq_now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline unsigned long long kq_now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void kq_timer_wheel_init(struct kq_timer_wheel *w, unsigned long long now)
+{
+	w->now = now;
+	w->n = 0;
+	w->late = NULL;
+	for (unsigned l = 0;  l != KQ_TIMER_LEVELS;  l++) {
+		w->bits[l] = 0;
+		for (unsigned i = 0;  i != KQ_TIMER_SLOTS;  i++) {
+			struct kq_timer *head = &w->slots[l][i];
+			head->next = head->prev = head;
+		}
+	}
+}
+
+static inline int kq_timer_active(const struct kq_timer *t)
+{
+	return t->next != NULL;
+}
+
+static inline void kq_timer_link(struct kq_timer_wheel *w, struct kq_timer *t)
+{
+	unsigned long long delta = t->expire - w->now;
+	if ((long long)delta < 0)
+		delta = 0;
+
+	unsigned level = 0;
+	while (level != KQ_TIMER_LEVELS - 1
+		&& delta >= (1ULL << ((level + 1) * KQ_TIMER_SLOT_BITS)))
+		level++;
+
+	unsigned long long at = w->now + delta;
+	unsigned long long max = 1ULL << (KQ_TIMER_LEVELS * KQ_TIMER_SLOT_BITS);
+	if (delta >= max)
+		at = w->now + max - 1; // too far: it will be cascaded again
+	unsigned slot = (at >> (level * KQ_TIMER_SLOT_BITS)) & KQ_TIMER_MASK;
+
+	struct kq_timer *head = &w->slots[level][slot];
+	t->next = head;
+	t->prev = head->prev;
+	head->prev->next = t;
+	head->prev = t;
+	w->bits[level] |= 1ULL << slot;
+}
+
+static inline void kq_timer_unlink(struct kq_timer_wheel *w, struct kq_timer *t)
+{
+	struct kq_timer *next = t->next;
+	t->prev->next = next;
+	next->prev = t->prev;
+	t->next = t->prev = NULL;
+
+	if (next == next->prev && next >= &w->slots[0][0] && next < &w->slots[0][0] + KQ_TIMER_LEVELS * KQ_TIMER_SLOTS) {
+		// the slot is empty now
+		size_t i = next - &w->slots[0][0];
+		w->bits[i / KQ_TIMER_SLOTS] &= ~(1ULL << (i % KQ_TIMER_SLOTS));
+	}
+}
+
+// start the timer or restart it if it's already active
+static inline void kq_timer_start(struct kq_timer_wheel *w, struct kq_timer *t, unsigned interval_ms)
+{
+	if (kq_timer_active(t))
+		kq_timer_unlink(w, t);
+	else
+		w->n++;
+	// the wheel time isn't updated while the handlers are running, so get the current time
+	t->expire = kq_now_ms() + interval_ms;
+	if ((long long)(t->expire - w->now) <= 0)
+		t->expire = w->now + 1; // the current slot is already processed
+	kq_timer_link(w, t);
+}
+
+static inline void kq_timer_stop(struct kq_timer_wheel *w, struct kq_timer *t)
+{
+	if (!kq_timer_active(t))
+		return;
+	kq_timer_unlink(w, t);
+	w->n--;
+}
+
+// move the timers from the higher level slot to the lower levels
+static void kq_timer_cascade(struct kq_timer_wheel *w, unsigned level, unsigned slot)
+{
+	struct kq_timer *head = &w->slots[level][slot];
+	struct kq_timer *t = head->next;
+	head->next = head->prev = head;
+	w->bits[level] &= ~(1ULL << slot);
+	while (t != head) {
+		struct kq_timer *next = t->next;
+		kq_timer_link(w, t);
+		t = next;
+	}
+}
+
+// call handlers of the expired timers
+static void kq_timer_process(struct kq_timer_wheel *w, unsigned long long now)
+{
+	while ((long long)(now - w->now) > 0) {
+		if (w->n == 0) {
+			w->now = now;
+			return;
+		}
+
+		if (w->bits[0] == 0 && (w->now & KQ_TIMER_MASK) != KQ_TIMER_MASK) {
+			// level 0 is empty: skip to the end of its window
+			unsigned long long end = w->now | KQ_TIMER_MASK;
+			w->now = ((long long)(now - end) < 0) ? now : end;
+			continue;
+		}
+
+		w->now++;
+		unsigned slot = w->now & KQ_TIMER_MASK;
+		if (slot == 0) {
+			// entering the next window of level 0: refill it from the upper levels
+			for (unsigned l = 1;  l != KQ_TIMER_LEVELS;  l++) {
+				unsigned s = (w->now >> (l * KQ_TIMER_SLOT_BITS)) & KQ_TIMER_MASK;
+				kq_timer_cascade(w, l, s);
+				if (s != 0)
+					break;
+			}
+		}
+
+		struct kq_timer *head = &w->slots[0][slot];
+		while (head->next != head) {
+			struct kq_timer *t = head->next;
+			kq_timer_unlink(w, t);
+			w->n--;
+			unsigned long long late = ((long long)(now - t->expire) > 0) ? now - t->expire : 0;
+			if (w->late != NULL)
+				kq_hist_add(w->late, late);
+			KQ_PROBE3(timer, t, t->handler, late);
+			kq_trace_add_at(kq_trace_now(), KQ_TRACE_TIMER, t, -1, 0, (size_t)t->handler, late);
+			t->handler(t); // the handler may restart the timer
+		}
+	}
+}
+
+// get the number of msec until the nearest timer expiration; -1: no timers
+static int kq_timer_next(const struct kq_timer_wheel *w)
+{
+	if (w->n == 0)
+		return -1;
+
+	unsigned long long best = ~0ULL;
+	for (unsigned l = 0;  l != KQ_TIMER_LEVELS;  l++) {
+		unsigned long long bits = w->bits[l];
+		if (bits == 0)
+			continue;
+		unsigned shift = l * KQ_TIMER_SLOT_BITS;
+		unsigned cur = (w->now >> shift) & KQ_TIMER_MASK;
+		// find the first non-empty slot starting from the current one
+		unsigned long long rot = (bits >> cur) | ((cur != 0) ? bits << (KQ_TIMER_SLOTS - cur) : 0);
+		unsigned d = __builtin_ctzll(rot);
+		if (d == 0)
+			d = KQ_TIMER_SLOTS; // the current slot is already processed: it's the next round
+
+		// level 0: the expiration time;
+		//  upper levels: the time when the slot is cascaded to the lower levels
+		unsigned long long at = ((w->now >> shift) + d) << shift;
+		if (at < best)
+			best = at;
+	}
+
+	unsigned long long ms = best - w->now;
+	return (ms > 0x7fffffff) ? 0x7fffffff : (int)ms;
+}
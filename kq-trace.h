@@ -0,0 +1,368 @@
+/* Kernel Queue The Complete Guide: kq-trace.h: Static tracepoints and the per-thread trace ring
+Two ways to see what the loop is doing in production, without recompiling or attaching a debugger:
+
+USDT probes (provider "kq") at the key points: waiting for events, each handler call, accept, connect,
+ AIO submit/complete, timer expiration, close.
+Each probe is a single `nop` plus an ELF note (.note.stapsdt) which describes where its arguments are;
+ perf, bpftrace and SystemTap replace the `nop` with a breakpoint only while they trace:
+	$ bpftrace -e 'usdt:./epoll-server:kq:handler_return { @[arg1] = hist(arg2) }'
+	$ perf buildid-cache --add ./epoll-server && perf record -e sdt_kq:accept -p PID
+The notes are the same as those produced by <sys/sdt.h>, which is used if it's installed.
+
+The trace ring: the same events are also recorded into a per-thread ring buffer of fixed-size binary records,
+ which is enabled at runtime by the thread itself (kq_trace_enable()).
+Recording is a few stores and a clock_gettime() (vDSO) - no locks, no syscalls;
+ the thread's ring is found via a thread-local pointer, so any code running on the thread can record.
+kq_trace_dump() writes the last records of all threads to a file, e.g. on a signal,
+ and epoll-trace.c turns the dump into per-connection timelines.
+*/
+#pragma once
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/auxv.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__has_include) && __has_include(<sys/sdt.h>)
+	#include <sys/sdt.h>
+	#define KQ_PROBE0(name)  STAP_PROBE(kq, name)
+	#define KQ_PROBE1(name, a)  STAP_PROBE1(kq, name, a)
+	#define KQ_PROBE2(name, a, b)  STAP_PROBE2(kq, name, a, b)
+	#define KQ_PROBE3(name, a, b, c)  STAP_PROBE3(kq, name, a, b, c)
+
+#elif defined(__x86_64__) || defined(__aarch64__)
+	// The note format is the one described in "UserSpaceProbeImplementation" (SystemTap):
+	//  probe address, base address (to detect prelink), semaphore (none), provider, name, arguments.
+	// All arguments are passed as signed 64-bit values: "-8@LOCATION".
+	#define _KQ_SDT_NOTE(name, args) \
+		"990:	nop\n" \
+		"	.pushsection .note.stapsdt,\"?\",\"note\"\n" \
+		"	.balign 4\n" \
+		"	.4byte 992f-991f, 994f-993f, 3\n" \
+		"991:	.asciz \"stapsdt\"\n" \
+		"992:	.balign 4\n" \
+		"993:	.8byte 990b\n" \
+		"	.8byte _.stapsdt.base\n" \
+		"	.8byte 0\n" \
+		"	.asciz \"kq\"\n" \
+		"	.asciz \"" #name "\"\n" \
+		"	.asciz \"" args "\"\n" \
+		"994:	.balign 4\n" \
+		"	.popsection\n" \
+		"	.ifndef _.stapsdt.base\n" \
+		"	.pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+		"	.weak _.stapsdt.base\n" \
+		"	.hidden _.stapsdt.base\n" \
+		"_.stapsdt.base: .space 1\n" \
+		"	.size _.stapsdt.base, 1\n" \
+		"	.popsection\n" \
+		"	.endif\n"
+	#if defined(__x86_64__)
+		#define _KQ_SDT_ARG  "nor" // register, memory or constant ("$1")
+	#else
+		#define _KQ_SDT_ARG  "r" // register: the tools don't parse aarch64 constants
+	#endif
+	#define KQ_PROBE0(name) \
+		__asm__ __volatile__(_KQ_SDT_NOTE(name, ""))
+	#define KQ_PROBE1(name, a) \
+		__asm__ __volatile__(_KQ_SDT_NOTE(name, "-8@%0") \
+			:: _KQ_SDT_ARG((long long)(size_t)(a)))
+	#define KQ_PROBE2(name, a, b) \
+		__asm__ __volatile__(_KQ_SDT_NOTE(name, "-8@%0 -8@%1") \
+			:: _KQ_SDT_ARG((long long)(size_t)(a)), _KQ_SDT_ARG((long long)(size_t)(b)))
+	#define KQ_PROBE3(name, a, b, c) \
+		__asm__ __volatile__(_KQ_SDT_NOTE(name, "-8@%0 -8@%1 -8@%2") \
+			:: _KQ_SDT_ARG((long long)(size_t)(a)), _KQ_SDT_ARG((long long)(size_t)(b)), _KQ_SDT_ARG((long long)(size_t)(c)))
+
+#else
+	#define KQ_PROBE0(name)
+	#define KQ_PROBE1(name, a)
+	#define KQ_PROBE2(name, a, b)
+	#define KQ_PROBE3(name, a, b, c)
+#endif
+
+/* The probes:
+	wait_enter(timeout_ms)          the loop is going to wait for events
+	wait_exit(nevents)              the KQ waiting function has returned
+	handler(obj, fd, fn)            the loop is calling the object's handler
+	handler_return(obj, fn, ns)     the handler has returned after `ns` nanoseconds
+	accept(listener, conn, fd)      a new connection is accepted
+	connect(conn, fd, error)        asynchronous connect() has completed
+	close(obj, fd)                  the object's descriptor is closed by the loop
+	timer(t, fn, late_ms)           a timer has expired
+	aio_submit(aio, nsubmitted)     io_submit() has returned
+	aio_complete(req, result)       an AIO request has completed
+*/
+
+enum KQ_TRACE {
+	KQ_TRACE_WAIT = 1, // arg: timeout, msec
+	KQ_TRACE_WAKE, // arg: events
+	KQ_TRACE_HANDLER, // obj: context;  arg: handler function;  dur_ns
+	KQ_TRACE_ACCEPT, // obj: the new connection;  arg: the listener
+	KQ_TRACE_CONNECT, // obj: context;  arg: error
+	KQ_TRACE_CLOSE, // obj: context
+	KQ_TRACE_TIMER, // obj: timer;  arg: handler function;  dur_ns: how late, msec
+	KQ_TRACE_AIO_SUBMIT, // obj: AIO engine;  arg: requests submitted
+	KQ_TRACE_AIO_COMPLETE, // obj: request;  arg: result
+};
+
+// 40 bytes
+struct kq_trace_rec {
+	unsigned long long time_ns; // CLOCK_MONOTONIC; handler: when it was called
+	unsigned long long obj; // the object's address
+	unsigned long long arg;
+	unsigned dur_ns; // handler: how long it took (saturated)
+	int fd; // the object's descriptor
+	unsigned short type; // enum KQ_TRACE
+	unsigned short gen; // the object's generation: the same memory is reused for the next connection
+	unsigned pad;
+};
+
+struct kq_trace {
+	struct kq_trace_rec *recs;
+	unsigned mask; // number of records - 1
+	_Atomic unsigned long long pos; // the next record;  written only by the owner thread
+	int tid;
+	char name[16];
+	struct kq_trace *next;
+};
+
+// the rings of all threads, for the dump
+static struct kq_trace *kq_trace_list;
+static pthread_mutex_t kq_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the ring of the current thread;  NULL: not recording
+static __thread struct kq_trace *kq_trace_ring;
+
+static inline unsigned long long kq_trace_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline int kq_trace_on()
+{
+	return kq_trace_ring != NULL;
+}
+
+static inline void kq_trace_add_at(unsigned long long time_ns, unsigned type, const void *obj, int fd, unsigned gen, unsigned long long arg, unsigned long long dur_ns)
+{
+	struct kq_trace *t = kq_trace_ring;
+	if (t == NULL)
+		return;
+	unsigned long long pos = atomic_load_explicit(&t->pos, memory_order_relaxed);
+	// the position of the previous record must be visible before this one overwrites a slot:
+	//  otherwise the dump could copy the slot half-written and still take it for valid
+	atomic_thread_fence(memory_order_release);
+	struct kq_trace_rec *r = &t->recs[pos & t->mask];
+	r->time_ns = time_ns;
+	r->obj = (size_t)obj;
+	r->arg = arg;
+	r->dur_ns = (dur_ns < 0xffffffff) ? dur_ns : 0xffffffff;
+	r->fd = fd;
+	r->type = type;
+	r->gen = gen;
+	r->pad = 0;
+	// the dump checks the position before and after copying the ring to skip the overwritten records
+	atomic_store_explicit(&t->pos, pos + 1, memory_order_release);
+}
+
+static inline void kq_trace_add(unsigned type, const void *obj, int fd, unsigned gen, unsigned long long arg)
+{
+	if (kq_trace_ring == NULL)
+		return;
+	kq_trace_add_at(kq_trace_now(), type, obj, fd, gen, arg, 0);
+}
+
+// the loop is going to wait for events
+static inline void kq_trace_wait(int timeout_ms)
+{
+	KQ_PROBE1(wait_enter, timeout_ms);
+	kq_trace_add(KQ_TRACE_WAIT, NULL, -1, 0, timeout_ms);
+}
+
+// the KQ waiting function has returned
+static inline void kq_trace_wake(int nevents)
+{
+	KQ_PROBE1(wait_exit, nevents);
+	kq_trace_add(KQ_TRACE_WAKE, NULL, -1, 0, nevents);
+}
+
+// start recording the current thread's events into a ring of `nrecs` records (rounded up to a power of 2)
+static int kq_trace_enable(unsigned nrecs, const char *name)
+{
+	if (kq_trace_ring != NULL)
+		return 0;
+	unsigned n = 64;
+	while (n < nrecs)
+		n *= 2;
+	struct kq_trace *t = calloc(1, sizeof(struct kq_trace));
+	if (t == NULL)
+		return -1;
+	if (NULL == (t->recs = calloc(n, sizeof(struct kq_trace_rec)))) {
+		free(t);
+		return -1;
+	}
+	t->mask = n - 1;
+	atomic_init(&t->pos, 0);
+	t->tid = syscall(SYS_gettid);
+	if (name != NULL)
+		strncpy(t->name, name, sizeof(t->name) - 1);
+
+	pthread_mutex_lock(&kq_trace_lock);
+	t->next = kq_trace_list;
+	kq_trace_list = t;
+	pthread_mutex_unlock(&kq_trace_lock);
+	kq_trace_ring = t;
+	return 0;
+}
+
+// stop recording on the current thread;  its records won't be in the dumps anymore
+static void kq_trace_disable()
+{
+	struct kq_trace *t = kq_trace_ring;
+	if (t == NULL)
+		return;
+	kq_trace_ring = NULL;
+	pthread_mutex_lock(&kq_trace_lock);
+	for (struct kq_trace **p = &kq_trace_list;  *p != NULL;  p = &(*p)->next) {
+		if (*p == t) {
+			*p = t->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&kq_trace_lock);
+	free(t->recs);
+	free(t);
+}
+
+/* The dump file:
+	struct kq_trace_file
+	for each thread:
+		struct kq_trace_thread
+		struct kq_trace_rec [nrecs], the oldest first
+*/
+#define KQ_TRACE_MAGIC  "KQTRACE1"
+
+struct kq_trace_file {
+	char magic[8];
+	unsigned nthreads;
+	unsigned rec_size;
+	unsigned long long load_bias; // the address at which the executable is loaded (PIE): subtract it to resolve the handlers
+	char exe[256];
+};
+
+struct kq_trace_thread {
+	int tid;
+	unsigned nrecs;
+	char name[16];
+};
+
+// the difference between the run-time and the link-time addresses of the executable
+static unsigned long long kq_trace_load_bias()
+{
+#if defined(__LP64__)
+	const Elf64_Phdr *ph = (void*)getauxval(AT_PHDR);
+#else
+	const Elf32_Phdr *ph = (void*)getauxval(AT_PHDR);
+#endif
+	size_t n = getauxval(AT_PHNUM);
+	for (size_t i = 0;  ph != NULL && i != n;  i++) {
+		if (ph[i].p_type == PT_PHDR)
+			return (size_t)ph - ph[i].p_vaddr;
+	}
+	return 0; // static executable which isn't position-independent
+}
+
+static int kq_trace_write(int fd, const void *data, size_t len)
+{
+	for (size_t off = 0;  off != len;  ) {
+		ssize_t r = write(fd, (char*)data + off, len - off);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		off += r;
+	}
+	return 0;
+}
+
+// write the last records of all threads to a file.
+// The threads continue recording meanwhile: the records overwritten while copying are skipped.
+static int kq_trace_dump(const char *path)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return -1;
+
+	int rc = -1;
+	struct kq_trace_rec *copy = NULL;
+	size_t copy_cap = 0;
+	pthread_mutex_lock(&kq_trace_lock);
+
+	struct kq_trace_file hdr = {};
+	memcpy(hdr.magic, KQ_TRACE_MAGIC, 8);
+	for (struct kq_trace *t = kq_trace_list;  t != NULL;  t = t->next) {
+		hdr.nthreads++;
+	}
+	hdr.rec_size = sizeof(struct kq_trace_rec);
+	hdr.load_bias = kq_trace_load_bias();
+	ssize_t n = readlink("/proc/self/exe", hdr.exe, sizeof(hdr.exe) - 1);
+	if (n > 0)
+		hdr.exe[n] = '\0';
+	if (0 != kq_trace_write(fd, &hdr, sizeof(hdr)))
+		goto end;
+
+	for (struct kq_trace *t = kq_trace_list;  t != NULL;  t = t->next) {
+		size_t size = t->mask + 1;
+		if (copy_cap < size) {
+			free(copy);
+			if (NULL == (copy = malloc(size * sizeof(struct kq_trace_rec))))
+				goto end;
+			copy_cap = size;
+		}
+		unsigned long long pos1 = atomic_load_explicit(&t->pos, memory_order_acquire);
+		memcpy(copy, t->recs, size * sizeof(struct kq_trace_rec));
+		// sequence lock reader: the copy must be complete before the position is read again
+		atomic_thread_fence(memory_order_acquire);
+		unsigned long long pos2 = atomic_load_explicit(&t->pos, memory_order_relaxed);
+
+		// valid: written before pos1, and neither overwritten nor being written after pos2
+		unsigned long long first = (pos1 > size) ? pos1 - size : 0;
+		if (pos2 >= size && first <= pos2 - size)
+			first = pos2 - size + 1;
+		if (first > pos1)
+			first = pos1;
+
+		struct kq_trace_thread th = {};
+		th.tid = t->tid;
+		th.nrecs = pos1 - first;
+		memcpy(th.name, t->name, sizeof(th.name));
+		if (0 != kq_trace_write(fd, &th, sizeof(th)))
+			goto end;
+		// the ring wraps around: write the older part first
+		size_t i = first & t->mask, j = pos1 & t->mask;
+		if (th.nrecs != 0 && i >= j) {
+			if (0 != kq_trace_write(fd, copy + i, (size - i) * sizeof(struct kq_trace_rec)))
+				goto end;
+			i = 0;
+		}
+		if (0 != kq_trace_write(fd, copy + i, (j - i) * sizeof(struct kq_trace_rec)))
+			goto end;
+	}
+	rc = 0;
+
+end:
+	pthread_mutex_unlock(&kq_trace_lock);
+	free(copy);
+	if (0 != close(fd))
+		rc = -1;
+	return rc;
+}
@@ -0,0 +1,407 @@
+/* Kernel Queue The Complete Guide: kq-udp.h: UDP sockets with batched I/O
+With small datagrams the cost is per packet, not per byte: one recvfrom()/sendto() per datagram
+ limits a thread to about a million packets per second even on loopback.
+Here every system call moves many packets:
+ recvmmsg() receives a batch of datagrams, sendmmsg() sends all queued datagrams at once,
+ UDP_GRO lets the kernel coalesce the datagrams of one flow into one large buffer
+ (received as one message, then split by the segment size from the control message),
+ and UDP_SEGMENT (GSO) sends consecutive same-size datagrams to one destination as one message
+ which the kernel or the NIC splits.
+The socket is edge-triggered: the READ handler receives until the socket is empty,
+ but no more than `read_budget` datagrams - then it yields to the other objects.
+The datagrams queued by on_datagram() are sent with one sendmmsg() after the received batch is processed;
+ the datagrams queued by other handlers - after the current events are processed (kq_yield()).
+If the socket's send buffer is full, the queue waits for the WRITE event (whandler is set only meanwhile);
+ when the queue is full too, kq_udp_send() fails with EAGAIN: the caller decides whether to drop the datagram.
+SO_REUSEPORT: several sockets, each on its own loop (thread), bind to the same port,
+ and the kernel distributes the flows between them by the hash of the addresses.
+IPv4 only.  See epoll-udp.c.
+*/
+#pragma once
+#include "kq.h"
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#ifndef UDP_SEGMENT
+	#define UDP_SEGMENT  103
+#endif
+#ifndef UDP_GRO
+	#define UDP_GRO  104
+#endif
+
+enum {
+	KQ_UDP_DGRAM_MAX = 65507, // max. IPv4 UDP payload
+	KQ_UDP_GSO_SEGS_MAX = 64, // the kernel's UDP_MAX_SEGMENTS
+	KQ_UDP_GRO_BUFSIZE = 65536, // a coalesced message may be this large
+	KQ_UDP_CTL_SIZE = 64, // control messages per datagram: GRO/GSO segment size
+};
+
+struct kq_udp;
+
+struct kq_udp_conf {
+	unsigned short port; // bind to this port on all addresses;  0: any port (e.g. for a client)
+	unsigned reuseport :1; // SO_REUSEPORT: a socket per thread on the same port
+	unsigned gro :1; // receive coalesced datagrams (UDP_GRO), if the kernel supports it
+	unsigned gso :1; // send coalesced datagrams (UDP_SEGMENT), if the kernel supports it
+	unsigned batch; // datagrams per recvmmsg() and messages per sendmmsg() call;  0: default
+	size_t rx_bufsize; // buffer per received message;  0: default (2K, or 64K with GRO)
+	size_t tx_bufsize; // bytes queued for sending;  0: default
+	unsigned read_budget; // max. datagrams received per handler call;  0: default
+	int rcvbuf, sndbuf; // SO_RCVBUF, SO_SNDBUF;  0: system default
+
+	// called for each received datagram (a GRO message is split into the original datagrams).
+	// The data is valid only during the call.
+	void (*on_datagram)(struct kq_udp *u, const char *data, size_t len, const struct sockaddr *from, socklen_t from_len);
+	void *udata;
+};
+
+struct kq_udp {
+	struct context obj; // must be the first member
+	struct kq_udp_conf conf;
+	struct kq_loop *loop;
+
+	// receiving: `batch` messages, each with its own buffer, address and control data
+	struct mmsghdr *rx_msgs;
+	struct iovec *rx_iov;
+	struct sockaddr_storage *rx_addrs;
+	char *rx_ctl, *rx_buf;
+
+	// sending: the datagrams are copied to tx_buf one after another
+	struct mmsghdr *tx_msgs;
+	struct iovec *tx_iov;
+	struct sockaddr_storage *tx_addrs;
+	char *tx_ctl, *tx_buf;
+	unsigned short *tx_nsegs; // datagrams in each message
+	unsigned tx_n; // queued messages
+	unsigned tx_first; // the first message which isn't sent yet
+	size_t tx_used;
+	size_t tx_seg_size; // the last message: size of its datagrams;  0: it can't be extended
+	unsigned reading :1; // inside READ handler: the datagrams are sent when it finishes
+	unsigned blocked :1; // the send buffer is full: waiting for the WRITE event
+	unsigned gro :1, gso :1; // enabled and supported by the kernel
+
+	unsigned long long nrecv_calls, nrecv_msgs, nrecv_datagrams;
+	unsigned long long nsend_calls, nsend_msgs, nsend_datagrams;
+	unsigned long long ntruncated; // received datagrams larger than the buffer
+	unsigned long long nsend_errors; // the messages which the kernel refused to send
+};
+
+static void kq_udp_write(struct context *obj);
+static int kq_udp_flush(struct kq_udp *u);
+
+// the segment size of a coalesced message;  0: not coalesced
+static inline size_t kq_udp_gro_size(struct msghdr *m)
+{
+	for (struct cmsghdr *cm = CMSG_FIRSTHDR(m);  cm != NULL;  cm = CMSG_NXTHDR(m, cm)) {
+		if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+			int size;
+			memcpy(&size, CMSG_DATA(cm), sizeof(size));
+			return size;
+		}
+	}
+	return 0;
+}
+
+static void kq_udp_read(struct context *obj)
+{
+	struct kq_udp *u = (struct kq_udp*)obj;
+	unsigned batch = u->conf.batch, ndgrams = 0;
+	u->reading = 1;
+	for (;;) {
+		if (ndgrams >= u->conf.read_budget) {
+			// there may be more data: continue after the other objects have been processed
+			kq_yield(u->loop, &u->obj, KQ_READY_R);
+			break;
+		}
+
+		// the kernel overwrites the lengths
+		for (unsigned i = 0;  i != batch;  i++) {
+			u->rx_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+			u->rx_msgs[i].msg_hdr.msg_controllen = KQ_UDP_CTL_SIZE;
+		}
+		int r = recvmmsg(u->obj.fd, u->rx_msgs, batch, 0, NULL);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			break; // EAGAIN: the socket is empty
+		}
+		u->nrecv_calls++;
+		u->nrecv_msgs += r;
+
+		for (int i = 0;  i != r;  i++) {
+			struct msghdr *m = &u->rx_msgs[i].msg_hdr;
+			if (m->msg_flags & MSG_TRUNC) {
+				u->ntruncated++;
+				continue;
+			}
+			const char *data = u->rx_iov[i].iov_base;
+			size_t len = u->rx_msgs[i].msg_len;
+			size_t seg = (u->gro) ? kq_udp_gro_size(m) : 0;
+			if (seg == 0)
+				seg = (len != 0) ? len : 1; // an empty datagram is a datagram too
+			size_t off = 0;
+			do {
+				size_t n = (len - off < seg) ? len - off : seg;
+				u->conf.on_datagram(u, data + off, n, m->msg_name, m->msg_namelen);
+				u->nrecv_datagrams++;
+				ndgrams++;
+				off += n;
+			} while (off < len && u->obj.fd != -1);
+			if (u->obj.fd == -1)
+				return; // closed by the user
+		}
+
+		// recvmmsg() doesn't fill the whole batch only if the socket is empty:
+		//  the next datagram will signal again, so don't waste a call on EAGAIN
+		if ((unsigned)r != batch)
+			break;
+	}
+	u->reading = 0;
+	if (u->tx_n != 0 && !u->blocked)
+		kq_udp_flush(u); // send all replies at once
+}
+
+// send all queued messages
+static int kq_udp_flush(struct kq_udp *u)
+{
+	while (u->tx_first != u->tx_n) {
+		int r = sendmmsg(u->obj.fd, &u->tx_msgs[u->tx_first], u->tx_n - u->tx_first, 0);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				u->blocked = 1;
+				u->obj.whandler = kq_udp_write; // continue when the kernel signals
+				return 0;
+			}
+			// e.g. ENOBUFS, EMSGSIZE, EIO (the device can't do GSO): the first message is dropped
+			u->nsend_errors++;
+			u->tx_first++;
+			continue;
+		}
+		u->nsend_calls++;
+		u->nsend_msgs += r;
+		for (int i = 0;  i != r;  i++) {
+			u->nsend_datagrams += u->tx_nsegs[u->tx_first + i];
+		}
+		u->tx_first += r;
+	}
+	u->tx_first = u->tx_n = 0;
+	u->tx_used = 0;
+	u->tx_seg_size = 0;
+	u->blocked = 0;
+	u->obj.whandler = NULL; // we don't want any more signals from KQ
+	return 0;
+}
+
+static void kq_udp_write(struct context *obj)
+{
+	struct kq_udp *u = (struct kq_udp*)obj;
+	if (u->tx_n != 0 && !u->reading)
+		kq_udp_flush(u);
+}
+
+// queue the datagram for sending.
+// Return 0;  -1: EAGAIN (the queue is full and the socket's send buffer is full too), EMSGSIZE
+static int kq_udp_send(struct kq_udp *u, const void *data, size_t len, const struct sockaddr *to, socklen_t to_len)
+{
+	if (len > KQ_UDP_DGRAM_MAX || to_len > sizeof(struct sockaddr_storage)) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	if (u->tx_seg_size != 0 && len <= u->tx_seg_size && u->tx_used + len <= u->conf.tx_bufsize) {
+		// append to the last message: the same destination and the same size
+		//  (only the last datagram of a message may be shorter)
+		unsigned i = u->tx_n - 1;
+		struct msghdr *m = &u->tx_msgs[i].msg_hdr;
+		if (m->msg_namelen == to_len && !memcmp(m->msg_name, to, to_len)
+			&& u->tx_nsegs[i] != KQ_UDP_GSO_SEGS_MAX
+			&& u->tx_iov[i].iov_len + len <= KQ_UDP_DGRAM_MAX) {
+
+			if (u->tx_nsegs[i] == 1) {
+				m->msg_control = u->tx_ctl + i * KQ_UDP_CTL_SIZE;
+				m->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+				struct cmsghdr *cm = CMSG_FIRSTHDR(m);
+				cm->cmsg_level = SOL_UDP;
+				cm->cmsg_type = UDP_SEGMENT;
+				cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+				uint16_t seg = u->tx_seg_size;
+				memcpy(CMSG_DATA(cm), &seg, sizeof(seg));
+			}
+			memcpy(u->tx_buf + u->tx_used, data, len);
+			u->tx_used += len;
+			u->tx_iov[i].iov_len += len;
+			u->tx_nsegs[i]++;
+			if (len != u->tx_seg_size)
+				u->tx_seg_size = 0;
+			return 0;
+		}
+	}
+
+	if (u->tx_n == u->conf.batch || u->tx_used + len > u->conf.tx_bufsize) {
+		if (u->blocked || 0 != kq_udp_flush(u) || u->tx_n != 0) {
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+
+	unsigned i = u->tx_n++;
+	struct msghdr *m = &u->tx_msgs[i].msg_hdr;
+	memcpy(&u->tx_addrs[i], to, to_len);
+	m->msg_name = &u->tx_addrs[i];
+	m->msg_namelen = to_len;
+	m->msg_iov = &u->tx_iov[i];
+	m->msg_iovlen = 1;
+	m->msg_control = NULL;
+	m->msg_controllen = 0;
+	u->tx_iov[i].iov_base = u->tx_buf + u->tx_used;
+	u->tx_iov[i].iov_len = len;
+	u->tx_nsegs[i] = 1;
+	memcpy(u->tx_buf + u->tx_used, data, len);
+	u->tx_used += len;
+	u->tx_seg_size = (u->gso && len != 0) ? len : 0;
+
+	if (!u->reading && !u->blocked) {
+		// send together with the datagrams which are queued during this iteration
+		u->obj.whandler = kq_udp_write;
+		kq_yield(u->loop, &u->obj, KQ_READY_W);
+	}
+	return 0;
+}
+
+static int kq_udp_socket(struct kq_udp *u)
+{
+	int sk = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sk == -1)
+		return -1;
+	int val = 1;
+	if (u->conf.reuseport
+		&& 0 != setsockopt(sk, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)))
+		goto err;
+	if (u->conf.rcvbuf != 0)
+		setsockopt(sk, SOL_SOCKET, SO_RCVBUF, &u->conf.rcvbuf, sizeof(int));
+	if (u->conf.sndbuf != 0)
+		setsockopt(sk, SOL_SOCKET, SO_SNDBUF, &u->conf.sndbuf, sizeof(int));
+
+	// the kernel may not support them: then we just send and receive one datagram per message
+	u->gro = (u->conf.gro && 0 == setsockopt(sk, SOL_UDP, UDP_GRO, &val, sizeof(val)));
+	val = 0; // no segmentation by default: UDP_SEGMENT is set per message
+	u->gso = (u->conf.gso && 0 == setsockopt(sk, SOL_UDP, UDP_SEGMENT, &val, sizeof(val)));
+
+	struct sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(u->conf.port);
+	if (0 != bind(sk, (struct sockaddr*)&addr, sizeof(addr)))
+		goto err;
+	return sk;
+
+err:
+	close(sk);
+	return -1;
+}
+
+static void kq_udp_close(struct kq_udp *u);
+
+// create the socket, bind it and attach to the loop
+static int kq_udp_open(struct kq_udp *u, struct kq_loop *loop, const struct kq_udp_conf *conf)
+{
+	memset(u, 0, sizeof(*u));
+	u->obj.fd = -1;
+	u->loop = loop;
+	u->conf = *conf;
+	if (u->conf.batch == 0)
+		u->conf.batch = 64;
+	if (u->conf.read_budget == 0)
+		u->conf.read_budget = 4096;
+	if (u->conf.tx_bufsize < KQ_UDP_DGRAM_MAX)
+		u->conf.tx_bufsize = 256*1024;
+
+	if (-1 == (u->obj.fd = kq_udp_socket(u)))
+		return -1;
+	if (u->conf.rx_bufsize == 0)
+		u->conf.rx_bufsize = (u->gro) ? KQ_UDP_GRO_BUFSIZE : 2048;
+
+	unsigned n = u->conf.batch;
+	u->rx_msgs = calloc(n, sizeof(struct mmsghdr));
+	u->rx_iov = calloc(n, sizeof(struct iovec));
+	u->rx_addrs = calloc(n, sizeof(struct sockaddr_storage));
+	u->rx_ctl = calloc(n, KQ_UDP_CTL_SIZE);
+	u->rx_buf = malloc(n * u->conf.rx_bufsize);
+	u->tx_msgs = calloc(n, sizeof(struct mmsghdr));
+	u->tx_iov = calloc(n, sizeof(struct iovec));
+	u->tx_addrs = calloc(n, sizeof(struct sockaddr_storage));
+	u->tx_ctl = calloc(n, KQ_UDP_CTL_SIZE);
+	u->tx_nsegs = calloc(n, sizeof(unsigned short));
+	u->tx_buf = malloc(u->conf.tx_bufsize);
+	if (u->rx_msgs == NULL || u->rx_iov == NULL || u->rx_addrs == NULL || u->rx_ctl == NULL || u->rx_buf == NULL
+		|| u->tx_msgs == NULL || u->tx_iov == NULL || u->tx_addrs == NULL || u->tx_ctl == NULL
+		|| u->tx_nsegs == NULL || u->tx_buf == NULL)
+		goto err;
+
+	for (unsigned i = 0;  i != n;  i++) {
+		u->rx_iov[i].iov_base = u->rx_buf + i * u->conf.rx_bufsize;
+		u->rx_iov[i].iov_len = u->conf.rx_bufsize;
+		struct msghdr *m = &u->rx_msgs[i].msg_hdr;
+		m->msg_name = &u->rx_addrs[i];
+		m->msg_iov = &u->rx_iov[i];
+		m->msg_iovlen = 1;
+		m->msg_control = u->rx_ctl + i * KQ_UDP_CTL_SIZE;
+	}
+
+	u->obj.rhandler = kq_udp_read;
+	if (0 != kq_attach(loop, &u->obj))
+		goto err;
+	return 0;
+
+err:
+	kq_udp_close(u);
+	return -1;
+}
+
+// the local port, e.g. after binding to any port
+static unsigned short kq_udp_port(const struct kq_udp *u)
+{
+	struct sockaddr_in addr = {};
+	socklen_t len = sizeof(addr);
+	if (0 != getsockname(u->obj.fd, (struct sockaddr*)&addr, &len))
+		return 0;
+	return ntohs(addr.sin_port);
+}
+
+// close the socket and free the memory.
+// Call it after the loop has stopped: the queued datagrams are discarded.
+static void kq_udp_close(struct kq_udp *u)
+{
+	if (u->obj.fd != -1) {
+		kq_detach(u->loop, &u->obj);
+		close(u->obj.fd);
+		u->obj.fd = -1;
+	}
+	free(u->rx_msgs);
+	free(u->rx_iov);
+	free(u->rx_addrs);
+	free(u->rx_ctl);
+	free(u->rx_buf);
+	free(u->tx_msgs);
+	free(u->tx_iov);
+	free(u->tx_addrs);
+	free(u->tx_ctl);
+	free(u->tx_nsegs);
+	free(u->tx_buf);
+	u->rx_msgs = NULL;
+	u->rx_iov = NULL;
+	u->rx_addrs = NULL;
+	u->rx_ctl = NULL;
+	u->rx_buf = NULL;
+	u->tx_msgs = NULL;
+	u->tx_iov = NULL;
+	u->tx_addrs = NULL;
+	u->tx_ctl = NULL;
+	u->tx_nsegs = NULL;
+	u->tx_buf = NULL;
+}
@@ -0,0 +1,625 @@
+/* Kernel Queue The Complete Guide: kq-uring.h: Completion-based event loop with io_uring
+Like IOCP, io_uring notifies us when an operation has been completed, not when we can start it.
+We put operation requests (SQE) into the submission ring, and the kernel puts results (CQE) into the completion ring.
+Both rings are shared memory, so one io_uring_enter() call submits all queued requests
+ and waits for the completions at the same time.
+
+The handler model is the same as with epoll: each `struct context` has READ and WRITE handlers.
+Each operation is associated with one of them, and its result is stored in `struct context.result`
+ before the handler is called.
+User data for each request is the object pointer with the safety flag (bit 0) and the handler type (bit 1).
+
+As a backend for kq.h, io_uring works in readiness mode:
+ a multishot poll request (edge-triggered by default) is submitted for each attached descriptor,
+ and its completions call the handlers just like epoll events do (bit 2 in user data).
+
+Multishot accept and multishot recv produce many completions from one request
+ while the kernel sets IORING_CQE_F_MORE flag.
+Multishot recv requires the kernel to select the buffer itself from a provided buffer ring.
+*/
+#pragma once
+#include "kq-context.h"
+#include "kq-bufpool.h"
+#include "kq-stats.h"
+#include <poll.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+// GLIBC doesn't have wrappers for these syscalls, so we make our own wrappers
+static inline int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(SYS_io_uring_setup, entries, p);
+}
+static inline int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(SYS_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+static inline int io_uring_enter2(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz)
+{
+	return syscall(SYS_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+static inline int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return syscall(SYS_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+enum KQ_URING_DIR {
+	KQ_URING_R = 0, // complete the operation via rhandler()
+	KQ_URING_W = 2, // complete the operation via whandler()
+	KQ_URING_POLL = 4, // readiness event for rhandler() and whandler()
+};
+
+struct kq_uring {
+	int fd;
+	unsigned features;
+	int quit;
+
+	// submission queue
+	unsigned *sq_head, *sq_tail, *sq_array;
+	unsigned sq_mask, sq_entries;
+	struct io_uring_sqe *sqes;
+	unsigned to_submit; // SQEs prepared since the last io_uring_enter()
+
+	// completion queue
+	unsigned *cq_head, *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+
+	// objects which were closed but still have operations in flight
+	struct context *retired;
+};
+
+// entries: size of the submission queue
+// flags: IORING_SETUP_*
+static int kq_uring_create_flags(struct kq_uring *u, unsigned entries, unsigned flags)
+{
+	memset(u, 0, sizeof(*u));
+	struct io_uring_params p = {};
+	p.flags = flags;
+	u->fd = io_uring_setup(entries, &p);
+	if (u->fd < 0 && errno == EINVAL) {
+		// old kernel
+		memset(&p, 0, sizeof(p));
+		u->fd = io_uring_setup(entries, &p);
+	}
+	if (u->fd < 0)
+		return -1;
+	u->features = p.features;
+
+	u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (u->features & IORING_FEAT_SINGLE_MMAP) {
+		// both rings are mapped with one mmap()
+		if (u->cq_ring_size > u->sq_ring_size)
+			u->sq_ring_size = u->cq_ring_size;
+		u->cq_ring_size = u->sq_ring_size;
+	}
+
+	u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED)
+		goto err;
+	u->cq_ring = u->sq_ring;
+	if (!(u->features & IORING_FEAT_SINGLE_MMAP)) {
+		u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED)
+			goto err;
+	}
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto err;
+
+	char *sq = u->sq_ring, *cq = u->cq_ring;
+	u->sq_head = (unsigned*)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+	u->sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	u->sq_array = (unsigned*)(sq + p.sq_off.array);
+	for (unsigned i = 0;  i != p.sq_entries;  i++) {
+		u->sq_array[i] = i; // SQ ring slot N always points to SQE N
+	}
+	u->cq_head = (unsigned*)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+	u->cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+	return 0;
+
+err:
+	if (u->sqes != NULL && u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqes_size);
+	if (u->cq_ring != NULL && u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_size);
+	if (u->sq_ring != NULL && u->sq_ring != MAP_FAILED)
+		munmap(u->sq_ring, u->sq_ring_size);
+	close(u->fd);
+	u->fd = -1;
+	return -1;
+}
+
+// entries: size of the submission queue
+static int kq_uring_create(struct kq_uring *u, unsigned entries)
+{
+	// only this thread submits requests, and the completion work is done when we call io_uring_enter()
+	return kq_uring_create_flags(u, entries, IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN);
+}
+
+static void kq_uring_close(struct kq_uring *u)
+{
+	munmap(u->sqes, u->sqes_size);
+	if (u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_size);
+	munmap(u->sq_ring, u->sq_ring_size);
+	close(u->fd);
+	u->fd = -1;
+}
+
+// submit all queued requests without waiting for completions
+static int kq_uring_submit(struct kq_uring *u)
+{
+	while (u->to_submit != 0) {
+		int r = io_uring_enter(u->fd, u->to_submit, 0, 0);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		u->to_submit -= r;
+	}
+	return 0;
+}
+
+// get a free SQE associated with the object's handler
+static struct io_uring_sqe* kq_uring_sqe(struct kq_uring *u, struct context *obj, enum KQ_URING_DIR dir)
+{
+	unsigned tail = *u->sq_tail;
+	if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->sq_entries) {
+		// submission queue is full: pass the queued requests to the kernel right now
+		if (0 != kq_uring_submit(u))
+			return NULL;
+	}
+
+	struct io_uring_sqe *sqe = &u->sqes[tail & u->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	if (obj != NULL) {
+		sqe->user_data = (size_t)obj | kq_obj_flag(obj) | dir;
+		obj->inflight++;
+	}
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->to_submit++;
+	return sqe;
+}
+
+// begin accepting connections: rhandler() is called with the new socket descriptor
+//  for each accepted connection
+static int kq_uring_accept(struct kq_uring *u, struct context *obj, int multishot)
+{
+	struct io_uring_sqe *sqe = kq_uring_sqe(u, obj, KQ_URING_R);
+	if (sqe == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = obj->fd;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	if (multishot)
+		sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+	return 0;
+}
+
+// begin connecting: whandler() is called with the result.
+// `addr` must stay valid until the request is submitted.
+static int kq_uring_connect(struct kq_uring *u, struct context *obj, const struct sockaddr *addr, socklen_t addr_len)
+{
+	struct io_uring_sqe *sqe = kq_uring_sqe(u, obj, KQ_URING_W);
+	if (sqe == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_CONNECT;
+	sqe->fd = obj->fd;
+	sqe->addr = (size_t)addr;
+	sqe->off = addr_len;
+	return 0;
+}
+
+// begin receiving data into the user buffer: rhandler() is called with the number of bytes received
+static int kq_uring_recv(struct kq_uring *u, struct context *obj, void *buf, size_t len)
+{
+	struct io_uring_sqe *sqe = kq_uring_sqe(u, obj, KQ_URING_R);
+	if (sqe == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = obj->fd;
+	sqe->addr = (size_t)buf;
+	sqe->len = len;
+	return 0;
+}
+
+// begin receiving data continuously into the buffers selected by the kernel from the buffer group:
+//  rhandler() is called for each received chunk.
+// Use kq_uring_buf() to get the buffer.
+static int kq_uring_recv_multishot(struct kq_uring *u, struct context *obj, unsigned short buf_group)
+{
+	struct io_uring_sqe *sqe = kq_uring_sqe(u, obj, KQ_URING_R);
+	if (sqe == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = obj->fd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = buf_group;
+	sqe->ioprio |= IORING_RECV_MULTISHOT;
+	return 0;
+}
+
+// begin sending data: whandler() is called with the number of bytes sent.
+// `buf` must stay valid until the operation is complete.
+static int kq_uring_send(struct kq_uring *u, struct context *obj, const void *buf, size_t len)
+{
+	struct io_uring_sqe *sqe = kq_uring_sqe(u, obj, KQ_URING_W);
+	if (sqe == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = obj->fd;
+	sqe->addr = (size_t)buf;
+	sqe->len = len;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	return 0;
+}
+
+// begin reading file data at the specified offset: rhandler() is called with the number of bytes read
+static int kq_uring_read(struct kq_uring *u, struct context *obj, void *buf, size_t len, unsigned long long off)
+{
+	struct io_uring_sqe *sqe = kq_uring_sqe(u, obj, KQ_URING_R);
+	if (sqe == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = obj->fd;
+	sqe->addr = (size_t)buf;
+	sqe->len = len;
+	sqe->off = off;
+	return 0;
+}
+
+// advise the kernel about the expected access to the file data (POSIX_FADV_*) without blocking the caller.
+// The request doesn't produce any events.
+static int kq_uring_fadvise(struct kq_uring *u, int fd, unsigned long long off, unsigned len, int advice)
+{
+	struct io_uring_sqe *sqe = kq_uring_sqe(u, NULL, 0);
+	if (sqe == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_FADVISE;
+	sqe->fd = fd;
+	sqe->off = off;
+	sqe->len = len;
+	sqe->fadvise_advice = advice;
+	if (u->features & IORING_FEAT_CQE_SKIP)
+		sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
+	return 0;
+}
+
+// start a one-shot timer: rhandler() is called with -ETIME result when it expires.
+// `ts` must stay valid until the request is submitted.
+static int kq_uring_timeout(struct kq_uring *u, struct context *obj, struct __kernel_timespec *ts)
+{
+	struct io_uring_sqe *sqe = kq_uring_sqe(u, obj, KQ_URING_R);
+	if (sqe == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (size_t)ts;
+	sqe->len = 1;
+	return 0;
+}
+
+// cancel the object's operation associated with the handler:
+//  the handler is called with -ECANCELED result.
+// The cancellation request itself doesn't produce any events.
+static int kq_uring_cancel(struct kq_uring *u, struct context *obj, enum KQ_URING_DIR dir)
+{
+	struct io_uring_sqe *sqe = kq_uring_sqe(u, NULL, 0);
+	if (sqe == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (size_t)obj | kq_obj_flag(obj) | dir;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+	if (u->features & IORING_FEAT_CQE_SKIP)
+		sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
+	return 0;
+}
+
+// cancel all object's operations, close its descriptor and schedule the object for releasing.
+// Its memory is freed only after the kernel has completed all its operations.
+static void kq_uring_retire(struct kq_uring *u, struct context *obj)
+{
+	if (obj->inflight != 0) {
+		// closing the descriptor doesn't cancel the requests which are already in the kernel
+		kq_uring_cancel(u, obj, KQ_URING_R);
+		kq_uring_cancel(u, obj, KQ_URING_W);
+	}
+	if (obj->fd != -1) {
+		close(obj->fd);
+		obj->fd = -1;
+	}
+	// the completions of the cancelled operations won't be passed to the handlers
+	kq_obj_retire(&u->retired, obj);
+}
+
+// readiness mode: submit the multishot poll request for the events the object is attached for
+static int kq_uring_poll_add(struct kq_uring *u, struct context *obj)
+{
+	struct io_uring_sqe *sqe = kq_uring_sqe(u, obj, KQ_URING_POLL);
+	if (sqe == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = obj->fd;
+	sqe->poll32_events = obj->kq_events;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	return 0;
+}
+
+// readiness mode: attach object's descriptor for READ and WRITE events
+static int kq_uring_attach(struct kq_uring *u, struct context *obj, int read_only)
+{
+	obj->kq_events = POLLIN | ((read_only) ? 0 : POLLOUT);
+	return kq_uring_poll_add(u, obj);
+}
+
+// readiness mode: must be called before the object's descriptor is closed
+static void kq_uring_detach(struct kq_uring *u, struct context *obj)
+{
+	obj->kq_events = 0; // don't arm it again
+	if (obj->inflight != 0)
+		kq_uring_cancel(u, obj, KQ_URING_POLL);
+}
+
+// process all completions which are in the ring
+// st: record the statistics;  NULL: don't
+static void kq_uring_dispatch(struct kq_uring *u, struct kq_stats *st)
+{
+	unsigned head = *u->cq_head;
+	while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+		size_t ud = cqe->user_data;
+		int res = cqe->res;
+		unsigned flags = cqe->flags;
+		// release the slot now: the handler may submit new requests
+		__atomic_store_n(u->cq_head, ++head, __ATOMIC_RELEASE);
+
+		struct context *o = (void*)(ud & ~(size_t)7);
+		if (o == NULL)
+			continue; // request without an object, e.g. cancellation
+
+		if (!(flags & IORING_CQE_F_MORE))
+			o->inflight--; // the kernel won't return more completions for this request
+
+		unsigned flag = ud & 1;
+		if (flag != kq_obj_flag(o))
+			continue; // the object was closed
+
+		if (ud & KQ_URING_POLL) {
+			void *ptr = (void*)(ud & ~(size_t)6);
+			if (res == -ECANCELED)
+				continue; // the object was detached
+			if (res < 0)
+				kq_stats_handle(st, ptr, 1, 1); // let the handlers get the error
+			else
+				kq_stats_handle(st, ptr
+					, res & (POLLIN | POLLERR | POLLHUP)
+					, res & (POLLOUT | POLLERR | POLLHUP));
+			// the multishot poll request may be stopped by the kernel, e.g. on overflow or an error:
+			//  arm it again for the same events unless the handler has closed the object
+			if (!(flags & IORING_CQE_F_MORE) && flag == kq_obj_flag(o) && o->kq_events != 0)
+				kq_uring_poll_add(u, o);
+			continue;
+		}
+
+		o->result = res;
+		o->result_flags = flags;
+		void (*handler)(struct context*) = (ud & KQ_URING_W) ? o->whandler : o->rhandler;
+		if (handler == NULL)
+			continue;
+		if (st != NULL)
+			kq_stats_call(st, handler, o);
+		else
+			kq_obj_call(handler, o);
+	}
+}
+
+// submit the queued requests, wait for at least 1 completion and process all completions
+// timeout_ms: -1: wait indefinitely
+// st: record the statistics;  NULL: don't
+static int kq_uring_wait(struct kq_uring *u, int timeout_ms, struct kq_stats *st)
+{
+	int r;
+	if (timeout_ms < 0 || !(u->features & IORING_FEAT_EXT_ARG)) {
+		r = io_uring_enter(u->fd, u->to_submit, 1, IORING_ENTER_GETEVENTS);
+	} else {
+		struct __kernel_timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000 };
+		struct io_uring_getevents_arg arg = {};
+		arg.ts = (size_t)&ts;
+		r = io_uring_enter2(u->fd, u->to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	}
+	if (st != NULL)
+		kq_stats_woken(st, __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) - *u->cq_head);
+	kq_trace_wake(__atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) - *u->cq_head);
+	if (r < 0) {
+		if (errno != ETIME && errno != EBUSY && errno != EAGAIN)
+			return -1;
+		// ETIME: timeout expired
+		// EBUSY, EAGAIN: the completion ring is full, process it first
+	} else {
+		u->to_submit -= r;
+	}
+
+	kq_uring_dispatch(u, st);
+	return 0;
+}
+
+// submit requests and process completions until kq_uring_stop() is called
+static int kq_uring_run(struct kq_uring *u)
+{
+	while (!u->quit) {
+		// submit the queued requests and wait for at least 1 completion with a single syscall
+		if (0 != kq_uring_wait(u, -1, NULL) && errno != EINTR)
+			return -1;
+		kq_obj_release_retired(&u->retired);
+	}
+	return 0;
+}
+
+static void kq_uring_stop(struct kq_uring *u)
+{
+	u->quit = 1;
+}
+
+
+// a ring of fixed-size buffers provided to the kernel for multishot receiving.
+// The buffers are either allocated by the ring itself or taken from a pool (kq-bufpool.h);
+//  in the latter case the user may keep a received buffer with kq_uring_buf_take().
+struct kq_uring_bufs {
+	struct io_uring_buf_ring *ring;
+	char **bufs; // buffer ID -> address
+	char *mem; // own memory; NULL: the buffers are from the pool
+	struct kq_bufpool *pool;
+	unsigned n, size, mask;
+	unsigned short bgid;
+	size_t ring_size;
+};
+
+static int kq_uring_bufs_register(struct kq_uring *u, struct kq_uring_bufs *b, unsigned short bgid, unsigned n)
+{
+	b->ring_size = n * sizeof(struct io_uring_buf);
+	b->ring = mmap(NULL, b->ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (b->ring == MAP_FAILED)
+		return -1;
+	b->n = n;
+	b->mask = n - 1;
+	b->bgid = bgid;
+
+	struct io_uring_buf_reg reg = {};
+	reg.ring_addr = (size_t)b->ring;
+	reg.ring_entries = n;
+	reg.bgid = bgid;
+	if (0 != io_uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+		munmap(b->ring, b->ring_size);
+		return -1;
+	}
+
+	for (unsigned i = 0;  i != n;  i++) {
+		struct io_uring_buf *buf = &b->ring->bufs[i];
+		buf->addr = (size_t)b->bufs[i];
+		buf->len = b->size;
+		buf->bid = i;
+	}
+	__atomic_store_n(&b->ring->tail, n, __ATOMIC_RELEASE);
+	return 0;
+}
+
+// n: number of buffers (power of 2)
+static int kq_uring_bufs_create(struct kq_uring *u, struct kq_uring_bufs *b, unsigned short bgid, unsigned n, unsigned size)
+{
+	b->pool = NULL;
+	b->size = size;
+	b->bufs = malloc(n * sizeof(char*));
+	b->mem = malloc((size_t)n * size);
+	if (b->bufs == NULL || b->mem == NULL)
+		goto err;
+	for (unsigned i = 0;  i != n;  i++) {
+		b->bufs[i] = b->mem + (size_t)i * size;
+	}
+
+	if (0 != kq_uring_bufs_register(u, b, bgid, n))
+		goto err;
+	return 0;
+
+err:
+	free(b->bufs);
+	free(b->mem);
+	return -1;
+}
+
+// take n buffers (power of 2) from the pool
+static int kq_uring_bufs_create_pool(struct kq_uring *u, struct kq_uring_bufs *b, unsigned short bgid, unsigned n, struct kq_bufpool *pool)
+{
+	b->pool = pool;
+	b->mem = NULL;
+	b->size = pool->size;
+	b->bufs = calloc(n, sizeof(char*));
+	if (b->bufs == NULL)
+		return -1;
+	for (unsigned i = 0;  i != n;  i++) {
+		if (NULL == (b->bufs[i] = kq_bufpool_get(pool)))
+			goto err;
+	}
+
+	if (0 != kq_uring_bufs_register(u, b, bgid, n))
+		goto err;
+	return 0;
+
+err:
+	for (unsigned i = 0;  i != n && b->bufs[i] != NULL;  i++) {
+		kq_bufpool_put(pool, b->bufs[i]);
+	}
+	free(b->bufs);
+	return -1;
+}
+
+static void kq_uring_bufs_close(struct kq_uring *u, struct kq_uring_bufs *b)
+{
+	struct io_uring_buf_reg reg = {};
+	reg.bgid = b->bgid;
+	io_uring_register(u->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+	if (b->pool != NULL) {
+		for (unsigned i = 0;  i != b->n;  i++) {
+			kq_bufpool_put(b->pool, b->bufs[i]);
+		}
+	}
+	free(b->bufs);
+	free(b->mem);
+	munmap(b->ring, b->ring_size);
+}
+
+// get the buffer ID selected by the kernel for the completed operation; -1: no buffer
+static inline int kq_uring_buf_id(const struct context *obj)
+{
+	if (!(obj->result_flags & IORING_CQE_F_BUFFER))
+		return -1;
+	return obj->result_flags >> IORING_CQE_BUFFER_SHIFT;
+}
+
+static inline char* kq_uring_buf(struct kq_uring_bufs *b, unsigned id)
+{
+	return b->bufs[id];
+}
+
+// give the buffer back to the kernel
+static void kq_uring_buf_put(struct kq_uring_bufs *b, unsigned id)
+{
+	unsigned short tail = b->ring->tail;
+	struct io_uring_buf *buf = &b->ring->bufs[tail & b->mask];
+	buf->addr = (size_t)kq_uring_buf(b, id);
+	buf->len = b->size;
+	buf->bid = id;
+	__atomic_store_n(&b->ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// keep the received data without copying: the buffer is detached from the ring,
+//  and a new buffer from the pool is given to the kernel in its place.
+// The caller returns the buffer to the pool with kq_bufpool_put().
+// NULL: the ring doesn't use a pool, or the pool is empty: copy the data and call kq_uring_buf_put()
+static char* kq_uring_buf_take(struct kq_uring_bufs *b, unsigned id)
+{
+	if (b->pool == NULL)
+		return NULL;
+	char *nbuf = kq_bufpool_get(b->pool);
+	if (nbuf == NULL)
+		return NULL;
+	char *buf = b->bufs[id];
+	b->bufs[id] = nbuf;
+	kq_uring_buf_put(b, id);
+	return buf;
+}
@@ -0,0 +1,394 @@
+/* Kernel Queue The Complete Guide: kq.h: Reusable event loop
+A single-threaded reactor built from the examples' `struct context` pattern:
+ each object has a descriptor and READ/WRITE handlers which are called by the loop.
+Handlers must always read or write until EAGAIN: KQ signals only the changes of the descriptor state.
+Timers (kq-timer.h) don't use any descriptors: the loop waits for events no longer than until the nearest timer expires.
+Other threads pass tasks to the loop via a lock-free queue (kq-post.h).
+The loop can record what it's doing: events per wakeup, time blocked and running, handler durations (kq-stats.h).
+USDT probes and the per-thread trace ring show each wakeup, handler call and close (kq-trace.h).
+A handler which has more work to do but has used up its budget calls kq_yield():
+ the loop calls it again after the other objects have processed their events.
+
+Backends:
+	KQ_EPOLL  epoll (kq-epoll.h)
+	KQ_URING  io_uring in readiness mode (kq-uring.h)
+	KQ_POLL   poll() (kq-poll.h), for reference and testing
+
+Define KQ_BACKEND to choose which backends are compiled in (default: KQ_EPOLL).
+With exactly one backend every call is resolved at compile time.
+With several backends (e.g. -DKQ_BACKEND=KQ_ANY) the backend is chosen by kq_create_backend() at startup,
+ and the calls are dispatched with a switch on the backend type - there are no function pointers.
+*/
+#pragma once
+#include "kq-context.h"
+#include "kq-timer.h"
+#include "kq-post.h"
+#include "kq-stats.h"
+#include <string.h>
+
+#define KQ_EPOLL  1
+#define KQ_URING  2
+#define KQ_POLL  4
+#define KQ_ANY  (KQ_EPOLL | KQ_URING | KQ_POLL)
+
+#ifndef KQ_BACKEND
+	#define KQ_BACKEND  KQ_EPOLL
+#endif
+
+#if KQ_BACKEND & KQ_EPOLL
+	#include "kq-epoll.h"
+#endif
+#if KQ_BACKEND & KQ_URING
+	#include "kq-uring.h"
+#endif
+#if KQ_BACKEND & KQ_POLL
+	#include "kq-poll.h"
+#endif
+
+enum {
+	KQ_EVENTS_DEFAULT = 256,
+};
+
+struct kq_loop {
+	unsigned backend; // KQ_EPOLL, KQ_URING, KQ_POLL
+	int quit;
+
+	// objects which were closed during the current iteration;
+	//  their memory stays valid until all received events are processed
+	struct context *retired;
+
+	struct kq_timer_wheel timers;
+	struct kq_post *post; // tasks from other threads; NULL: disabled
+	struct kq_stats *stats; // NULL: disabled
+
+	// objects which have yielded
+	struct context *ready, **ready_last;
+
+#if KQ_BACKEND & KQ_EPOLL
+	struct kq_epoll epoll;
+#endif
+#if KQ_BACKEND & KQ_URING
+	struct kq_uring uring;
+#endif
+#if KQ_BACKEND & KQ_POLL
+	struct kq_poll poll;
+#endif
+};
+
+static inline unsigned kq_backend(const struct kq_loop *loop)
+{
+#if KQ_BACKEND == KQ_EPOLL || KQ_BACKEND == KQ_URING || KQ_BACKEND == KQ_POLL
+	return KQ_BACKEND; // constant: the compiler removes all other switch branches
+#else
+	return loop->backend;
+#endif
+}
+
+static inline const char* kq_backend_name(unsigned backend)
+{
+	switch (backend) {
+	case KQ_EPOLL: return "epoll";
+	case KQ_URING: return "io_uring";
+	case KQ_POLL: return "poll";
+	}
+	return "";
+}
+
+// get backend by name; 0: not compiled in
+static inline unsigned kq_backend_by_name(const char *name)
+{
+	for (unsigned b = 1;  b & KQ_ANY;  b <<= 1) {
+		if ((b & KQ_BACKEND) && !strcmp(name, kq_backend_name(b)))
+			return b;
+	}
+	return 0;
+}
+
+// backend: KQ_EPOLL, KQ_URING, KQ_POLL; 0: default (the first compiled in)
+// nevents: max. number of events to receive per one syscall; 0: default
+static int kq_create_backend(struct kq_loop *loop, unsigned backend, unsigned nevents)
+{
+	if (backend == 0)
+		backend = KQ_BACKEND & -KQ_BACKEND; // lowest bit
+	if (!(backend & KQ_BACKEND)) {
+		errno = ENOSYS;
+		return -1;
+	}
+	if (nevents == 0)
+		nevents = KQ_EVENTS_DEFAULT;
+	loop->backend = backend;
+	loop->quit = 0;
+	loop->retired = NULL;
+	loop->post = NULL;
+	loop->stats = NULL;
+	loop->ready = NULL;
+	loop->ready_last = &loop->ready;
+	kq_timer_wheel_init(&loop->timers, kq_now_ms());
+
+	switch (kq_backend(loop)) {
+#if KQ_BACKEND & KQ_EPOLL
+	case KQ_EPOLL:
+		return kq_epoll_create(&loop->epoll, nevents);
+#endif
+#if KQ_BACKEND & KQ_URING
+	case KQ_URING:
+		return kq_uring_create(&loop->uring, nevents);
+#endif
+#if KQ_BACKEND & KQ_POLL
+	case KQ_POLL:
+		return kq_poll_create(&loop->poll);
+#endif
+	}
+	return -1;
+}
+
+static int kq_create(struct kq_loop *loop, unsigned nevents)
+{
+	return kq_create_backend(loop, 0, nevents);
+}
+
+static void kq_stats_disable(struct kq_loop *loop);
+
+static void kq_close(struct kq_loop *loop)
+{
+	kq_stats_disable(loop);
+	switch (kq_backend(loop)) {
+#if KQ_BACKEND & KQ_EPOLL
+	case KQ_EPOLL:
+		kq_epoll_close(&loop->epoll); break;
+#endif
+#if KQ_BACKEND & KQ_URING
+	case KQ_URING:
+		kq_uring_close(&loop->uring); break;
+#endif
+#if KQ_BACKEND & KQ_POLL
+	case KQ_POLL:
+		kq_poll_close(&loop->poll); break;
+#endif
+	}
+}
+
+// attach object's descriptor to KQ for both READ and WRITE events
+static inline int kq_attach(struct kq_loop *loop, struct context *obj)
+{
+	obj->loop = loop;
+	switch (kq_backend(loop)) {
+#if KQ_BACKEND & KQ_EPOLL
+	case KQ_EPOLL:
+		return kq_epoll_attach(&loop->epoll, obj);
+#endif
+#if KQ_BACKEND & KQ_URING
+	case KQ_URING:
+		return kq_uring_attach(&loop->uring, obj, 0);
+#endif
+#if KQ_BACKEND & KQ_POLL
+	case KQ_POLL:
+		return kq_poll_attach(&loop->poll, obj);
+#endif
+	}
+	return -1;
+}
+
+// attach a listening socket for READ events.
+// exclusive: the socket is attached to several KQ objects (one per thread),
+//  and the kernel should wake up only one of the threads waiting for it (epoll only)
+static inline int kq_attach_listener(struct kq_loop *loop, struct context *obj, int exclusive)
+{
+	obj->loop = loop;
+	switch (kq_backend(loop)) {
+#if KQ_BACKEND & KQ_EPOLL
+	case KQ_EPOLL:
+		return kq_epoll_attach_listener(&loop->epoll, obj, exclusive);
+#endif
+#if KQ_BACKEND & KQ_URING
+	case KQ_URING:
+		return kq_uring_attach(&loop->uring, obj, 1);
+#endif
+#if KQ_BACKEND & KQ_POLL
+	case KQ_POLL:
+		return kq_poll_attach(&loop->poll, obj);
+#endif
+	}
+	return -1;
+}
+
+// stop receiving events for the object's descriptor without closing it
+static int kq_detach(struct kq_loop *loop, struct context *obj)
+{
+	switch (kq_backend(loop)) {
+#if KQ_BACKEND & KQ_EPOLL
+	case KQ_EPOLL:
+		return epoll_ctl(loop->epoll.fd, EPOLL_CTL_DEL, obj->fd, NULL);
+#endif
+#if KQ_BACKEND & KQ_URING
+	case KQ_URING:
+		kq_uring_detach(&loop->uring, obj);
+		return 0;
+#endif
+#if KQ_BACKEND & KQ_POLL
+	case KQ_POLL:
+		kq_poll_detach(&loop->poll, obj);
+		return 0;
+#endif
+	}
+	return -1;
+}
+
+// close object's descriptor and schedule the object for releasing.
+// The object won't receive any more events, but its memory is freed only after the current iteration,
+//  because there may be more cached events for it.
+static void kq_retire(struct kq_loop *loop, struct context *obj)
+{
+	KQ_PROBE2(close, obj, obj->fd);
+	kq_trace_add(KQ_TRACE_CLOSE, obj, obj->fd, obj->gen, 0);
+	if (obj->fd != -1) {
+		if (kq_backend(loop) != KQ_EPOLL)
+			kq_detach(loop, obj);
+		close(obj->fd); // epoll detaches the descriptor automatically
+		obj->fd = -1;
+	}
+	kq_obj_retire(&loop->retired, obj);
+}
+
+// receive events and call the handlers
+// timeout_ms: -1: wait indefinitely
+static inline int kq_wait(struct kq_loop *loop, int timeout_ms)
+{
+	switch (kq_backend(loop)) {
+#if KQ_BACKEND & KQ_EPOLL
+	case KQ_EPOLL:
+		return kq_epoll_wait(&loop->epoll, timeout_ms, loop->stats);
+#endif
+#if KQ_BACKEND & KQ_URING
+	case KQ_URING:
+		return kq_uring_wait(&loop->uring, timeout_ms, loop->stats);
+#endif
+#if KQ_BACKEND & KQ_POLL
+	case KQ_POLL:
+		return kq_poll_wait(&loop->poll, timeout_ms, loop->stats);
+#endif
+	}
+	return -1;
+}
+
+// start the timer or restart it if it's already active.
+// The handler is called by kq_run() after interval_ms.
+static inline void kq_timer_add(struct kq_loop *loop, struct kq_timer *t, unsigned interval_ms)
+{
+	kq_timer_start(&loop->timers, t, interval_ms);
+}
+
+static inline void kq_timer_remove(struct kq_loop *loop, struct kq_timer *t)
+{
+	kq_timer_stop(&loop->timers, t);
+}
+
+// call the object's handler (dir: KQ_READY_R or KQ_READY_W) again after the current events are processed.
+// In edge-triggered mode KQ doesn't signal again until the handler reads or writes until EAGAIN,
+//  so a handler which stops earlier to let the other objects run must remember it this way.
+static inline void kq_yield(struct kq_loop *loop, struct context *obj, unsigned dir)
+{
+	if (obj->ready == 0) {
+		obj->next_ready = NULL;
+		*loop->ready_last = obj;
+		loop->ready_last = &obj->next_ready;
+	}
+	obj->ready |= dir;
+}
+
+// call the handlers of the objects which have yielded;
+//  the objects which yield again are processed on the next iteration
+static void kq_ready_process(struct kq_loop *loop)
+{
+	struct context *obj = loop->ready;
+	loop->ready = NULL;
+	loop->ready_last = &loop->ready;
+	while (obj != NULL) {
+		struct context *next = obj->next_ready;
+		unsigned dir = obj->ready;
+		obj->ready = 0;
+		// the object may have been closed: then its handlers are NULL
+		kq_stats_handle(loop->stats, kq_obj_ptr(obj), dir & KQ_READY_R, dir & KQ_READY_W);
+		obj = next;
+	}
+}
+
+// allow other threads to pass tasks to the loop with kq_post(q, task)
+static int kq_post_enable(struct kq_loop *loop, struct kq_post *q)
+{
+	if (0 != kq_post_create(q))
+		return -1;
+	// eventfd is only ever read: attach it like a listening socket
+	if (0 != kq_attach_listener(loop, &q->obj, 0)) {
+		kq_post_close(q);
+		return -1;
+	}
+	loop->post = q;
+	if (loop->stats != NULL)
+		kq_stats_name(loop->stats, kq_post_read, "kq_post_read");
+	return 0;
+}
+
+static void kq_post_disable(struct kq_loop *loop)
+{
+	struct kq_post *q = loop->post;
+	if (q == NULL)
+		return;
+	kq_detach(loop, &q->obj);
+	kq_post_close(q);
+	loop->post = NULL;
+}
+
+// process events, tasks and timers until kq_stop() is called
+static int kq_run(struct kq_loop *loop)
+{
+	while (!loop->quit) {
+		int timeout_ms = kq_timer_next(&loop->timers); // -1: no timers, wait indefinitely
+		if (loop->ready != NULL)
+			timeout_ms = 0; // some objects have more work to do: just check for events
+		else if (loop->post != NULL && !kq_post_sleep(loop->post))
+			timeout_ms = 0; // there are tasks already: just check for events
+
+		kq_stats_wait(loop->stats);
+		kq_trace_wait(timeout_ms);
+		int r = kq_wait(loop, timeout_ms);
+		if (loop->post != NULL)
+			kq_post_awake(loop->post);
+		if (r < 0 && errno != EINTR)
+			return -1; // EINTR: interrupted when UNIX signal is received
+
+		kq_ready_process(loop);
+		if (loop->post != NULL)
+			kq_post_process(loop->post);
+		kq_timer_process(&loop->timers, kq_now_ms());
+		kq_obj_release_retired(&loop->retired);
+		kq_stats_done(loop->stats);
+	}
+	return 0;
+}
+
+// start recording the statistics (see kq-stats.h); call it from the loop's thread
+static int kq_stats_enable(struct kq_loop *loop)
+{
+	if (loop->stats != NULL)
+		return 0;
+	if (NULL == (loop->stats = malloc(sizeof(struct kq_stats))))
+		return -1;
+	kq_stats_init(loop->stats);
+	loop->timers.late = &loop->stats->timer_late_ms;
+	if (loop->post != NULL)
+		kq_stats_name(loop->stats, kq_post_read, "kq_post_read");
+	return 0;
+}
+
+static void kq_stats_disable(struct kq_loop *loop)
+{
+	loop->timers.late = NULL;
+	free(loop->stats);
+	loop->stats = NULL;
+}
+
+static void kq_stop(struct kq_loop *loop)
+{
+	loop->quit = 1;
+}
@@ -0,0 +1,106 @@
+/* Kernel Queue The Complete Guide: uring-connect.c: HTTP/1 client with io_uring
+Usage:
+	$ nc -l 127.0.0.1 64000
+	$ ./uring-connect
+*/
+#include <assert.h>
+#include <stdio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "kq-uring.h"
+
+struct kq_uring u;
+
+// the structure associated with a socket descriptor
+struct context obj;
+struct sockaddr_in addr;
+const char request[] = "GET / HTTP/1.1\r\nHost: hostname\r\nConnection: close\r\n\r\n";
+int data_offset;
+char data[64*1024];
+
+// the structure associated with a timer
+struct context timer;
+struct __kernel_timespec connect_timeout = { .tv_sec = 5 };
+
+void obj_sent(struct context *o);
+void obj_received(struct context *o);
+
+void timer_expired(struct context *t)
+{
+	if (t->result != -ETIME)
+		return; // the timer was cancelled
+
+	printf("Connection timed out\n");
+	kq_uring_cancel(&u, &obj, KQ_URING_W); // whandler will be called with -ECANCELED
+}
+
+void obj_connected(struct context *o)
+{
+	kq_uring_cancel(&u, &timer, KQ_URING_R);
+
+	if (o->result < 0) {
+		errno = -o->result;
+		perror("connect");
+		kq_uring_stop(&u);
+		return;
+	}
+	printf("Connected\n");
+
+	o->whandler = obj_sent;
+	kq_uring_send(&u, o, request, sizeof(request)-1);
+}
+
+void obj_sent(struct context *o)
+{
+	assert(o->result > 0);
+	data_offset += o->result;
+	if (data_offset != sizeof(request)-1) {
+		// we need to send the complete request
+		kq_uring_send(&u, o, request + data_offset, sizeof(request)-1 - data_offset);
+		return;
+	}
+
+	printf("Sent HTTP request.  Receiving HTTP response...\n");
+	kq_uring_recv(&u, o, data, sizeof(data));
+}
+
+void obj_received(struct context *o)
+{
+	if (o->result > 0) {
+		// received some data
+		printf("%.*s", o->result, data);
+		kq_uring_recv(&u, o, data, sizeof(data));
+		return;
+	}
+
+	// server has finished sending data, or an error occurred
+	kq_uring_stop(&u);
+}
+
+void main()
+{
+	assert(0 == kq_uring_create(&u, 64));
+
+	obj.fd = socket(AF_INET, SOCK_STREAM, 0);
+	assert(obj.fd != -1);
+	int val = 1;
+	assert(0 == setsockopt(obj.fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(int)));
+	obj.rhandler = obj_received;
+	obj.whandler = obj_connected;
+
+	addr.sin_family = AF_INET;
+	addr.sin_port = ntohs(64000);
+	char ip4[] = {127,0,0,1};
+	*(int*)&addr.sin_addr = *(int*)ip4;
+
+	// both requests are submitted with one syscall when the loop starts
+	assert(0 == kq_uring_connect(&u, &obj, (struct sockaddr*)&addr, sizeof(addr)));
+	timer.fd = -1;
+	timer.rhandler = timer_expired;
+	assert(0 == kq_uring_timeout(&u, &timer, &connect_timeout));
+
+	kq_uring_run(&u);
+
+	close(obj.fd);
+	kq_uring_close(&u);
+}
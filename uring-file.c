@@ -0,0 +1,156 @@
+/* Kernel Queue The Complete Guide: uring-file.c: Asynchronous reading of a buffered file with io_uring
+The whole file is read as a sequential stream with up to DEPTH reads in flight (kq-file.h).
+The file is opened without O_DIRECT, so the data from the page cache is returned immediately,
+ and the buffer, offset and size don't need any alignment.
+The loop itself may use any backend: io_uring signals file read completions via eventfd.
+Usage:
+	$ ./uring-file [-d DEPTH] [-s BLOCK] [-r READAHEAD_KB] [-t THREADS] [-n] [-b BACKEND] FILE
+Options:
+	-s BLOCK    read size in bytes (default: 65536)
+	-r KB       request the data in advance this far ahead of the reads (default: 2048); 0: disable
+	-t THREADS  worker threads for the reads if io_uring isn't available (default: 4); 0: read synchronously
+	-n          don't use io_uring
+*/
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "kq-file.h"
+
+struct kq_loop loop;
+struct kq_file file;
+struct kq_file_stream stream;
+uint64_t size, next_off, total, checksum;
+unsigned block, active;
+
+struct stream_req {
+	struct kq_file_req req;
+	unsigned char *buf;
+};
+
+void stream_read_done(struct kq_file_req *r);
+
+// read the next block with this request, or finish
+void stream_next(struct stream_req *s)
+{
+	if (next_off >= size) {
+		if (--active == 0)
+			kq_stop(&loop);
+		return;
+	}
+	s->req.handler = stream_read_done;
+	assert(0 == kq_file_stream_read(&file, &stream, &s->req, s->buf, block, next_off));
+	next_off += block;
+}
+
+void stream_read_done(struct kq_file_req *r)
+{
+	struct stream_req *s = (void*)r;
+	if (r->result < 0) {
+		errno = r->error;
+		perror("read");
+		exit(1);
+	}
+	// the blocks complete in any order: use the checksum which doesn't depend on it
+	for (ssize_t i = 0;  i != r->result;  i++) {
+		checksum += s->buf[i];
+	}
+	total += r->result;
+	stream_next(s);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned depth = 16, backend = 0, nthreads = 4, use_uring = 1, ra_kb = 2048;
+	block = 64*1024;
+	int opt;
+	while (-1 != (opt = getopt(argc, argv, "d:s:r:t:nb:"))) {
+		switch (opt) {
+		case 'd':
+			depth = atoi(optarg); break;
+		case 's':
+			block = atoi(optarg); break;
+		case 'r':
+			ra_kb = atoi(optarg); break;
+		case 't':
+			nthreads = atoi(optarg); break;
+		case 'n':
+			use_uring = 0; break;
+		case 'b':
+			if (0 == (backend = kq_backend_by_name(optarg))) {
+				fprintf(stderr, "Unsupported backend: %s\n", optarg);
+				return 1;
+			}
+			break;
+		default:
+			optind = argc;
+		}
+	}
+	if (optind != argc - 1 || depth == 0 || block == 0) {
+		fprintf(stderr, "Usage: %s [-d DEPTH] [-s BLOCK] [-r READAHEAD_KB] [-t THREADS] [-n] [-b BACKEND] FILE\n", argv[0]);
+		return 1;
+	}
+
+	int fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		perror(argv[optind]);
+		return 1;
+	}
+	struct stat st;
+	assert(0 == fstat(fd, &st));
+	size = st.st_size;
+
+	assert(0 == kq_create_backend(&loop, backend, 0));
+	assert(0 == kq_file_create(&file, &loop, (use_uring) ? depth * 2 : 0));
+	file.ra_window = ra_kb * 1024;
+	struct kq_post q;
+	struct kq_offload pool;
+	if (!file.uring && nthreads != 0) {
+		// the workers post completions to the loop's task queue
+		assert(0 == kq_post_enable(&loop, &q));
+		assert(0 == kq_offload_create(&pool, nthreads));
+		file.pool = &pool;
+	}
+	kq_file_stream_init(&file, &stream, fd);
+
+	unsigned long long start = kq_now_ms();
+	struct stream_req *reqs = calloc(depth, sizeof(struct stream_req));
+	assert(reqs != NULL);
+	for (unsigned i = 0;  i != depth;  i++) {
+		reqs[i].buf = malloc(block);
+		assert(reqs[i].buf != NULL);
+	}
+	for (unsigned i = 0;  i != depth && next_off < size;  i++) {
+		active++;
+		stream_next(&reqs[i]);
+	}
+	kq_file_submit(&file);
+
+	if (active == 0)
+		kq_stop(&loop); // empty file, or all reads were performed synchronously
+	assert(0 == kq_run(&loop));
+	unsigned long long ms = kq_now_ms() - start;
+	assert(total == size);
+
+	printf("%s: %llu bytes in %llums: %.1fMB/s, checksum: %llu\n"
+		, argv[optind], (unsigned long long)total, ms, (double)total / (ms ? ms : 1) / 1000
+		, (unsigned long long)checksum);
+	printf("%s: reads: %llu, io_uring_enter() calls: %llu, eventfd signals: %llu, readahead requests: %llu, worker threads: %llu, synchronous: %llu\n"
+		, (file.uring) ? "io_uring" : "no io_uring"
+		, file.nreads, file.nsubmits, file.nwakeups, file.nadvise, file.noffload, file.nsync);
+
+	if (file.pool != NULL) {
+		kq_offload_close(&pool);
+		kq_post_disable(&loop);
+	}
+	kq_file_close(&file);
+	kq_close(&loop);
+	for (unsigned i = 0;  i != depth;  i++) {
+		free(reqs[i].buf);
+	}
+	free(reqs);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,196 @@
+/* Kernel Queue The Complete Guide: uring-server.c: HTTP/1 server with io_uring
+One multishot accept request accepts all connections,
+ one multishot recv request per connection receives all data into the buffers provided to the kernel.
+All new requests are submitted together with waiting for completions, in one io_uring_enter() call.
+Usage:
+	$ ./uring-server
+	$ curl 127.0.0.1:64000/ 127.0.0.1:64000/
+*/
+#define _GNU_SOURCE
+#include <assert.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "kq-uring.h"
+
+struct kq_uring u;
+struct kq_uring_bufs bufs;
+enum { BUF_GROUP = 1 };
+
+#define RESPONSE "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nHello"
+enum { RESPONSES_MAX = 64 };
+// several responses in a row, so pipelined requests are answered with one send request
+char responses[RESPONSES_MAX * (sizeof(RESPONSE)-1)];
+
+unsigned long long nrequests;
+
+struct conn {
+	struct context obj; // must be the first member
+	unsigned crlf; // the number of bytes of "\r\n\r\n" matched at the end of the last received chunk
+	unsigned pending; // requests which weren't answered yet
+	const char *out;
+	size_t out_len;
+};
+
+void conn_send_next(struct conn *c);
+
+void conn_release(struct context *obj)
+{
+	free(obj);
+}
+
+// count the complete requests (terminated by an empty line) in the received data
+unsigned count_requests(struct conn *c, const char *d, size_t n)
+{
+	static const char term[] = "\r\n\r\n";
+	unsigned k = 0;
+	for (size_t i = 0;  i != n;  i++) {
+		if (d[i] == term[c->crlf]) {
+			if (++c->crlf == 4) {
+				c->crlf = 0;
+				k++;
+			}
+		} else {
+			c->crlf = (d[i] == '\r') ? 1 : 0;
+		}
+	}
+	return k;
+}
+
+// rhandler: data received
+void conn_recv(struct context *obj)
+{
+	struct conn *c = (struct conn*)obj;
+	if (obj->result == -ENOBUFS) {
+		// all provided buffers are in use, multishot request has been stopped
+		if (!(obj->result_flags & IORING_CQE_F_MORE))
+			kq_uring_recv_multishot(&u, obj, BUF_GROUP);
+		return;
+	}
+	if (obj->result <= 0) {
+		// client has finished sending data, or an error occurred
+		kq_uring_retire(&u, obj);
+		return;
+	}
+
+	int id = kq_uring_buf_id(obj);
+	unsigned k = count_requests(c, kq_uring_buf(&bufs, id), obj->result);
+	kq_uring_buf_put(&bufs, id); // the data is processed, the kernel may use this buffer again
+	nrequests += k;
+
+	if (!(obj->result_flags & IORING_CQE_F_MORE))
+		kq_uring_recv_multishot(&u, obj, BUF_GROUP);
+
+	c->pending += k;
+	if (c->out_len == 0)
+		conn_send_next(c);
+}
+
+void conn_send_next(struct conn *c)
+{
+	if (c->pending == 0)
+		return;
+	unsigned k = (c->pending < RESPONSES_MAX) ? c->pending : RESPONSES_MAX;
+	c->pending -= k;
+	c->out = responses;
+	c->out_len = k * (sizeof(RESPONSE)-1);
+	kq_uring_send(&u, &c->obj, c->out, c->out_len);
+}
+
+// whandler: data sent
+void conn_sent(struct context *obj)
+{
+	struct conn *c = (struct conn*)obj;
+	if (obj->result < 0) {
+		kq_uring_retire(&u, obj);
+		return;
+	}
+
+	c->out += obj->result;
+	c->out_len -= obj->result;
+	if (c->out_len != 0) {
+		kq_uring_send(&u, obj, c->out, c->out_len); // send the rest
+		return;
+	}
+	conn_send_next(c);
+}
+
+// rhandler: new connection accepted
+void accept_handler(struct context *obj)
+{
+	if (!(obj->result_flags & IORING_CQE_F_MORE))
+		kq_uring_accept(&u, obj, 1); // multishot request has been stopped by the kernel
+
+	if (obj->result < 0)
+		return;
+
+	struct conn *c = calloc(1, sizeof(struct conn));
+	if (c == NULL) {
+		close(obj->result);
+		return;
+	}
+	c->obj.fd = obj->result;
+	c->obj.rhandler = conn_recv;
+	c->obj.whandler = conn_sent;
+	c->obj.release = conn_release;
+
+	int val = 1;
+	setsockopt(c->obj.fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+
+	kq_uring_recv_multishot(&u, &c->obj, BUF_GROUP);
+}
+
+struct __kernel_timespec stats_interval = { .tv_sec = 1 };
+
+// rhandler: timer expired
+void stats_handler(struct context *obj)
+{
+	static unsigned long long prev;
+	if (nrequests != prev) {
+		printf("requests/sec: %llu\n", nrequests - prev);
+		prev = nrequests;
+	}
+	kq_uring_timeout(&u, obj, &stats_interval);
+}
+
+int main()
+{
+	signal(SIGPIPE, SIG_IGN);
+	for (int i = 0;  i != RESPONSES_MAX;  i++) {
+		memcpy(responses + i * (sizeof(RESPONSE)-1), RESPONSE, sizeof(RESPONSE)-1);
+	}
+
+	assert(0 == kq_uring_create(&u, 4096));
+	assert(0 == kq_uring_bufs_create(&u, &bufs, BUF_GROUP, 4096, 4*1024));
+
+	// create and prepare a socket
+	struct context lobj = {};
+	lobj.rhandler = accept_handler;
+	lobj.fd = socket(AF_INET, SOCK_STREAM, 0);
+	assert(lobj.fd != -1);
+	int val = 1;
+	setsockopt(lobj.fd, SOL_SOCKET, SO_REUSEADDR, &val, 4);
+
+	struct sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = ntohs(64000);
+	assert(0 == bind(lobj.fd, (struct sockaddr*)&addr, sizeof(addr)));
+	assert(0 == listen(lobj.fd, SOMAXCONN));
+
+	assert(0 == kq_uring_accept(&u, &lobj, 1));
+
+	struct context timer = {};
+	timer.fd = -1;
+	timer.rhandler = stats_handler;
+	assert(0 == kq_uring_timeout(&u, &timer, &stats_interval));
+
+	printf("Listening on port 64000\n");
+	kq_uring_run(&u);
+
+	close(lobj.fd);
+	kq_uring_bufs_close(&u, &bufs);
+	kq_uring_close(&u);
+	return 0;
+}